@@ -23,6 +23,7 @@
 #define MEMORY_ACCESS_BYTECODES(_) \
 	_(mov,      "mov") \
 	_(fastmov,  "fastmov") \
+	_(force,    "force") /* force a parameter's frame slot */ \
 	_(dotdot,   "dotdot") \
 	_(assign,   "assign") \
 	_(assign2,  "assign2") \
@@ -138,6 +139,24 @@
 	_(cummin, "cummin",	UnifyScan,	pmin) \
 	_(cummax, "cummax",	UnifyScan,	pmax) \
 
+// Superinstructions picked by the compiler's peephole pass. Each one runs its
+// first op and, if that falls through, the op that follows it. The second op
+// stays in the instruction stream, so jump offsets don't change.
+#define FUSED_BYTECODES(_) \
+	_(ltjc, "ltjc", lt, jc) \
+	_(lejc, "lejc", le, jc) \
+	_(gtjc, "gtjc", gt, jc) \
+	_(gejc, "gejc", ge, jc) \
+	_(eqjc, "eqjc", eq, jc) \
+	_(neqjc, "neqjc", neq, jc) \
+	_(addassign, "addassign", add, assign) \
+	_(addmov, "addmov", add, fastmov) \
+
+// forend whose loop body starts with a subset
+#define SUPER_BYTECODES(_) \
+	FUSED_BYTECODES(_) \
+	_(forsubset, "forsubset", forend, subset) \
+
 #define SPECIAL_BYTECODES(_) 	\
 	_(done, "done") 
 
@@ -176,6 +195,7 @@
 	SCAN_BYTECODES(_) \
 	UTILITY_BYTECODES(_) \
 	SPECIAL_FOLD_BYTECODES(_) \
+	SUPER_BYTECODES(_) \
 
 #define BYTECODES(_) \
 	STANDARD_BYTECODES(_) \
@@ -200,13 +220,16 @@
 
 DECLARE_ENUM(ByteCode, BYTECODES)
 
+struct SymbolCache;
+
 struct Instruction {
 	int64_t a, b, c;
 	ByteCode::Enum bc;
 	mutable void const* ibc;
+	mutable SymbolCache* cache;	// lookup caches for symbol operands a, b, c; allocated on first use
 
 	Instruction(ByteCode::Enum bc, int64_t a=0, int64_t b=0, int64_t c=0) :
-		a(a), b(b), c(c), bc(bc), ibc(0) {}
+		a(a), b(b), c(c), bc(bc), ibc(0), cache(0) {}
 	
 	std::string regToStr(int64_t a) const {
 		//if(a <= 0) return intToStr(-a);
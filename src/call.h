@@ -5,6 +5,9 @@
 
 #ifdef USE_THREADED_INTERPRETER
 static const void** glabels = 0;
+#ifdef ENABLE_EPEE
+static const void* gjitloop = 0;
+#endif
 #endif
 
 static void printCode(Thread const& thread, Prototype const* prototype, Environment* env) {
@@ -51,6 +54,9 @@ static Instruction const* buildStackFrame(Thread& thread, Environment* environme
 			Instruction const& inst = prototype->bc[i];
 			inst.ibc = glabels[inst.bc];
 		}
+#ifdef ENABLE_EPEE
+		FindLoops(prototype, glabels, gjitloop);
+#endif
 	}
 #endif
 	return &(prototype->bc[0]);
@@ -120,9 +126,24 @@ static bool namedArguments(Environment* env, CompiledCall const& call) {
 	}
 }
 
-inline void argAssign(Thread& thread, Environment* env, Pair const& parameter, Pair const& argument) {
+// A parameter kept in a frame slot (see Compiler::compileFunctionBody) goes
+// straight into the new frame's register, missing or not. A promise there
+// holds the environment it's evaluated in rather than the callee's.
+inline void argAssign(Thread& thread, Environment const* caller, Environment* env, Value* slot, Pair const& parameter, Pair const& argument) {
 	Value w = argument.v;
-	if(!w.isNil()) {
+	if(slot != 0) {
+		if(w.isNil())
+			w = parameter.v;	// an empty argument leaves the default
+		if(w.isPromise()) {
+			assert(w.p == 0);
+			w.p = (Environment*)caller;
+		} else if(w.isDefault()) {
+			assert(w.p == 0);
+			w.p = env;
+		}
+		*slot = w;
+	}
+	else if(!w.isNil()) {
 		if(w.isPromise() || w.isDefault()) {
 			assert(w.p == 0);
 			w.p = env;
@@ -149,6 +170,13 @@ inline void dotAssign(Thread& thread, Environment* env, Pair const& argument) {
 	env->dots.push_back(p);
 }
 
+// where parameter i is bound once the callee's frame is built, 0 for its environment
+static Value* parameterSlot(Thread& thread, Prototype const* prototype, int64_t i) {
+	int64_t slot = prototype->parameterSlots[i];
+	return slot < 0 ? 0 : thread.base - (prototype->constants.size() + slot);
+}
+
+// Both matchers run with the callee's frame already built.
 static void MatchArgs(Thread& thread, Environment const* env, Environment* fenv, Function const& func, CompiledCall const& call) {
 	PairList const& parameters = func.prototype()->parameters;
 	PairList const& arguments = call.arguments;
@@ -158,7 +186,7 @@ static void MatchArgs(Thread& thread, Environment const* env, Environment* fenv,
 
 	// set parameters from arguments & defaults
 	for(int64_t i = 0; i < (int64_t)parameters.size(); i++) {
-		argAssign(thread, fenv, parameters[i], 
+		argAssign(thread, env, fenv, parameterSlot(thread, func.prototype(), i), parameters[i], 
 			(i < end && !arguments[i].v.isNil()) ? arguments[i] : parameters[i]);
 	}
 
@@ -186,7 +214,7 @@ static void MatchNamedArgs(Thread& thread, Environment* env, Environment* fenv,
 
 	// set defaults
 	for(int64_t i = 0; i < (int64_t)parameters.size(); ++i) {
-		argAssign(thread, fenv, parameters[i], parameters[i]);
+		argAssign(thread, env, fenv, parameterSlot(thread, func.prototype(), i), parameters[i], parameters[i]);
 	}
 
 	if(!named) {
@@ -196,7 +224,7 @@ static void MatchNamedArgs(Thread& thread, Environment* env, Environment* fenv,
 		int64_t end = std::min(numArgs, pDotIndex);
 		for(int64_t i = 0; i < end; ++i) {
 			Pair const& arg = argument(i, env, call);
-			argAssign(thread, fenv, parameters[i], arg);
+			argAssign(thread, env, fenv, parameterSlot(thread, func.prototype(), i), parameters[i], arg);
 		}
 
 		// if we have left over arguments, but no parameter dots, error
@@ -264,7 +292,7 @@ static void MatchNamedArgs(Thread& thread, Environment* env, Environment* fenv,
 		for(int64_t j = 0; j < (int64_t)parameters.size(); ++j) {
 			if(j != pDotIndex && set[j] >= 0) {
 				Pair const& arg = argument(set[j], env, call);
-				argAssign(thread, fenv, parameters[j], arg);
+				argAssign(thread, env, fenv, parameterSlot(thread, func.prototype(), j), parameters[j], arg);
 			}
 		}
 
@@ -294,10 +322,50 @@ static Environment* CreateEnvironment(Thread& thread, Environment* l, Environmen
 	return env;
 }
 
+// Frameless functions run in their closure's environment, everything else gets a new one.
+static Environment* FunctionEnvironment(Thread& thread, Function const& func, Environment* caller, Value const& call) {
+	if(func.prototype()->frameless)
+		return func.environment();
+	return CreateEnvironment(thread, func.environment(), caller, call);
+}
+
+// Set up a function's frame for FrameEnvironment, once buildStackFrame has pushed it.
+static void FunctionFrame(Thread& thread, Environment* caller, Value const& call) {
+	thread.frame.caller = caller;
+	thread.frame.call = call;
+}
+
+// The environment calls from the current frame run against. A frameless
+// frame gets its own on its first call: the callee's promises, parent.frame
+// and sys.call need it. The parameters promises read are copied in from
+// their slots. Promises and defaults not forced yet move over, and forceSlot
+// forces them there from then on, so neither is evaluated twice.
+static Environment* FrameEnvironment(Thread& thread) {
+	StackFrame& frame = thread.frame;
+	if(__builtin_expect(!frame.prototype->frameless || frame.caller == 0, true))
+		return frame.environment;
+	Prototype const* prototype = frame.prototype;
+	Environment* env = CreateEnvironment(thread, frame.environment, frame.caller, frame.call);
+	for(size_t i = 0; i < prototype->spills.size(); i++) {
+		int64_t k = prototype->spills[i];
+		Value w = *parameterSlot(thread, prototype, k);
+		if(w.isNil())
+			continue;	// missing, as if it had never been bound
+		if(w.isPromise() || w.isDefault())
+			w.p = env;	// a promise runs in env's caller, a default in env
+		env->insert(prototype->parameters[k].n) = w;
+		thread.traces.LiveEnvironment(env, w);
+	}
+	frame.environment = env;
+	frame.caller = 0;
+	return env;
+}
+
 static Instruction const* GenericDispatch(Thread& thread, Instruction const& inst, String op, Value const& a, int64_t out) {
 	Value const& f = thread.frame.environment->getRecursive(op);
 	if(f.isFunction()) {
-		Environment* fenv = CreateEnvironment(thread, ((Function const&)f).environment(), thread.frame.environment, Null::Singleton());
+		Environment* env = FrameEnvironment(thread);
+		Environment* fenv = FunctionEnvironment(thread, (Function const&)f, env, Null::Singleton());
 		List call(0);
 		Pair p;
 		p.n = Strings::empty;
@@ -305,8 +373,10 @@ static Instruction const* GenericDispatch(Thread& thread, Instruction const& ins
 		PairList args;
 		args.push_back(p);
 		CompiledCall cc(call, args, 1, false);
-		MatchArgs(thread, thread.frame.environment, fenv, ((Function const&)f), cc);
-		return buildStackFrame(thread, fenv, ((Function const&)f).prototype(), out, &inst+1);
+		Instruction const* pc = buildStackFrame(thread, fenv, ((Function const&)f).prototype(), out, &inst+1);
+		FunctionFrame(thread, env, Null::Singleton());
+		MatchArgs(thread, env, fenv, ((Function const&)f), cc);
+		return pc;
 	}
 	_error("Failed to find generic for builtin op");
 }
@@ -314,7 +384,8 @@ static Instruction const* GenericDispatch(Thread& thread, Instruction const& ins
 static Instruction const* GenericDispatch(Thread& thread, Instruction const& inst, String op, Value const& a, Value const& b, int64_t out) {
 	Value const& f = thread.frame.environment->getRecursive(op);
 	if(f.isFunction()) { 
-		Environment* fenv = CreateEnvironment(thread, ((Function const&)f).environment(), thread.frame.environment, Null::Singleton());
+		Environment* env = FrameEnvironment(thread);
+		Environment* fenv = FunctionEnvironment(thread, (Function const&)f, env, Null::Singleton());
 		List call(0);
 		PairList args;
 		Pair p;
@@ -324,8 +395,10 @@ static Instruction const* GenericDispatch(Thread& thread, Instruction const& ins
 		p.v = b;
 		args.push_back(p);
 		CompiledCall cc(call, args, 2, false);
-		MatchArgs(thread, thread.frame.environment, fenv, ((Function const&)f), cc);
-		return buildStackFrame(thread, fenv, ((Function const&)f).prototype(), out, &inst+1);
+		Instruction const* pc = buildStackFrame(thread, fenv, ((Function const&)f).prototype(), out, &inst+1);
+		FunctionFrame(thread, env, Null::Singleton());
+		MatchArgs(thread, env, fenv, ((Function const&)f), cc);
+		return pc;
 	}
 	_error("Failed to find generic for builtin op");
 }
@@ -334,6 +407,30 @@ Instruction const* forceDot(Thread& thread, Instruction const& inst, Value const
 
 Instruction const* forceReg(Thread& thread, Instruction const& inst, Value const* a, String name);
 
+// operand is 0, 1 or 2 for symbols in inst.a, inst.b or inst.c
+static __attribute__((noinline)) Value const& lookupEnclosing(Thread& thread, Instruction const& inst, int64_t operand, String name) {
+	Environment const* env = thread.frame.environment;
+	if(env->LexicalScope() == 0 || operand < 0 || operand > 2)
+		return env->getRecursive(name);
+	SymbolCache* c = inst.cache;
+	if(c == 0) {
+		c = new (GC) SymbolCache[3];
+		memset(c, 0, sizeof(SymbolCache)*3);
+		if(!__sync_bool_compare_and_swap(&inst.cache, (SymbolCache*)0, c))
+			c = inst.cache;
+	}
+	return env->getEnclosing(name, c[operand]);
+}
+
+static inline Value const& lookupSymbol(Thread& thread, Instruction const& inst, int64_t operand, String name) ALWAYS_INLINE;
+static inline Value const& lookupSymbol(Thread& thread, Instruction const& inst, int64_t operand, String name) {
+	bool success;
+	Value const& v = thread.frame.environment->getLocal(name, success);
+	if(__builtin_expect(success, true))
+		return v;
+	return lookupEnclosing(thread, inst, operand, name);
+}
+
 #define REGISTER(i) (*(thread.base+(i)))
 
 // Out register is currently always a register, not memory
@@ -342,7 +439,7 @@ Instruction const* forceReg(Thread& thread, Instruction const& inst, Value const
 #define OPERAND(a, i) \
 Value const& a = __builtin_expect((i) <= 0, true) ? \
 		*(thread.base+(i)) : \
-		thread.frame.environment->getRecursive((String)(i)); 
+		lookupSymbol(thread, inst, &(i) - (int64_t const*)&inst, (String)(i)); 
 	
 #define FORCE(a, i) \
 if(__builtin_expect((i) > 0 && !a.isConcrete(), false)) { \
@@ -381,9 +478,13 @@ if(__builtin_expect(a.isFuture(), false)) { \
 	return &inst; \
 }
 
+// Traces have no logical NA: a loaded NA would filter, fold and negate as
+// TRUE or FALSE depending on the op. So logicals holding one aren't traced,
+// and futures never hold one.
 bool isTraceableType(Thread const& thread, Value const& a) {
 	Type::Enum type = thread.traces.futureType(a);
-        return type == Type::Double || type == Type::Integer || type == Type::Logical;
+        return type == Type::Double || type == Type::Integer || 
+		(type == Type::Logical && (a.isFuture() || !HasNA(a)));
 }
 
 bool isTraceableShape(Thread const& thread, Value const& a) {
@@ -413,11 +514,61 @@ bool isTraceable(Thread const& thread, Value const& a, Value const& b) {
 		isTraceableShape(thread, a, b);
 }
 
+// Maps recycle the shorter operand, see Traces::isRecyclable
+bool isTraceableRecycled(Thread const& thread, Value const& a, Value const& b) {
+	IRNode::Shape const& shapea = thread.traces.futureShape(a);
+	IRNode::Shape const& shapeb = thread.traces.futureShape(b);
+	return	thread.state.jitEnabled &&
+		isTraceableType(thread, a) &&
+		isTraceableType(thread, b) &&
+		!shapea.blocking &&
+		!shapeb.blocking &&
+		(shapea.length >= TRACE_VECTOR_WIDTH || shapeb.length >= TRACE_VECTOR_WIDTH) &&
+		thread.traces.isRecyclable(a, b);
+}
+
+// Maps can also take single values already recorded in a trace, e.g. the
+// mean in x - mean(x). The trace runs in phases to compute them first.
+bool isTraceableScalar(Thread const& thread, Value const& a) {
+	return	thread.state.jitEnabled &&
+		isTraceableType(thread, a) &&
+		thread.traces.isScalarFuture(a);
+}
+
+bool isTraceableScalar(Thread const& thread, Value const& a, Value const& b) {
+	bool sa = thread.traces.isScalarFuture(a);
+	bool sb = thread.traces.isScalarFuture(b);
+	if(!thread.state.jitEnabled || !(sa || sb) ||
+		!isTraceableType(thread, a) || !isTraceableType(thread, b))
+		return false;
+	// the other operand has to be in the same trace or be a plain scalar
+	Value const& s = sa ? a : b;
+	Value const& o = sa ? b : a;
+	if(o.length == s.length)
+		return thread.traces.isScalarFuture(o) || !thread.traces.futureShape(o).blocking;
+	return !o.isFuture() && o.length == 1;
+}
+
 template< template<class X> class Group>
 bool isTraceable(Thread const& thread, Value const& a) { 
-	return 	isTraceable(thread, a);
+	return 	isTraceable(thread, a) || isTraceableScalar(thread, a);
 }
 
+template<>
+bool isTraceable<ArithFold>(Thread const& thread, Value const& a) { return isTraceable(thread, a); }
+
+template<>
+bool isTraceable<LogicalFold>(Thread const& thread, Value const& a) { return isTraceable(thread, a); }
+
+template<>
+bool isTraceable<UnifyFold>(Thread const& thread, Value const& a) { return isTraceable(thread, a); }
+
+template<>
+bool isTraceable<CountFold>(Thread const& thread, Value const& a) { return isTraceable(thread, a); }
+
+template<>
+bool isTraceable<MomentFold>(Thread const& thread, Value const& a) { return isTraceable(thread, a); }
+
 template<>
 bool isTraceable<ArithScan>(Thread const& thread, Value const& a) { return false; }
 
@@ -426,9 +577,15 @@ bool isTraceable<UnifyScan>(Thread const& thread, Value const& a) { return false
 
 template< template<class X, class Y> class Group>
 bool isTraceable(Thread const& thread, Value const& a, Value const& b) {
-	return  isTraceable(thread, a, b);
+	return  isTraceableRecycled(thread, a, b) || isTraceableScalar(thread, a, b);
 }
 
+template<>
+bool isTraceable<Moment2Fold>(Thread const& thread, Value const& a, Value const& b) { return isTraceable(thread, a, b) && a.length == b.length; }
+
+template<>
+bool isTraceable<Split>(Thread const& thread, Value const& a, Value const& b) { return isTraceable(thread, a, b) && a.length == b.length; }
+
 template< template<class X, class Y, class Z> class Group>
 bool isTraceable(Thread const& thread, Value const& a, Value const& b, Value const& c) {
 	return false;
@@ -441,7 +598,10 @@ bool isTraceable<IfElse>(Thread const& thread, Value const& a, Value const& b, V
 		isTraceableType(thread, b) &&
 		isTraceableType(thread, c) &&
 		isTraceableShape(thread, a, c) &&
-		isTraceableShape(thread, b, c);
+		isTraceableShape(thread, b, c) &&
+		a.length <= c.length && b.length <= c.length &&
+		thread.traces.isRecyclable(a, c) &&
+		thread.traces.isRecyclable(b, c);
 }
 
 #endif
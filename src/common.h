@@ -18,6 +18,7 @@
 #define GC_THREADS
 #include <gc/gc_cpp.h>
 #include <gc/gc_allocator.h>
+#include <gc/gc_typed.h>
 
 #ifdef __GNUC__
 	#define ALWAYS_INLINE __attribute__((always_inline))
@@ -33,6 +34,8 @@
 #endif
 
 #define USE_THREADED_INTERPRETER
+// count dispatches per opcode and report them at exit (make bench)
+//#define COUNT_DISPATCHES
 #define TIMING
 
 std::string rawToStr( unsigned char n );
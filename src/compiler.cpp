@@ -1,6 +1,8 @@
 
 #include "compiler.h"
 #include "runtime.h"
+#include <iterator>
+#include <string.h>
 
 static ByteCode::Enum op1(String const& func) {
 	if(func == Strings::add) return ByteCode::pos; 
@@ -137,6 +139,43 @@ static int64_t isDotDot(String s) {
 	return -1;	
 }
 
+static void symbols(Value const& expr, std::set<String>& out) {
+	if(isSymbol(expr)) {
+		out.insert(SymbolStr(expr));
+	}
+	else if(expr.isObject()) {
+		symbols(((Object const&)expr).base(), out);
+	}
+	else if(expr.isList()) {
+		List const& l = (List const&)expr;
+		for(int64_t i = 0; i < l.length; i++)
+			symbols(l[i], out);
+	}
+}
+
+// Functions that can see or hand out the calling environment. A body that
+// mentions any of these keeps all of its locals in the environment.
+static char const* const environmentFunctions[] = {
+	"function", "<<-", "eval", "evalq", "eval.parent", "local", "environment",
+	"parent.frame", "sys.call", "sys.function", "sys.frame", "alist",
+	"get", "exists", "assign", "substitute", "as.environment",
+	"UseMethod", "NextMethod", "on.exit", "browser", 0
+};
+
+static bool needsEnvironment(Value const& expr) {
+	std::set<String> names;
+	symbols(expr, names);
+	for(std::set<String>::const_iterator i = names.begin(); i != names.end(); ++i) {
+		for(char const* const* f = environmentFunctions; *f != 0; f++)
+			if(strcmp(*i, *f) == 0) return true;
+	}
+	return false;
+}
+
+void Compiler::escape(Value const& expr) {
+	symbols(expr, escaped);
+}
+
 Compiler::Operand Compiler::compileSymbol(Value const& symbol, Prototype* code) {
 	String s = SymbolStr(symbol);
 	
@@ -147,10 +186,35 @@ Compiler::Operand Compiler::compileSymbol(Value const& symbol, Prototype* code)
 		return t;
 	}
 	else {
+		std::map<String, int64_t>::const_iterator i = slots.find(s);
+		if(assigned.find(s) == assigned.end()) {
+			// a read that may happen before the local is assigned has to fall
+			// through to the enclosing scopes, so it can't come from a slot.
+			// Only a parameter gets here with a slot: it may still hold its
+			// promise, which is forced on the first read along every path.
+			if(i != slots.end()) {
+				emit(ByteCode::force, Operand(SLOT, i->second), Operand(MEMORY, s), 0);
+				assigned.insert(s);
+			}
+			else
+				escaped.insert(s);
+		}
+		if(i != slots.end())
+			return Operand(SLOT, i->second);
 		return Operand(MEMORY, s);
 	}
 }
 
+void Compiler::compileAssign(String name, Operand rhs) {
+	std::map<String, int64_t>::const_iterator i = slots.find(name);
+	if(i != slots.end())
+		emit(ByteCode::fastmov, rhs, 0, Operand(SLOT, i->second));
+	else
+		emit(ByteCode::assign, Operand(MEMORY, name), 0, rhs);
+	locals.insert(name);
+	assigned.insert(name);
+}
+
 Compiler::Operand Compiler::placeInRegister(Operand r) {
 	if(r.loc != REGISTER && r.loc != INVALID) {
 		kill(r);
@@ -183,6 +247,7 @@ CompiledCall Compiler::makeCall(List const& call, Character const& names) {
 			p.v = call[i];
 			dotIndex = i-1;
 		} else if(isCall(call[i]) || isSymbol(call[i])) {
+			symbols(call[i], promised);
 			Promise::Init(p.v, Compiler::compilePromise(thread, call[i]),NULL);
 		} else {
 			p.v = call[i];
@@ -194,6 +259,7 @@ CompiledCall Compiler::makeCall(List const& call, Character const& names) {
 
 // a standard call, not an op
 Compiler::Operand Compiler::compileFunctionCall(List const& call, Character const& names, Prototype* code) {
+	escape(call[0]);
 	Operand function = compile(call[0], code);
 	CompiledCall a = makeCall(call, names);
 	code->calls.push_back(a);
@@ -289,8 +355,10 @@ Compiler::Operand Compiler::compileCall(List const& call, Character const& names
 		Operand result = placeInRegister(compileConstant(Null::Singleton(), code));
 		jmps.push_back(emit(ByteCode::jmp, (int64_t)0, (int64_t)0, (int64_t)0));
 		
+		std::set<String> before = assigned;
 		for(int64_t i = 1; i <= n; i++) {
 			ir[branch+i].c = (int64_t)ir.size()-branch;
+			assigned = before;
 			if(!call[i+1].isNil()) {
 				kill(result);
 				Operand r = placeInRegister(compile(call[i+1], code));
@@ -310,6 +378,7 @@ Compiler::Operand Compiler::compileCall(List const& call, Character const& names
 		for(int64_t i = 0; i < (int64_t)jmps.size(); i++) {
 			ir[jmps[i]].a = (int64_t)ir.size()-jmps[i];
 		}
+		assigned = before;
 		return result;
 	}
 
@@ -340,9 +409,12 @@ Compiler::Operand Compiler::compileCall(List const& call, Character const& names
       
         // Handle simple assignment 
         if(!isCall(dest)) { 
-            Operand target = Operand(MEMORY, SymbolStr(dest));
-		    emit(func == Strings::assign2 ? ByteCode::assign2 : ByteCode::assign, 
-                target, 0, rhs);
+            if(func == Strings::assign2) {
+                escaped.insert(SymbolStr(dest));
+                emit(ByteCode::assign2, Operand(MEMORY, SymbolStr(dest)), 0, rhs);
+            }
+            else
+                compileAssign(SymbolStr(dest), rhs);
         }
 		
         // Handle complex LHS assignment instructions...
@@ -384,10 +456,13 @@ Compiler::Operand Compiler::compileCall(List const& call, Character const& names
 			    dest = c[1];
 		    }
 
-            Operand target = Operand(MEMORY, SymbolStr(dest));
 		    Operand source = compile(value, code);
-		    emit(func == Strings::assign2 ? ByteCode::assign2 : ByteCode::assign, 
-                target, 0, source);
+            if(func == Strings::assign2) {
+                escaped.insert(SymbolStr(dest));
+                emit(ByteCode::assign2, Operand(MEMORY, SymbolStr(dest)), 0, source);
+            }
+            else
+                compileAssign(SymbolStr(dest), source);
             kill( source );
 		    
             Operand rm = allocRegister();
@@ -399,6 +474,7 @@ Compiler::Operand Compiler::compileCall(List const& call, Character const& names
     else if(func == Strings::rm && call.length == 2)
     {
         Operand symbol = Operand(MEMORY, SymbolStr(call[1]));
+        escaped.insert(symbol.s);
 		Operand rm = allocRegister();
         emit( ByteCode::rm, symbol, 0, rm );
         return rm;
@@ -426,7 +502,7 @@ Compiler::Operand Compiler::compileCall(List const& call, Character const& names
 		}
 
 		//compile the source for the body
-		Prototype* functionCode = Compiler::compileFunctionBody(thread, call[2]);
+		Prototype* functionCode = Compiler::compileFunctionBody(thread, call[1], call[2]);
 
 		// Populate function info
 		functionCode->parameters = parameters;
@@ -459,19 +535,28 @@ Compiler::Operand Compiler::compileCall(List const& call, Character const& names
 	} 
 	else if(func == Strings::forSym) 
 	{
-		Operand loop_variable = Operand(MEMORY, SymbolStr(call[1]));
+		String var = SymbolStr(call[1]);
+		std::map<String, int64_t>::const_iterator slot = slots.find(var);
+		Operand loop_variable = slot != slots.end() ? 
+			Operand(SLOT, slot->second) : Operand(MEMORY, var);
 		Operand loop_vector = compile(call[2], code);
 		Operand loop_counter = allocRegister();	// save space for loop counter
 
 		emit(ByteCode::forbegin, loop_variable, loop_vector, loop_counter);
 		emit(ByteCode::jmp, 0, 0, 0);
 		
+		// the body may run zero times, so nothing it assigns is definite afterwards
+		std::set<String> before = assigned;
+		locals.insert(var);
+		assigned.insert(var);
+
 		loopDepth++;
 		int64_t beginbody = ir.size();
 		Operand body = compile(call[3], code);
 		int64_t endbody = ir.size();
 		resolveLoopExits(beginbody, endbody, endbody, endbody+2);
 		loopDepth--;
+		assigned = before;
 		
 		emit(ByteCode::forend, loop_variable, loop_vector, loop_counter);
 		emit(ByteCode::jmp, beginbody-endbody, 0, 0);
@@ -487,9 +572,11 @@ Compiler::Operand Compiler::compileCall(List const& call, Character const& names
 		emit(ByteCode::jc, 1, 0, kill(head_condition));
 		loopDepth++;
 		
+		std::set<String> before = assigned;
 		int64_t beginbody = ir.size();
 		Operand body = compile(call[2], code);
 		kill(body);
+		assigned = before;	// next jumps straight to the tail condition
 		int64_t tail = ir.size();
 		Operand tail_condition = compile(call[1], code);
 		int64_t endbody = ir.size();
@@ -504,11 +591,13 @@ Compiler::Operand Compiler::compileCall(List const& call, Character const& names
 	else if(func == Strings::repeatSym)
 	{
 		loopDepth++;
+		std::set<String> before = assigned;
 		int64_t beginbody = ir.size();
 		Operand body = compile(call[1], code);
 		int64_t endbody = ir.size();
 		resolveLoopExits(beginbody, endbody, endbody, endbody+1);
 		loopDepth--;
+		assigned = before;
 		emit(ByteCode::jmp, beginbody-endbody, 0, 0);
 		
 		kill(body);
@@ -540,15 +629,23 @@ Compiler::Operand Compiler::compileCall(List const& call, Character const& names
 		Operand cond = compile(call[1], code);
 		emit(ByteCode::jc, 1, 0, kill(cond));
 		int64_t begin1 = ir.size(), begin2 = 0;
+		std::set<String> before = assigned;
 		resultT = placeInRegister(compile(call[2], code));
 		
 		emit(ByteCode::jmp, (int64_t)0, (int64_t)0, (int64_t)0);
 		begin2 = ir.size();
 	
+		std::set<String> assignedT;
+		assignedT.swap(assigned);
+		assigned = before;
 		kill(resultT);
 		resultF = placeInRegister(
 			call.length == 4 ? 	compile(call[3], code) :
 						compileConstant(Null::Singleton(), code) );
+		std::set<String> both;
+		std::set_intersection(assignedT.begin(), assignedT.end(),
+			assigned.begin(), assigned.end(), std::inserter(both, both.begin()));
+		assigned.swap(both);
         assert(resultT == resultF || resultT.loc == INVALID || resultF.loc == INVALID);
 		int64_t end = ir.size();
 		ir[begin2-1].a = end-begin2+1;
@@ -564,8 +661,10 @@ Compiler::Operand Compiler::compileCall(List const& call, Character const& names
 		Operand left = compile(call[1], code);
 		emit(ByteCode::jc, 0, 1, kill(left));
 		int64_t j1 = ir.size()-1;
+		std::set<String> before = assigned;
 		Operand right = compile(call[2], code);
 		emit(ByteCode::jc, 2, 1, kill(right));
+		assigned = before;
 	
 		kill(r0);	
 		Operand r1 = placeInRegister(compileConstant(Logical::False(), code));
@@ -580,8 +679,10 @@ Compiler::Operand Compiler::compileCall(List const& call, Character const& names
 		Operand left = compile(call[1], code);
 		emit(ByteCode::jc, 1, 0, kill(left));
 		int64_t j1 = ir.size()-1;
+		std::set<String> before = assigned;
 		Operand right = compile(call[2], code);
 		emit(ByteCode::jc, 1, 2, kill(right));
+		assigned = before;
 
 		kill(r0);
 		Operand r1 = placeInRegister(compileConstant(Logical::True(), code));
@@ -731,6 +832,7 @@ Compiler::Operand Compiler::compileCall(List const& call, Character const& names
 		if(call.length != 2) _error("missing requires one argument");
 		if(!isSymbol(call[1]) && !call[1].isCharacter1()) _error("wrong parameter to missing");
 		Operand s = Operand(MEMORY, SymbolStr(call[1]));
+		escaped.insert(s.s);
 		Operand result = allocRegister();
 		emit(ByteCode::missing, s, 0, result); 
 		return result;
@@ -791,6 +893,92 @@ Compiler::Operand Compiler::compile(Value const& expr, Prototype* code) {
 
 
 
+static ByteCode::Enum fuse(ByteCode::Enum first, ByteCode::Enum second) {
+	#define FUSE(Name, string, First, Second) \
+		if(first == ByteCode::First && second == ByteCode::Second) return ByteCode::Name;
+	FUSED_BYTECODES(FUSE)
+	#undef FUSE
+	return first;
+}
+
+// Replace the head of hot instruction pairs with a superinstruction. 
+// The tail is left where it is, so jumps into it still work.
+void Compiler::fuseInstructions() {
+	for(size_t i = 0; i+1 < ir.size(); i++) {
+		ByteCode::Enum bc = fuse(ir[i].bc, ir[i+1].bc);
+		if(bc != ir[i].bc) {
+			ir[i].bc = bc;
+			i++;
+		}
+		else if(ir[i].bc == ByteCode::forend) {
+			// the jmp after a forend holds the offset, relative to the forend,
+			// of the top of the loop body
+			int64_t target = i + ir[i+1].a.i;
+			if(ir[target].bc == ByteCode::subset)
+				ir[i].bc = ByteCode::forsubset;
+		}
+	}
+}
+
+// Is the fastmov at k the start of `r[i] <- v` or `r[[i]] <- v` on slot r?
+// It copies r to a register t, the index and value are computed without
+// writing r or t, then iassign/eassign updates t and t is moved back to r.
+bool Compiler::isReplacement(size_t k, Operand slot) const {
+	Operand t = ir[k].c;
+	if(t.loc != REGISTER) return false;
+	for(size_t m = k+1; m+1 < ir.size(); m++) {
+		if((ir[m].bc == ByteCode::iassign || ir[m].bc == ByteCode::eassign) && ir[m].c == t)
+			return ir[m+1].bc == ByteCode::fastmov && ir[m+1].a == t && ir[m+1].c == slot;
+		if(ir[m].c == slot || ir[m].c == t)
+			return false;
+	}
+	return false;
+}
+
+// A slot's vector can only be shared if it's read by something that might
+// keep it. When a slot is only ever read by replacements assigning back to
+// it, by element and length reads, and as the function's result, its
+// replacements are rewritten to work on the slot itself. iassign_op and
+// eassign_op can then update its vector in place (see SlotAssign).
+void Compiler::replaceInPlace() {
+	for(int64_t s = 0; s < (int64_t)slots.size(); s++) {
+		Operand slot(SLOT, s);
+		std::vector<size_t> replacements;
+		bool ok = true;
+		for(size_t i = 0; i < ir.size() && ok; i++) {
+			IRNode const& n = ir[i];
+			if(n.a != slot && n.b != slot && n.c != slot)
+				continue;
+			if(n.b == slot)
+				ok = false;
+			else if(n.c == slot)
+				ok = (n.bc == ByteCode::fastmov || n.bc == ByteCode::mov) && n.a != slot;
+			else if(n.bc == ByteCode::ret || n.bc == ByteCode::subset ||
+				n.bc == ByteCode::subset2 || n.bc == ByteCode::length)
+				ok = true;
+			else if(n.bc == ByteCode::fastmov && i+1 < ir.size() &&
+				ir[i+1].bc == ByteCode::ret && ir[i+1].a == n.c)
+				ok = true;	// return(r)
+			else if(n.bc == ByteCode::fastmov && isReplacement(i, slot))
+				replacements.push_back(i);
+			else
+				ok = false;
+		}
+		if(!ok) continue;
+		for(size_t j = 0; j < replacements.size(); j++) {
+			size_t k = replacements[j];
+			Operand t = ir[k].c;
+			size_t m = k+1;
+			while(!((ir[m].bc == ByteCode::iassign || ir[m].bc == ByteCode::eassign) && ir[m].c == t))
+				m++;
+			ir[m].c = slot;
+			// leave t holding the result, as before
+			ir[m+1].a = slot;
+			ir[m+1].c = t;
+		}
+	}
+}
+
 void Compiler::dumpCode() const {
 	for(size_t i = 0; i < ir.size(); i++) {
 		std::cout << ByteCode::toString(ir[i].bc) << "\t" << ir[i].a.toString() << "\t" << ir[i].b.toString() << "\t" << ir[i].c.toString() << std::endl;
@@ -800,13 +988,15 @@ void Compiler::dumpCode() const {
 // generate actual code from IR as follows...
 // 	MEMORY and INTEGER operands unchanged
 //	CONSTANT operands placed in lower N registers (starting at 0)
+//	SLOT operands placed above those
 //	REGISTER operands placed in above those
 //	all register ops encoded with negative integer.
 //	INVALID operands just go to 0 since they will never be used
 int64_t Compiler::encodeOperand(Operand op, int64_t n) const {
 	if(op.loc == MEMORY || op.loc == INTEGER) return op.i;
 	else if(op.loc == CONSTANT) return -(op.i);
-	else if(op.loc == REGISTER) return -(op.i + n);
+	else if(op.loc == SLOT) return -(op.i + n);
+	else if(op.loc == REGISTER) return -(op.i + n + (int64_t)slots.size());
 	else return 0;
 }
 
@@ -818,7 +1008,7 @@ Prototype* Compiler::compile(Value const& expr) {
 
 	std::reverse(code->constants.begin(), code->constants.end());
 	code->expression = expr;
-	code->registers = code->constants.size() + max_n;
+	code->registers = code->constants.size() + slots.size() + max_n;
 	
 	// insert appropriate termination statement at end of code
 	if(scope == FUNCTION)
@@ -829,6 +1019,10 @@ Prototype* Compiler::compile(Value const& expr) {
 		emit(ByteCode::rets, result, 0, 0);
 		emit(ByteCode::done, 0, 0, 0);
 	}
+	replaceInPlace();
+	fuseInstructions();
+	code->slots = slots.size();
+
 	int64_t n = code->constants.size();
 	for(size_t i = 0; i < ir.size(); i++) {
 		code->bc.push_back(Instruction(ir[i].bc, encodeOperand(ir[i].a, n), encodeOperand(ir[i].b, n), encodeOperand(ir[i].c, n)));
@@ -837,3 +1031,73 @@ Prototype* Compiler::compile(Value const& expr) {
 	return code;	
 }
 
+
+Prototype* Compiler::compileFunctionBody(Thread& thread, Value const& formals, Value const& expr) {
+	Character names = hasNames(formals) ?
+		(Character const&)getNames((Object const&)formals) :
+		Character(0);
+
+	// Parameters are bound before the body runs, so reading one never falls
+	// through to the enclosing scopes.
+	Compiler compiler(thread, FUNCTION);
+	for(int64_t i = 0; i < names.length; i++)
+		compiler.assigned.insert(names[i]);
+	Prototype* code = compiler.compile(expr);
+
+	Compiler slotted(thread, FUNCTION);
+	std::set<String> candidates(compiler.locals);
+	for(int64_t i = 0; i < names.length; i++)
+		candidates.insert(names[i]);
+
+	bool frameless = false;
+	if(!needsEnvironment(expr)) {
+		// Default arguments are evaluated in the environment, so whatever
+		// they use stays there, and so do the dots.
+		compiler.escape(formals);
+		compiler.escaped.insert(Strings::dots);
+
+		// Promises read from the environment, so a local they read stays
+		// there. A parameter they read can have a slot if the body never
+		// assigns it and the frame is frameless: its first call gives it an
+		// environment with those parameters copied in (see FrameEnvironment).
+		std::set<String> escaped(compiler.escaped);
+		for(std::set<String>::const_iterator i = compiler.promised.begin(); i != compiler.promised.end(); ++i) {
+			if(compiler.locals.find(*i) != compiler.locals.end())
+				escaped.insert(*i);
+		}
+
+		// With everything in slots the frame needs no environment of its own
+		// and runs in the closure's. Defaults are then evaluated there, so
+		// they mustn't assign.
+		std::set<String> used;
+		symbols(formals, used);
+		frameless = !needsEnvironment(formals) &&
+			used.find(Strings::assign) == used.end() &&
+			used.find(Strings::eqassign) == used.end();
+		for(std::set<String>::const_iterator i = candidates.begin(); i != candidates.end(); ++i) {
+			if(escaped.find(*i) != escaped.end())
+				frameless = false;
+		}
+		if(!frameless)
+			escaped.insert(compiler.promised.begin(), compiler.promised.end());
+
+		// Second pass with the surviving locals and parameters assigned to frame slots.
+		for(std::set<String>::const_iterator i = candidates.begin(); i != candidates.end(); ++i) {
+			if(escaped.find(*i) == escaped.end()) {
+				int64_t index = slotted.slots.size();
+				slotted.slots[*i] = index;
+			}
+		}
+		if(!slotted.slots.empty())
+			code = slotted.compile(expr);
+		code->frameless = frameless;
+	}
+
+	for(int64_t i = 0; i < names.length; i++) {
+		std::map<String, int64_t>::const_iterator s = slotted.slots.find(names[i]);
+		code->parameterSlots.push_back(s != slotted.slots.end() ? s->second : -1);
+		if(frameless && compiler.promised.find(names[i]) != compiler.promised.end())
+			code->spills.push_back(i);
+	}
+	return code;
+}
@@ -6,6 +6,7 @@
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <set>
 
 #include "common.h"
 #include "exceptions.h"
@@ -33,6 +34,7 @@ private:
 	enum Loc {
 		INVALID,
 		REGISTER,
+		SLOT,
 		MEMORY,
 		CONSTANT,
 		INTEGER
@@ -56,6 +58,7 @@ private:
 		std::string toString() const {
 			if(loc == INVALID) return "I";
 			else if(loc == REGISTER) return intToStr(i) + "R";
+			else if(loc == SLOT) return intToStr(i) + "S";
 			else if(loc == CONSTANT) return intToStr(i) + "C";
 			else if(loc == MEMORY) return std::string(s);
 			else return intToStr(i) + "L";
@@ -76,6 +79,14 @@ private:
 	Operand kill(Operand i) { if(i.loc == REGISTER) { n = std::min(n, i.i); } return i; }
 	Operand top() { return Operand(REGISTER, n); }
 
+	// Frame slots: function locals that never need to live in the environment
+	// are kept in fixed registers below the temporaries.
+	std::map<String, int64_t> slots;
+	std::set<String> assigned;	// locals definitely assigned at this point
+	std::set<String> locals;	// every name assigned with <- or used as a loop variable
+	std::set<String> escaped;	// names that must stay in the environment
+	std::set<String> promised;	// names read by the promises of calls
+
 	Compiler(Thread& thread, Scope scope) : thread(thread), state(thread.state), scope(scope), loopDepth(0), n(0), max_n(0) {}
 	
 	Prototype* compile(Value const& expr);			// compile function block, code ends with return
@@ -87,6 +98,8 @@ private:
 	Operand compileFunctionCall(List const& call, Character const& names, Prototype* code); 
 	Operand compileInternalFunctionCall(Object const& o, Prototype* code); 
 	Operand compileExpression(List const& values, Prototype* code);
+	void compileAssign(String name, Operand rhs);
+	void escape(Value const& expr);
 	
 	CompiledCall makeCall(List const& call, Character const& names);
 
@@ -94,6 +107,9 @@ private:
 	Operand forceInRegister(Operand r);
 	int64_t emit(ByteCode::Enum bc, Operand a, Operand b, Operand c);
 	void resolveLoopExits(int64_t start, int64_t end, int64_t nextTarget, int64_t breakTarget);
+	void fuseInstructions();
+	bool isReplacement(size_t k, Operand slot) const;
+	void replaceInPlace();
 	int64_t encodeOperand(Operand op, int64_t n) const;
 	void dumpCode() const;
 
@@ -103,10 +119,7 @@ public:
 		return compiler.compile(expr);
 	}
 	
-	static Prototype* compileFunctionBody(Thread& thread, Value const& expr) {
-		Compiler compiler(thread, FUNCTION);
-		return compiler.compile(expr);
-	}
+	static Prototype* compileFunctionBody(Thread& thread, Value const& formals, Value const& expr);
 	
 	static Prototype* compilePromise(Thread& thread, Value const& expr) {
 		Compiler compiler(thread, PROMISE);
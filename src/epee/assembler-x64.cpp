@@ -2650,6 +2650,150 @@ void Assembler::blendvpd(XMMRegister dst, const Operand& src) {
 	emit(0x15);
 	emit_sse_operand(dst, src);
 }
+// AVX
+
+void Assembler::emit_vex(int rxb, int vvvv, VexLength l, VexPrefix pp, VexMap map) {
+	// R, X, B and vvvv are stored inverted
+	emit(0xC4);
+	emit(((~rxb & 0x7) << 5) | map);
+	emit(((~vvvv & 0xF) << 3) | (l << 2) | pp);
+}
+
+void Assembler::emit_vex(XMMRegister reg, XMMRegister vreg, XMMRegister rm,
+		VexLength l, VexPrefix pp, VexMap map) {
+	emit_vex((reg.code() & 0x8) >> 1 | (rm.code() & 0x8) >> 3, vreg.code(), l, pp, map);
+}
+
+void Assembler::emit_vex(XMMRegister reg, XMMRegister vreg, const Operand& rm,
+		VexLength l, VexPrefix pp, VexMap map) {
+	emit_vex((reg.code() & 0x8) >> 1 | rm.rex_, vreg.code(), l, pp, map);
+}
+
+void Assembler::vpd(byte op, XMMRegister dst, XMMRegister a, XMMRegister b, VexLength l) {
+	EnsureSpace ensure_space(this);
+	emit_vex(dst, a, b, l, kVex66, kVex0F);
+	emit(op);
+	emit_sse_operand(dst, b);
+}
+
+void Assembler::vpd(byte op, XMMRegister dst, XMMRegister a, const Operand& b, VexLength l) {
+	EnsureSpace ensure_space(this);
+	emit_vex(dst, a, b, l, kVex66, kVex0F);
+	emit(op);
+	emit_sse_operand(dst, b);
+}
+
+void Assembler::vmovupd(XMMRegister dst, const Operand& src, VexLength l) {
+	vpd(0x10, dst, xmm0, src, l);
+}
+void Assembler::vmovupd(const Operand& dst, XMMRegister src, VexLength l) {
+	vpd(0x11, src, xmm0, dst, l);
+}
+void Assembler::vmovapd(XMMRegister dst, XMMRegister src, VexLength l) {
+	vpd(0x28, dst, xmm0, src, l);
+}
+
+void Assembler::vaddpd(XMMRegister dst, XMMRegister a, XMMRegister b, VexLength l) { vpd(0x58, dst, a, b, l); }
+void Assembler::vaddpd(XMMRegister dst, XMMRegister a, const Operand& b, VexLength l) { vpd(0x58, dst, a, b, l); }
+void Assembler::vsubpd(XMMRegister dst, XMMRegister a, XMMRegister b, VexLength l) { vpd(0x5C, dst, a, b, l); }
+void Assembler::vsubpd(XMMRegister dst, XMMRegister a, const Operand& b, VexLength l) { vpd(0x5C, dst, a, b, l); }
+void Assembler::vmulpd(XMMRegister dst, XMMRegister a, XMMRegister b, VexLength l) { vpd(0x59, dst, a, b, l); }
+void Assembler::vmulpd(XMMRegister dst, XMMRegister a, const Operand& b, VexLength l) { vpd(0x59, dst, a, b, l); }
+void Assembler::vdivpd(XMMRegister dst, XMMRegister a, XMMRegister b, VexLength l) { vpd(0x5E, dst, a, b, l); }
+void Assembler::vdivpd(XMMRegister dst, XMMRegister a, const Operand& b, VexLength l) { vpd(0x5E, dst, a, b, l); }
+void Assembler::vminpd(XMMRegister dst, XMMRegister a, XMMRegister b, VexLength l) { vpd(0x5D, dst, a, b, l); }
+void Assembler::vminpd(XMMRegister dst, XMMRegister a, const Operand& b, VexLength l) { vpd(0x5D, dst, a, b, l); }
+void Assembler::vmaxpd(XMMRegister dst, XMMRegister a, XMMRegister b, VexLength l) { vpd(0x5F, dst, a, b, l); }
+void Assembler::vmaxpd(XMMRegister dst, XMMRegister a, const Operand& b, VexLength l) { vpd(0x5F, dst, a, b, l); }
+void Assembler::vandpd(XMMRegister dst, XMMRegister a, XMMRegister b, VexLength l) { vpd(0x54, dst, a, b, l); }
+void Assembler::vandpd(XMMRegister dst, XMMRegister a, const Operand& b, VexLength l) { vpd(0x54, dst, a, b, l); }
+void Assembler::vandnpd(XMMRegister dst, XMMRegister a, XMMRegister b, VexLength l) { vpd(0x55, dst, a, b, l); }
+void Assembler::vorpd(XMMRegister dst, XMMRegister a, XMMRegister b, VexLength l) { vpd(0x56, dst, a, b, l); }
+void Assembler::vxorpd(XMMRegister dst, XMMRegister a, XMMRegister b, VexLength l) { vpd(0x57, dst, a, b, l); }
+void Assembler::vxorpd(XMMRegister dst, XMMRegister a, const Operand& b, VexLength l) { vpd(0x57, dst, a, b, l); }
+
+void Assembler::vsqrtpd(XMMRegister dst, XMMRegister src, VexLength l) {
+	vpd(0x51, dst, xmm0, src, l);
+}
+
+void Assembler::vroundpd(XMMRegister dst, XMMRegister src, RoundingMode mode, VexLength l) {
+	EnsureSpace ensure_space(this);
+	emit_vex(dst, xmm0, src, l, kVex66, kVex0F3A);
+	emit(0x09);
+	emit_sse_operand(dst, src);
+	// Mask precision exception.
+	emit(static_cast<byte>(mode) | 0x8);
+}
+
+void Assembler::vcmppd(XMMRegister dst, XMMRegister a, XMMRegister b, ComparisonType mode, VexLength l) {
+	EnsureSpace ensure_space(this);
+	emit_vex(dst, a, b, l, kVex66, kVex0F);
+	emit(0xC2);
+	emit_sse_operand(dst, b);
+	emit(static_cast<byte>(mode));
+}
+
+void Assembler::vblendvpd(XMMRegister dst, XMMRegister a, XMMRegister b, XMMRegister mask, VexLength l) {
+	EnsureSpace ensure_space(this);
+	emit_vex(dst, a, b, l, kVex66, kVex0F3A);
+	emit(0x4B);
+	emit_sse_operand(dst, b);
+	// the mask register lives in the top nibble of the immediate
+	emit(mask.code() << 4);
+}
+
+void Assembler::vbroadcastsd(XMMRegister dst, const Operand& src) {
+	EnsureSpace ensure_space(this);
+	emit_vex(dst, xmm0, src, kVex256, kVex66, kVex0F38);
+	emit(0x19);
+	emit_sse_operand(dst, src);
+}
+
+void Assembler::vextractf128(XMMRegister dst, XMMRegister src, int8_t lane) {
+	EnsureSpace ensure_space(this);
+	emit_vex(src, xmm0, dst, kVex256, kVex66, kVex0F3A);
+	emit(0x19);
+	emit_sse_operand(src, dst);
+	emit(lane);
+}
+
+void Assembler::vinsertf128(XMMRegister dst, XMMRegister a, XMMRegister b, int8_t lane) {
+	EnsureSpace ensure_space(this);
+	emit_vex(dst, a, b, kVex256, kVex66, kVex0F3A);
+	emit(0x18);
+	emit_sse_operand(dst, b);
+	emit(lane);
+}
+
+void Assembler::vmaskmovpd(XMMRegister dst, XMMRegister mask, const Operand& src, VexLength l) {
+	EnsureSpace ensure_space(this);
+	emit_vex(dst, mask, src, l, kVex66, kVex0F38);
+	emit(0x2D);
+	emit_sse_operand(dst, src);
+}
+
+void Assembler::vmaskmovpd(const Operand& dst, XMMRegister mask, XMMRegister src, VexLength l) {
+	EnsureSpace ensure_space(this);
+	emit_vex(src, mask, dst, l, kVex66, kVex0F38);
+	emit(0x2F);
+	emit_sse_operand(src, dst);
+}
+
+void Assembler::vmovmskpd(Register dst, XMMRegister src, VexLength l) {
+	EnsureSpace ensure_space(this);
+	XMMRegister d = { dst.code() };
+	emit_vex(d, xmm0, src, l, kVex66, kVex0F);
+	emit(0x50);
+	emit_sse_operand(dst, src);
+}
+
+void Assembler::vzeroupper() {
+	EnsureSpace ensure_space(this);
+	emit(0xC5);
+	emit(0xF8);
+	emit(0x77);
+}
+
 void Assembler::paddq(XMMRegister dst, XMMRegister src) {
 	EnsureSpace ensure_space(this);
 	emit(0x66);
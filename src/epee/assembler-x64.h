@@ -1396,6 +1396,52 @@ class Assembler {
   void blendvpd(XMMRegister dst, XMMRegister src);
   void blendvpd(XMMRegister dst, const Operand& adr);
 
+  // AVX instructions (VEX encoded, non-destructive three operand forms).
+  // XMMRegister n names ymmn when l is kVex256. VEX.128 forms zero the
+  // upper half of dst and can be mixed with 256-bit code without the
+  // SSE/AVX transition penalty.
+  enum VexLength {
+    kVex128 = 0,
+    kVex256 = 1
+  };
+  void vmovupd(XMMRegister dst, const Operand& src, VexLength l = kVex256);
+  void vmovupd(const Operand& dst, XMMRegister src, VexLength l = kVex256);
+  void vmovapd(XMMRegister dst, XMMRegister src, VexLength l = kVex256);
+
+  void vaddpd(XMMRegister dst, XMMRegister a, XMMRegister b, VexLength l = kVex256);
+  void vaddpd(XMMRegister dst, XMMRegister a, const Operand& b, VexLength l = kVex256);
+  void vsubpd(XMMRegister dst, XMMRegister a, XMMRegister b, VexLength l = kVex256);
+  void vsubpd(XMMRegister dst, XMMRegister a, const Operand& b, VexLength l = kVex256);
+  void vmulpd(XMMRegister dst, XMMRegister a, XMMRegister b, VexLength l = kVex256);
+  void vmulpd(XMMRegister dst, XMMRegister a, const Operand& b, VexLength l = kVex256);
+  void vdivpd(XMMRegister dst, XMMRegister a, XMMRegister b, VexLength l = kVex256);
+  void vdivpd(XMMRegister dst, XMMRegister a, const Operand& b, VexLength l = kVex256);
+  void vminpd(XMMRegister dst, XMMRegister a, XMMRegister b, VexLength l = kVex256);
+  void vminpd(XMMRegister dst, XMMRegister a, const Operand& b, VexLength l = kVex256);
+  void vmaxpd(XMMRegister dst, XMMRegister a, XMMRegister b, VexLength l = kVex256);
+  void vmaxpd(XMMRegister dst, XMMRegister a, const Operand& b, VexLength l = kVex256);
+  void vandpd(XMMRegister dst, XMMRegister a, XMMRegister b, VexLength l = kVex256);
+  void vandpd(XMMRegister dst, XMMRegister a, const Operand& b, VexLength l = kVex256);
+  void vandnpd(XMMRegister dst, XMMRegister a, XMMRegister b, VexLength l = kVex256);
+  void vorpd(XMMRegister dst, XMMRegister a, XMMRegister b, VexLength l = kVex256);
+  void vxorpd(XMMRegister dst, XMMRegister a, XMMRegister b, VexLength l = kVex256);
+  void vxorpd(XMMRegister dst, XMMRegister a, const Operand& b, VexLength l = kVex256);
+
+  void vsqrtpd(XMMRegister dst, XMMRegister src, VexLength l = kVex256);
+  void vroundpd(XMMRegister dst, XMMRegister src, RoundingMode mode, VexLength l = kVex256);
+  void vcmppd(XMMRegister dst, XMMRegister a, XMMRegister b, ComparisonType mode, VexLength l = kVex256);
+  // dst = mask ? b : a, lane by lane on the sign bit of mask
+  void vblendvpd(XMMRegister dst, XMMRegister a, XMMRegister b, XMMRegister mask, VexLength l = kVex256);
+
+  void vbroadcastsd(XMMRegister dst, const Operand& src);
+  void vextractf128(XMMRegister dst, XMMRegister src, int8_t lane);
+  void vinsertf128(XMMRegister dst, XMMRegister a, XMMRegister b, int8_t lane);
+  // masked load (zeroes lanes whose mask sign bit is clear) and store
+  void vmaskmovpd(XMMRegister dst, XMMRegister mask, const Operand& src, VexLength l = kVex256);
+  void vmaskmovpd(const Operand& dst, XMMRegister mask, XMMRegister src, VexLength l = kVex256);
+  void vmovmskpd(Register dst, XMMRegister src, VexLength l = kVex256);
+  void vzeroupper();
+
   // The first argument is the reg field, the second argument is the r/m field.
   void emit_sse_operand(XMMRegister dst, XMMRegister src);
   void emit_sse_operand(XMMRegister reg, const Operand& adr);
@@ -1548,6 +1594,20 @@ class Assembler {
   // numbers have a high bit set.
   inline void emit_optional_rex_32(const Operand& op);
 
+  // Emit a three byte VEX prefix. reg and rm supply VEX.R and VEX.X/B as
+  // the REX bits would, vreg is the extra source operand (VEX.vvvv).
+  // pp selects the implied 66/F3/F2 prefix, map the 0F/0F38/0F3A map.
+  enum VexPrefix { kVexNone = 0, kVex66 = 1, kVexF3 = 2, kVexF2 = 3 };
+  enum VexMap { kVex0F = 1, kVex0F38 = 2, kVex0F3A = 3 };
+  void emit_vex(XMMRegister reg, XMMRegister vreg, XMMRegister rm,
+                VexLength l, VexPrefix pp, VexMap map);
+  void emit_vex(XMMRegister reg, XMMRegister vreg, const Operand& rm,
+                VexLength l, VexPrefix pp, VexMap map);
+  void emit_vex(int rxb, int vvvv, VexLength l, VexPrefix pp, VexMap map);
+  // the packed-double instructions common form: 66 0F op /r
+  void vpd(byte op, XMMRegister dst, XMMRegister a, XMMRegister b, VexLength l);
+  void vpd(byte op, XMMRegister dst, XMMRegister a, const Operand& b, VexLength l);
+
 
   // Emit the ModR/M byte, and optionally the SIB byte and
   // 1- or 4-byte offset for a memory operand.  Also encodes
@@ -27,6 +27,7 @@
 		_(ifelse, "ifelse", ___) \
 		_(sload, "sload", ___) \
 		_(sstore, "sstore", ___) \
+		_(broadcast, "broadcast", ___) \
 
 DECLARE_ENUM(IROpCode,IR_ENUM)
 
@@ -83,52 +84,64 @@ struct IRNode {
 	Value in;
 	Value out;
 	
+	// Nodes that compute the same values: same operation on the same
+	// operands under the same shapes. Trace::Emit hash-conses on this, so
+	// it has to compare everything the code generated for a node depends on.
 	bool operator==(IRNode const& o) const {
-		bool eq = (op == o.op && type == o.type && shape == o.shape);
-		switch(group) {
-			case IRNode::NOP:
+		if(op != o.op || type != o.type || arity != o.arity || group != o.group ||
+			shape != o.shape || outShape != o.outShape)
+			return false;
+		switch(op) {
+			case IROpCode::random:	// two random number sources are never the same
+			case IROpCode::sload:
+			case IROpCode::sstore:
+			case IROpCode::nop:
 				return false;
-				break;
-			case IRNode::GENERATOR: {
-				if(op == IROpCode::load) {
-					return eq && in == o.in && constant.i == o.constant.i;
-				} else if(op == IROpCode::gather) {
-					return eq && unary.a == o.unary.a && in == o.in;
-				} else if(op == IROpCode::constant) {
-					return eq && ((type == Type::Double && constant.d == o.constant.d) || 
-							(type == Type::Integer && constant.i == o.constant.i) || 
-							(type == Type::Logical && constant.l == o.constant.l));
-				} else if(op == IROpCode::seq || op == IROpCode::index) {
-					return eq && ((type == Type::Double && sequence.da == o.sequence.da && sequence.db == o.sequence.db) || 
-							(type == Type::Integer && sequence.ia == o.sequence.ia && sequence.ib == o.sequence.ib));
-				} else if(op == IROpCode::random) {
-					return false;	// two random number sources are never the same
-				} 
-				else {
-					_error("Bad generator in node equality");
-				}
-			} break;
-			default: {
+			case IROpCode::load:
+				return in == o.in && constant.i == o.constant.i;
+			case IROpCode::gather:
+				return in == o.in && unary.a == o.unary.a;
+			case IROpCode::constant:
+				return constant.i == o.constant.i;
+			case IROpCode::seq:
+			case IROpCode::index:
+				return sequence.ia == o.sequence.ia && sequence.ib == o.sequence.ib;
+			default:
 				switch(arity) {
 					case IRNode::TRINARY:
-						return eq && trinary.a == o.trinary.a && trinary.b == o.trinary.b && trinary.c == o.trinary.c;
-					break;
+						return trinary.a == o.trinary.a && trinary.b == o.trinary.b && trinary.c == o.trinary.c;
 					case IRNode::BINARY:
-						return eq && binary.a == o.binary.a && binary.b == o.binary.b;
-					break;
-					case IRNode::UNARY:
-						if(op == IROpCode::addc || op == IROpCode::mulc)
-							return eq && unary.a == o.unary.a && constant.i == o.constant.i;
-						else
-							return eq && unary.a == o.unary.a;
-					break;
-					case IRNode::NULLARY:
+						return binary.a == o.binary.a && binary.b == o.binary.b && binary.data == o.binary.data;
 					default:
-						return eq;
-					break;
+						return unary.a == o.unary.a && unary.data == o.unary.data;
+				}
+		}
+	}
+
+	// consistent with operator==
+	uint64_t hash() const {
+		uint64_t h = 14695981039346656037ULL;
+		#define IR_HASH(x) h = (h ^ (uint64_t)(x)) * 1099511628211ULL;
+		IR_HASH(op) IR_HASH(type) IR_HASH(shape.length) IR_HASH(shape.filter) IR_HASH(shape.split)
+		switch(op) {
+			case IROpCode::load: IR_HASH(in.p) IR_HASH(constant.i) break;
+			case IROpCode::gather: IR_HASH(in.p) IR_HASH(unary.a) break;
+			case IROpCode::constant: IR_HASH(constant.i) break;
+			case IROpCode::seq:
+			case IROpCode::index: IR_HASH(sequence.ia) IR_HASH(sequence.ib) break;
+			case IROpCode::random:
+			case IROpCode::sload:
+			case IROpCode::sstore:
+			case IROpCode::nop: break;
+			default:
+				switch(arity) {
+					case IRNode::TRINARY: IR_HASH(trinary.a) IR_HASH(trinary.b) IR_HASH(trinary.c) break;
+					case IRNode::BINARY: IR_HASH(binary.a) IR_HASH(binary.b) IR_HASH(binary.data) break;
+					default: IR_HASH(unary.a) IR_HASH(unary.data) break;
 				}
-			} break;
 		}
+		#undef IR_HASH
+		return h;
 	}
 
 	bool isDouble() const { return type == Type::Double; }
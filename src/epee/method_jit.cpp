@@ -0,0 +1,826 @@
+#include <sys/mman.h>
+#include <stdio.h>
+#include <map>
+#include <algorithm>
+
+#include "../interpreter.h"
+#include "method_jit.h"
+#include "assembler-x64.h"
+
+using namespace v8::internal;
+
+// What the loop compiler knows about an operand at some instruction
+enum JType {
+	J_NONE,			// not reached yet
+	J_LGL,
+	J_INT,
+	J_DBL,
+	J_INTVEC,		// vectors of length 2 or more, so the payload is the data pointer
+	J_DBLVEC,
+	J_COUNTER,		// for loop counter: header is the length, payload the index
+	J_ANY
+};
+
+static JType typeOf(Value const& v) {
+	if(v.isDouble1()) return J_DBL;
+	if(v.isInteger1()) return J_INT;
+	if(v.isLogical1()) return J_LGL;
+	if(v.isDouble() && v.length > 1) return J_DBLVEC;
+	if(v.isInteger() && v.length > 1) return J_INTVEC;
+	return J_ANY;
+}
+
+static JType join(JType a, JType b) {
+	if(a == J_NONE) return b;
+	if(b == J_NONE || a == b) return a;
+	return J_ANY;
+}
+
+static bool isNumber(JType t) { return t == J_INT || t == J_DBL; }
+static bool isScalar(JType t) { return t == J_LGL || t == J_INT || t == J_DBL; }
+static bool isVector(JType t) { return t == J_INTVEC || t == J_DBLVEC; }
+
+static JType elementOf(JType t) {
+	if(t == J_INTVEC) return J_INT;
+	if(t == J_DBLVEC) return J_DBL;
+	return J_ANY;
+}
+
+static int64_t headerOf(JType t) {
+	switch(t) {
+		case J_LGL: return (1<<4) + Type::Logical;
+		case J_INT: return (1<<4) + Type::Integer;
+		default: return (1<<4) + Type::Double;
+	}
+}
+
+// Superinstructions are compiled as their first half, the second half
+// is still in the bytecode right after them.
+static ByteCode::Enum baseOp(ByteCode::Enum bc) {
+	switch(bc) {
+		#define FUSED(Name, string, First, Second) case ByteCode::Name: return ByteCode::First;
+		FUSED_BYTECODES(FUSED)
+		#undef FUSED
+		case ByteCode::forsubset: return ByteCode::forend;
+		default: return bc;
+	}
+}
+
+static bool isArith(ByteCode::Enum op) {
+	return op == ByteCode::add || op == ByteCode::sub || op == ByteCode::mul || op == ByteCode::div;
+}
+
+static bool isCompare(ByteCode::Enum op) {
+	return op == ByteCode::lt || op == ByteCode::le || op == ByteCode::gt ||
+		op == ByteCode::ge || op == ByteCode::eq || op == ByteCode::neq;
+}
+
+// Operand fields an instruction reads and writes. False if the JIT can't compile it.
+struct Uses {
+	int64_t read[2];
+	int reads;
+	int64_t write;
+	bool writes;
+};
+
+static bool uses(Instruction const& inst, Uses& u) {
+	ByteCode::Enum op = baseOp(inst.bc);
+	u.reads = 0;
+	u.writes = false;
+	if(isArith(op) || isCompare(op) || op == ByteCode::subset) {
+		u.read[u.reads++] = inst.a;
+		u.read[u.reads++] = inst.b;
+		u.write = inst.c; u.writes = true;
+	}
+	else if(op == ByteCode::fastmov || op == ByteCode::mov) {
+		u.read[u.reads++] = inst.a;
+		u.write = inst.c; u.writes = true;
+	}
+	else if(op == ByteCode::assign) {
+		u.read[u.reads++] = inst.c;
+		u.write = inst.a; u.writes = true;
+	}
+	else if(op == ByteCode::forend) {
+		u.read[u.reads++] = inst.b;
+		u.read[u.reads++] = inst.c;
+		u.write = inst.a; u.writes = true;
+	}
+	else if(op == ByteCode::jc) {
+		u.read[u.reads++] = inst.c;
+	}
+	else if(op == ByteCode::force) {
+		u.read[u.reads++] = inst.a;
+	}
+	else if(op != ByteCode::jmp) {
+		return false;
+	}
+	return true;
+}
+
+// Loop head if instruction i jumps backwards, -1 otherwise.
+// The jmp after a forend only holds the forend's offset.
+static int64_t backEdge(std::vector<Instruction, traceable_allocator<Instruction> > const& bc, int64_t i) {
+	ByteCode::Enum op = baseOp(bc[i].bc);
+	if(op == ByteCode::forend)
+		return i + bc[i+1].a;
+	if(op == ByteCode::jc && (bc[i].a <= 0 || bc[i].b <= 0))
+		return i + std::min(bc[i].a, bc[i].b);
+	if(op == ByteCode::jmp && bc[i].a <= 0 && !(i > 0 && baseOp(bc[i-1].bc) == ByteCode::forend))
+		return i + bc[i].a;
+	return -1;
+}
+
+typedef Instruction const* (*NativeLoop)(Value* base, Value* const* symbols);
+
+// Collected along with the Prototype that finds it, so its tables come
+// from the collected heap too.
+struct LoopCode : public gc {
+	int64_t head, end;		// loop body, inclusive
+	void const* ibc;		// head's own handler
+	void const* endibc;		// back edge's own handler
+	void const* handler;		// dispatches the head into RunLoop
+	void const* forend;		// unfused forend handler
+	int64_t hotness;		// back edges taken in the interpreter
+
+	std::vector<String, gc_allocator<String> > symbols;	// passed to the code as pointers, in this order
+	std::vector<bool, gc_allocator<bool> > assigned;	// written in the loop, so must already be local
+
+	// live-in operands and the types the code was compiled for
+	std::vector<std::pair<int64_t, JType>, gc_allocator<std::pair<int64_t, JType> > > guards;
+	NativeLoop code;
+
+	int64_t attempts;		// compiles so far
+	int64_t misses;			// entries rejected by the guards since the last compile
+	int64_t cooldown;		// entries to skip before trying to compile again
+};
+
+void FindLoops(Prototype const* prototype, void const* const* labels, void const* handler) {
+	std::vector<Instruction, traceable_allocator<Instruction> > const& bc = prototype->bc;
+	int64_t n = bc.size();
+
+	for(int64_t end = 0; end < n; end++) {
+		int64_t head = backEdge(bc, end);
+		if(head < 0) continue;
+
+		// only innermost loops made of instructions we can compile
+		bool ok = true;
+		for(int64_t i = head; i <= end && ok; i++) {
+			Uses u;
+			ok = uses(bc[i], u) && (i == end || backEdge(bc, i) < 0);
+		}
+		for(size_t i = 0; i < prototype->loops.size() && ok; i++)
+			ok = prototype->loops[i]->head != head;
+		if(!ok) continue;
+
+		LoopCode* loop = new (GC) LoopCode();
+		loop->head = head;
+		loop->end = end;
+		for(int64_t i = head; i <= end && ok; i++) {
+			Uses u;
+			uses(bc[i], u);
+			int64_t operands[3] = { u.writes ? u.write : 0, u.reads > 0 ? u.read[0] : 0, u.reads > 1 ? u.read[1] : 0 };
+			for(int k = 0; k < 3; k++) {
+				if(operands[k] <= 0) continue;
+				String s = (String)operands[k];
+				size_t j = std::find(loop->symbols.begin(), loop->symbols.end(), s) - loop->symbols.begin();
+				if(j == loop->symbols.size()) {
+					loop->symbols.push_back(s);
+					loop->assigned.push_back(false);
+				}
+				if(k == 0) loop->assigned[j] = true;
+			}
+		}
+		if(loop->symbols.size() > JIT_MAX_SYMBOLS) {
+			delete loop;
+			continue;
+		}
+		loop->ibc = bc[head].ibc;
+		loop->endibc = bc[end].ibc;
+		loop->handler = handler;
+		loop->forend = labels[ByteCode::forend];
+		loop->code = 0;
+		loop->hotness = loop->attempts = loop->misses = loop->cooldown = 0;
+		prototype->loops.push_back(loop);
+	}
+}
+
+static void install(Prototype const* prototype, LoopCode& loop) {
+	prototype->bc[loop.head].ibc = loop.handler;
+	// forsubset would run the head's subset itself instead of dispatching it
+	if(prototype->bc[loop.end].bc == ByteCode::forsubset)
+		prototype->bc[loop.end].ibc = loop.forend;
+}
+
+// leaves the loop to the interpreter for good
+static void uninstall(Prototype const* prototype, LoopCode& loop) {
+	prototype->bc[loop.head].ibc = loop.ibc;
+	prototype->bc[loop.end].ibc = loop.endibc;
+}
+
+static LoopCode* findLoop(Prototype const* prototype, Instruction const* head) {
+	int64_t h = head - &prototype->bc[0];
+	for(size_t i = 0; i < prototype->loops.size(); i++) {
+		if(prototype->loops[i]->head == h)
+			return prototype->loops[i];
+	}
+	return 0;
+}
+
+Instruction const* HotLoop(Thread& thread, Instruction const* head) {
+	Prototype const* prototype = thread.frame.prototype;
+	LoopCode* loop = findLoop(prototype, head);
+	if(loop && ++loop->hotness == JIT_HOT_LOOP)
+		install(prototype, *loop);
+	return head;
+}
+
+// Executable memory for compiled loops, never freed.
+static Lock jitLock;
+static char* arena = 0;
+static int64_t arenaUsed = JIT_ARENA_BYTES;
+
+static char* reserveCode(int64_t bytes) {
+	if(bytes > JIT_ARENA_BYTES)
+		return 0;
+	if(arenaUsed + bytes > JIT_ARENA_BYTES) {
+		void* p = mmap(0, JIT_ARENA_BYTES, PROT_READ | PROT_WRITE | PROT_EXEC,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(p == MAP_FAILED)
+			return 0;
+		arena = (char*)p;
+		arenaUsed = 0;
+	}
+	return arena + arenaUsed;
+}
+
+static const Register gprHomes[] = { rbx, r12, r13, r14, r15 };
+static const XMMRegister xmmHomes[] = { xmm8, xmm9, xmm10, xmm11, xmm12, xmm13, xmm14, xmm15 };
+#define GPR_HOMES (int)(sizeof(gprHomes)/sizeof(Register))
+#define XMM_HOMES (int)(sizeof(xmmHomes)/sizeof(XMMRegister))
+
+//
+// Compiles one loop for the operand types seen in base and symbols.
+//
+// Operands are keyed by their register offset (<= 0) or by 1 + their
+// position in LoopCode::symbols. At run time rdi holds the register base
+// and rsi the array of symbol pointers. Values stay in their boxed
+// locations, except for type stable scalars that are live into the loop,
+// which get a home register for the whole loop and are written back on
+// every exit.
+//
+class LoopCompiler {
+	Prototype const* prototype;
+	LoopCode& loop;
+	int64_t head, end, n;
+
+	std::map<int64_t, int64_t> index;	// operand key -> dense index
+	std::vector<int64_t> keys;
+
+	struct State {
+		bool reached;
+		std::vector<char> type;		// JType of each operand
+		std::vector<char> defined;	// written on every path from the head
+	};
+	std::vector<State> in;
+
+	std::vector<char> written;		// join of all types written to each operand
+	std::vector<char> liveIn;
+	std::vector<int64_t> useCount;
+	std::vector<int> home;			// register code, or -1 if boxed
+
+	Assembler* a;
+	Label* labels;
+	Label* exits;
+
+public:
+	int64_t homes;
+
+	LoopCompiler(Prototype const* prototype, LoopCode& loop)
+		: prototype(prototype), loop(loop), head(loop.head), end(loop.end), n(end-head+1), homes(0) {}
+
+	int64_t key(int64_t operand) {
+		if(operand <= 0) return operand;
+		return 1 + (std::find(loop.symbols.begin(), loop.symbols.end(), (String)operand) - loop.symbols.begin());
+	}
+
+	int64_t idx(int64_t operand) {
+		return index[key(operand)];
+	}
+
+	void successors(int64_t i, std::vector<int64_t>& s) {
+		Instruction const& inst = prototype->bc[i];
+		ByteCode::Enum op = baseOp(inst.bc);
+		s.clear();
+		if(op == ByteCode::jmp) s.push_back(i+inst.a);
+		else if(op == ByteCode::jc) { s.push_back(i+inst.a); s.push_back(i+inst.b); }
+		else if(op == ByteCode::forend) { s.push_back(i+prototype->bc[i+1].a); s.push_back(i+2); }
+		else s.push_back(i+1);
+	}
+
+	JType resultType(Instruction const& inst, State const& s) {
+		ByteCode::Enum op = baseOp(inst.bc);
+		if(isArith(op)) {
+			JType ta = (JType)s.type[idx(inst.a)], tb = (JType)s.type[idx(inst.b)];
+			if(!isNumber(ta) || !isNumber(tb)) return J_ANY;
+			return (op != ByteCode::div && ta == J_INT && tb == J_INT) ? J_INT : J_DBL;
+		}
+		if(isCompare(op)) return J_LGL;
+		if(op == ByteCode::fastmov || op == ByteCode::mov) return (JType)s.type[idx(inst.a)];
+		if(op == ByteCode::assign) return (JType)s.type[idx(inst.c)];
+		if(op == ByteCode::forend) return elementOf((JType)s.type[idx(inst.b)]);
+		if(op == ByteCode::subset) return elementOf((JType)s.type[idx(inst.a)]);
+		return J_ANY;
+	}
+
+	bool merge(State& dst, State const& src) {
+		if(!dst.reached) {
+			dst = src;
+			return true;
+		}
+		bool changed = false;
+		for(size_t k = 0; k < keys.size(); k++) {
+			char t = join((JType)dst.type[k], (JType)src.type[k]);
+			char d = dst.defined[k] && src.defined[k];
+			changed = changed || t != dst.type[k] || d != dst.defined[k];
+			dst.type[k] = t;
+			dst.defined[k] = d;
+		}
+		return changed;
+	}
+
+	// Infers operand types from the entry snapshot to a fixed point and
+	// checks that every instruction can be compiled with them.
+	bool analyze(Value const* base, Value* const* symbols) {
+		for(int64_t i = head; i <= end; i++) {
+			Uses u;
+			uses(prototype->bc[i], u);
+			if(u.writes && index.find(key(u.write)) == index.end()) {
+				index[key(u.write)] = keys.size();
+				keys.push_back(key(u.write));
+			}
+			for(int r = 0; r < u.reads; r++) {
+				if(index.find(key(u.read[r])) == index.end()) {
+					index[key(u.read[r])] = keys.size();
+					keys.push_back(key(u.read[r]));
+				}
+			}
+		}
+
+		State empty;
+		empty.reached = false;
+		in.assign(n, empty);
+		State& entry = in[0];
+		entry.reached = true;
+		entry.type.resize(keys.size());
+		entry.defined.assign(keys.size(), 0);
+		for(size_t k = 0; k < keys.size(); k++)
+			entry.type[k] = typeOf(keys[k] <= 0 ? base[keys[k]] : *symbols[keys[k]-1]);
+		for(int64_t i = head; i <= end; i++) {
+			if(baseOp(prototype->bc[i].bc) == ByteCode::forend)
+				entry.type[idx(prototype->bc[i].c)] = J_COUNTER;
+		}
+
+		std::vector<int64_t> work, s;
+		work.push_back(head);
+		while(!work.empty()) {
+			int64_t i = work.back();
+			work.pop_back();
+			Instruction const& inst = prototype->bc[i];
+			State out = in[i-head];
+			Uses u;
+			uses(inst, u);
+			if(u.writes) {
+				out.type[idx(u.write)] = resultType(inst, in[i-head]);
+				out.defined[idx(u.write)] = 1;
+			}
+			successors(i, s);
+			for(size_t j = 0; j < s.size(); j++) {
+				if(s[j] >= head && s[j] <= end && merge(in[s[j]-head], out))
+					work.push_back(s[j]);
+			}
+		}
+
+		written.assign(keys.size(), J_NONE);
+		liveIn.assign(keys.size(), 0);
+		useCount.assign(keys.size(), 0);
+		for(int64_t i = head; i <= end; i++) {
+			State const& st = in[i-head];
+			if(!st.reached) continue;
+			Instruction const& inst = prototype->bc[i];
+			ByteCode::Enum op = baseOp(inst.bc);
+			Uses u;
+			uses(inst, u);
+
+			for(int r = 0; r < u.reads; r++) {
+				int64_t k = idx(u.read[r]);
+				JType t = (JType)st.type[k];
+				// symbols could be promises, which only the interpreter can force
+				if(t == J_NONE || (u.read[r] > 0 && t == J_ANY))
+					return false;
+				if(!st.defined[k]) liveIn[k] = 1;
+				useCount[k]++;
+			}
+			if(u.writes) {
+				useCount[idx(u.write)]++;
+				written[idx(u.write)] = join((JType)written[idx(u.write)], resultType(inst, st));
+			}
+
+			if(isArith(op) || isCompare(op)) {
+				if(!isNumber((JType)st.type[idx(inst.a)]) || !isNumber((JType)st.type[idx(inst.b)]))
+					return false;
+			}
+			else if(op == ByteCode::subset) {
+				if(!isVector((JType)st.type[idx(inst.a)]) || !isNumber((JType)st.type[idx(inst.b)]))
+					return false;
+			}
+			else if(op == ByteCode::forend) {
+				if(!isVector((JType)st.type[idx(inst.b)]) || st.type[idx(inst.c)] != J_COUNTER)
+					return false;
+			}
+			else if(op == ByteCode::jc) {
+				if(st.type[idx(inst.c)] != J_LGL)
+					return false;
+			}
+			else if(op == ByteCode::mov) {
+				JType t = (JType)st.type[idx(inst.a)];
+				if(!isScalar(t) && !isVector(t))
+					return false;
+			}
+			else if(op == ByteCode::force) {
+				// nothing to do once the parameter is known to be a value
+				JType t = (JType)st.type[idx(inst.a)];
+				if(!isScalar(t) && !isVector(t))
+					return false;
+			}
+		}
+
+		// the counter is only ever touched by its forend
+		for(size_t k = 0; k < keys.size(); k++) {
+			if(in[0].type[k] == J_COUNTER && written[k] != J_NONE)
+				return false;
+		}
+
+		loop.guards.clear();
+		for(size_t k = 0; k < keys.size(); k++) {
+			if(liveIn[k] && in[0].type[k] != J_ANY && in[0].type[k] != J_COUNTER)
+				loop.guards.push_back(std::make_pair(keys[k], (JType)in[0].type[k]));
+		}
+		return true;
+	}
+
+	// Gives home registers to the most used live-in scalars whose type never changes.
+	void allocate() {
+		home.assign(keys.size(), -1);
+		std::vector<std::pair<int64_t, int64_t> > order;
+		for(size_t k = 0; k < keys.size(); k++) {
+			JType t = (JType)in[0].type[k];
+			if(liveIn[k] && (isScalar(t) || t == J_COUNTER) && (written[k] == J_NONE || written[k] == t))
+				order.push_back(std::make_pair(-useCount[k], (int64_t)k));
+		}
+		std::sort(order.begin(), order.end());
+		int gprs = 0, xmms = 0;
+		for(size_t j = 0; j < order.size(); j++) {
+			int64_t k = order[j].second;
+			if(in[0].type[k] == J_DBL) {
+				if(xmms < XMM_HOMES) { home[k] = xmmHomes[xmms++].code(); homes++; }
+			} else {
+				if(gprs < GPR_HOMES) { home[k] = gprHomes[gprs++].code(); homes++; }
+			}
+		}
+	}
+
+	// Boxed location of part 0 (header) or 1 (payload) of an operand
+	Operand location(int64_t k, int part, Register scratch) {
+		int64_t key = keys[k];
+		if(key <= 0)
+			return Operand(rdi, (int32_t)(key*sizeof(Value) + part*8));
+		a->movq(scratch, Operand(rsi, (int32_t)((key-1)*8)));
+		return Operand(scratch, part*8);
+	}
+
+	Register gpr(int64_t k) { Register r = { home[k] }; return r; }
+	XMMRegister xmm(int64_t k) { XMMRegister r = { home[k] }; return r; }
+
+	Label* exit(int64_t target) {
+		return &exits[target];
+	}
+
+	Label* target(int64_t t) {
+		return (t >= head && t <= end) ? &labels[t-head] : exit(t);
+	}
+
+	void loadInt(Register dst, int64_t k, JType t, Register scratch) {
+		if(home[k] >= 0) a->movq(dst, gpr(k));
+		else if(t == J_LGL) a->movsxbq(dst, location(k, 1, scratch));
+		else a->movq(dst, location(k, 1, scratch));
+	}
+
+	// integer NA is the only value that overflows when 1 is subtracted
+	void checkNA(Register r, Label* fail) {
+		a->cmpq(r, Immediate(1));
+		a->j(overflow, fail);
+	}
+
+	void loadDbl(XMMRegister dst, int64_t k, JType t, Register scratch, Label* fail) {
+		if(t == J_DBL) {
+			if(home[k] >= 0) a->movsd(dst, xmm(k));
+			else a->movsd(dst, location(k, 1, scratch));
+		} else {
+			loadInt(scratch, k, t, scratch);
+			checkNA(scratch, fail);
+			a->cvtqsi2sd(dst, scratch);
+		}
+	}
+
+	void storeInt(int64_t k, Register src, JType t) {
+		if(home[k] >= 0) {
+			a->movq(gpr(k), src);
+		} else {
+			a->movq(location(k, 0, r11), Immediate(headerOf(t)));
+			a->movq(location(k, 1, r11), src);
+		}
+	}
+
+	void storeDbl(int64_t k, XMMRegister src) {
+		if(home[k] >= 0) {
+			a->movsd(xmm(k), src);
+		} else {
+			a->movq(location(k, 0, r11), Immediate(headerOf(J_DBL)));
+			a->movsd(location(k, 1, r11), src);
+		}
+	}
+
+	void copy(int64_t from, int64_t to, JType t) {
+		if(from == to) return;
+		if(home[from] >= 0 || home[to] >= 0) {
+			if(t == J_DBL) {
+				loadDbl(xmm0, from, t, rax, 0);
+				storeDbl(to, xmm0);
+			} else {
+				loadInt(rax, from, t, r9);
+				storeInt(to, rax, t);
+			}
+		} else {
+			a->movq(rax, location(from, 0, r9));
+			a->movq(rcx, location(from, 1, r9));
+			a->movq(location(to, 0, r10), rax);
+			a->movq(location(to, 1, r10), rcx);
+		}
+	}
+
+	void emitArith(int64_t i, Instruction const& inst, ByteCode::Enum op, State const& st) {
+		int64_t ka = idx(inst.a), kb = idx(inst.b), kc = idx(inst.c);
+		JType ta = (JType)st.type[ka], tb = (JType)st.type[kb];
+		if(resultType(inst, st) == J_INT) {
+			loadInt(rax, ka, ta, r9);
+			checkNA(rax, exit(i));
+			loadInt(rcx, kb, tb, r10);
+			checkNA(rcx, exit(i));
+			if(op == ByteCode::add) a->addq(rax, rcx);
+			else if(op == ByteCode::sub) a->subq(rax, rcx);
+			else a->imulq(rax, rcx);
+			storeInt(kc, rax, J_INT);
+		} else {
+			loadDbl(xmm0, ka, ta, rax, exit(i));
+			loadDbl(xmm1, kb, tb, rcx, exit(i));
+			if(op == ByteCode::add) a->addsd(xmm0, xmm1);
+			else if(op == ByteCode::sub) a->subsd(xmm0, xmm1);
+			else if(op == ByteCode::mul) a->mulsd(xmm0, xmm1);
+			else a->divsd(xmm0, xmm1);
+			storeDbl(kc, xmm0);
+		}
+	}
+
+	// Logical results are stored as a full 0 or -1 payload
+	void emitCompare(int64_t i, Instruction const& inst, ByteCode::Enum op, State const& st) {
+		int64_t ka = idx(inst.a), kb = idx(inst.b), kc = idx(inst.c);
+		JType ta = (JType)st.type[ka], tb = (JType)st.type[kb];
+		if(ta == J_INT && tb == J_INT) {
+			loadInt(rax, ka, ta, r9);
+			checkNA(rax, exit(i));
+			loadInt(rcx, kb, tb, r10);
+			checkNA(rcx, exit(i));
+			a->xorl(rdx, rdx);
+			a->cmpq(rax, rcx);
+			Condition cc = op == ByteCode::lt ? less :
+				op == ByteCode::le ? less_equal :
+				op == ByteCode::gt ? greater :
+				op == ByteCode::ge ? greater_equal :
+				op == ByteCode::eq ? equal : not_equal;
+			a->setcc(cc, rdx);
+			a->neg(rdx);
+		} else {
+			// like C, every comparison with NaN is false except !=
+			loadDbl(xmm0, ka, ta, rax, exit(i));
+			loadDbl(xmm1, kb, tb, rcx, exit(i));
+			a->xorl(rdx, rdx);
+			if(op == ByteCode::eq || op == ByteCode::neq) {
+				a->xorl(rcx, rcx);
+				a->ucomisd(xmm0, xmm1);
+				a->setcc(equal, rdx);
+				a->setcc(parity_odd, rcx);
+				a->andl(rdx, rcx);
+				if(op == ByteCode::eq) a->neg(rdx);
+				else a->subq(rdx, Immediate(1));
+			} else {
+				if(op == ByteCode::lt || op == ByteCode::le) a->ucomisd(xmm1, xmm0);
+				else a->ucomisd(xmm0, xmm1);
+				a->setcc((op == ByteCode::lt || op == ByteCode::gt) ? above : above_equal, rdx);
+				a->neg(rdx);
+			}
+		}
+		storeInt(kc, rdx, J_LGL);
+	}
+
+	// Same indexing as the interpreter's scalar subset: whole numbered
+	// indices in bounds are handled here, everything else by the interpreter.
+	void emitSubset(int64_t i, Instruction const& inst, State const& st) {
+		int64_t ka = idx(inst.a), kb = idx(inst.b), kc = idx(inst.c);
+		JType ta = (JType)st.type[ka], tb = (JType)st.type[kb];
+		if(tb == J_INT) {
+			loadInt(rax, kb, tb, r10);
+		} else {
+			loadDbl(xmm0, kb, tb, r10, exit(i));
+			a->cvttsd2siq(rax, xmm0);
+			a->cvtqsi2sd(xmm1, rax);
+			a->ucomisd(xmm0, xmm1);
+			a->j(not_equal, exit(i));
+			a->j(parity_even, exit(i));
+		}
+		a->subq(rax, Immediate(1));
+		a->movq(rcx, location(ka, 0, r9));
+		a->sar(rcx, Immediate(4));
+		a->cmpq(rax, rcx);
+		a->j(above_equal, exit(i));
+		a->movq(rdx, location(ka, 1, r9));
+		if(ta == J_DBLVEC) {
+			a->movsd(xmm0, Operand(rdx, rax, times_8, 0));
+			storeDbl(kc, xmm0);
+		} else {
+			a->movq(rcx, Operand(rdx, rax, times_8, 0));
+			storeInt(kc, rcx, J_INT);
+		}
+	}
+
+	void emitForend(int64_t i, Instruction const& inst, State const& st) {
+		int64_t kv = idx(inst.a), kb = idx(inst.b), kc = idx(inst.c);
+		Register counter = rax;
+		if(home[kc] >= 0) counter = gpr(kc);
+		else a->movq(rax, location(kc, 1, r9));
+		a->cmpq(counter, location(kc, 0, r9));
+		a->j(greater_equal, target(i+2));
+		a->movq(rdx, location(kb, 1, r10));
+		if(st.type[kb] == J_DBLVEC) {
+			a->movsd(xmm0, Operand(rdx, counter, times_8, 0));
+			storeDbl(kv, xmm0);
+		} else {
+			a->movq(rcx, Operand(rdx, counter, times_8, 0));
+			storeInt(kv, rcx, J_INT);
+		}
+		if(home[kc] >= 0) a->incq(counter);
+		else a->incq(location(kc, 1, r9));
+		a->jmp(target(i+prototype->bc[i+1].a));
+	}
+
+	void emitJc(int64_t i, Instruction const& inst, State const& st) {
+		loadInt(rax, idx(inst.c), J_LGL, r9);
+		a->cmpq(rax, Immediate(-1));
+		a->j(equal, target(i+inst.a));
+		a->testq(rax, rax);
+		a->j(zero, target(i+inst.b));
+		a->jmp(exit(i));
+	}
+
+	int64_t emit(char* buffer, int64_t size) {
+		Assembler assembler(buffer, size);
+		a = &assembler;
+		labels = new Label[n];
+		exits = new Label[prototype->bc.size()+1];
+		Label epilogue;
+
+		for(int g = 0; g < GPR_HOMES; g++) a->push(gprHomes[g]);
+		for(size_t k = 0; k < keys.size(); k++) {
+			if(home[k] < 0) continue;
+			JType t = (JType)in[0].type[k];
+			if(t == J_DBL) a->movsd(xmm(k), location(k, 1, r9));
+			else if(t == J_LGL) a->movsxbq(gpr(k), location(k, 1, r9));
+			else a->movq(gpr(k), location(k, 1, r9));
+		}
+
+		for(int64_t i = head; i <= end; i++) {
+			a->bind(&labels[i-head]);
+			State const& st = in[i-head];
+			if(!st.reached) continue;
+			Instruction const& inst = prototype->bc[i];
+			ByteCode::Enum op = baseOp(inst.bc);
+			if(isArith(op)) emitArith(i, inst, op, st);
+			else if(isCompare(op)) emitCompare(i, inst, op, st);
+			else if(op == ByteCode::subset) emitSubset(i, inst, st);
+			else if(op == ByteCode::forend) emitForend(i, inst, st);
+			else if(op == ByteCode::jc) emitJc(i, inst, st);
+			else if(op == ByteCode::jmp) a->jmp(target(i+inst.a));
+			else if(op == ByteCode::assign) copy(idx(inst.c), idx(inst.a), (JType)st.type[idx(inst.c)]);
+			else if(op == ByteCode::force) continue;
+			else copy(idx(inst.a), idx(inst.c), (JType)st.type[idx(inst.a)]);
+		}
+
+		for(size_t t = 0; t <= prototype->bc.size(); t++) {
+			if(!exits[t].is_linked()) continue;
+			a->bind(&exits[t]);
+			a->movq(rax, (void*)&prototype->bc[t]);
+			a->jmp(&epilogue);
+		}
+
+		a->bind(&epilogue);
+		for(size_t k = 0; k < keys.size(); k++) {
+			if(home[k] < 0) continue;
+			if(in[0].type[k] == J_DBL) a->movsd(location(k, 1, r9), xmm(k));
+			else a->movq(location(k, 1, r9), gpr(k));
+		}
+		for(int g = GPR_HOMES-1; g >= 0; g--) a->pop(gprHomes[g]);
+		a->ret(0);
+
+		delete [] labels;
+		delete [] exits;
+		return a->pc_offset();
+	}
+
+	int64_t bound() {
+		return 512 + 256*n + 24*(prototype->bc.size()+1) + 32*keys.size();
+	}
+};
+
+static bool resolve(Environment* env, LoopCode const& loop, Value** symbols) {
+	for(size_t i = 0; i < loop.symbols.size(); i++) {
+		bool success;
+		Environment* e = env;
+		Value const* v = &e->getLocal(loop.symbols[i], success);
+		while(!success && !loop.assigned[i] && e->LexicalScope()) {
+			e = e->LexicalScope();
+			v = &e->getLocal(loop.symbols[i], success);
+		}
+		if(!success) return false;
+		symbols[i] = (Value*)v;
+	}
+	return true;
+}
+
+static bool compile(Thread& thread, LoopCode& loop, Value* const* symbols) {
+	Prototype const* prototype = thread.frame.prototype;
+	LoopCompiler compiler(prototype, loop);
+	if(!compiler.analyze(thread.base, symbols))
+		return false;
+	compiler.allocate();
+
+	jitLock.acquire();
+	char* code = reserveCode(compiler.bound());
+	if(code) {
+		int64_t size = compiler.emit(code, compiler.bound());
+		arenaUsed += (size + 15) & ~15;
+		loop.code = (NativeLoop)code;
+		if(thread.state.verbose) {
+			printf("jit: compiled loop %d-%d (%d bytes, %d values in registers)\n",
+				(int)loop.head, (int)loop.end, (int)size, (int)compiler.homes);
+		}
+	}
+	jitLock.release();
+	return code != 0;
+}
+
+Instruction const* RunLoop(Thread& thread, Instruction const* pc) {
+	Prototype const* prototype = thread.frame.prototype;
+	LoopCode* loop = findLoop(prototype, pc);
+	if(!loop) return pc;
+
+	Value* symbols[JIT_MAX_SYMBOLS];
+	if(!resolve(thread.frame.environment, *loop, symbols))
+		return pc;
+
+	if(!loop->code) {
+		if(loop->cooldown > 0) {
+			loop->cooldown--;
+			return pc;
+		}
+		if(!compile(thread, *loop, symbols)) {
+			loop->cooldown = JIT_MAX_FAILURES;
+			if(++loop->attempts >= JIT_MAX_ATTEMPTS)
+				uninstall(prototype, *loop);
+			return pc;
+		}
+		loop->misses = 0;
+	}
+
+	for(size_t i = 0; i < loop->guards.size(); i++) {
+		int64_t k = loop->guards[i].first;
+		Value const& v = k <= 0 ? thread.base[k] : *symbols[k-1];
+		if(typeOf(v) != loop->guards[i].second) {
+			if(++loop->misses > JIT_MAX_FAILURES) {
+				loop->code = 0;
+				if(++loop->attempts >= JIT_MAX_ATTEMPTS)
+					uninstall(prototype, *loop);
+			}
+			return pc;
+		}
+	}
+	return loop->code(thread.base, symbols);
+}
@@ -0,0 +1,47 @@
+
+#ifndef METHOD_JIT_H
+#define METHOD_JIT_H
+
+#ifdef ENABLE_EPEE
+
+// Baseline JIT for scalar loops.
+//
+// Each innermost loop of a prototype (for, while, repeat) counts its back
+// edges in the interpreter. Once hot, its head dispatches into native code
+// specialized to the scalar types observed there, so a loop that started
+// in the interpreter continues in compiled code at its next iteration with
+// the interpreter's registers and loop counter as is. Scalars read on entry
+// live unboxed in GPRs/XMMs for the whole loop; anything the code can't
+// handle (NA arithmetic, out of bounds subsets, leaving the loop) exits back
+// to the interpreter at the matching instruction with the registers written
+// back, and the next back edge enters the compiled loop again.
+
+// back edges taken in the interpreter before a loop is compiled
+#define JIT_HOT_LOOP 64
+// loops whose entry guards keep failing are recompiled against new types
+// this many times before being left to the interpreter for good
+#define JIT_MAX_ATTEMPTS 4
+#define JIT_MAX_FAILURES 64
+// most distinct symbols a compiled loop may touch
+#define JIT_MAX_SYMBOLS 32
+#define JIT_ARENA_BYTES (1 << 20)
+
+struct Prototype;
+class Thread;
+struct Instruction;
+
+// Finds the loops of a freshly threaded prototype. Hot loops get their
+// heads redirected to handler, which should call RunLoop; labels are the
+// interpreter's own handlers.
+void FindLoops(Prototype const* prototype, void const* const* labels, void const* handler);
+
+// Counts a back edge to head, returns head.
+Instruction const* HotLoop(Thread& thread, Instruction const* head);
+
+// Runs the loop whose head is pc, returning where the interpreter resumes.
+// Returns pc itself if the loop couldn't be entered.
+Instruction const* RunLoop(Thread& thread, Instruction const* pc);
+
+#endif
+
+#endif
@@ -7,14 +7,15 @@
 
 void Trace::Reset() {
 	n_recorded_since_last_exec = 0;
+	n_shared = 0;
 	nodes.clear();
+	cse.clear();
 	outputs.clear();
 	liveEnvironments.clear();
 }
 
 Trace::Trace() { 
 	Reset(); 
-	code_buffer = NULL;
 }
 
 std::string shape2string(IRNode::Shape const& shape) {
@@ -46,6 +47,7 @@ std::string Trace::toString(Thread & thread) {
 		TRINARY(cm2)
 		UNARY(cast)
 		UNARY(filter)
+		UNARY(broadcast)
 		BINARY(split)
 		TRINARY(ifelse)
 		case IROpCode::seq:
@@ -64,6 +66,10 @@ std::string Trace::toString(Thread & thread) {
 		case IROpCode::sload: out << "$" << node.in.p; break;
 		case IROpCode::sstore: out << "n" << node.binary.a << "[" << node.binary.data << "]\tn" << node.binary.b; break;
 		case IROpCode::nop: break;
+#undef TRINARY
+#undef BINARY
+#undef UNARY
+#undef NULLARY
 		}
 		if(node.liveOut) {
 			out << "\t -> ";
@@ -84,6 +90,22 @@ std::string Trace::toString(Thread & thread) {
 	return out.str();
 }
 
+// Recording the same operation on the same operands twice (d1 and d2 in
+// black_scholes, say) gives back the first node rather than a copy.
+IRef Trace::Emit(IRNode const& n) {
+	uint64_t h = n.hash();
+	std::pair<CSETable::const_iterator, CSETable::const_iterator> r = cse.equal_range(h);
+	for(CSETable::const_iterator i = r.first; i != r.second; ++i) {
+		if(nodes[i->second] == n) {
+			n_shared++;
+			return i->second;
+		}
+	}
+	nodes.push_back(n);
+	cse.insert(std::make_pair(h, (IRef)nodes.size()-1));
+	return nodes.size()-1;
+}
+
 IRef Trace::EmitCoerce(IRef a, Type::Enum dst_type) {
 	IRNode& n = nodes[a];
 	if(dst_type == n.type) {
@@ -121,8 +143,7 @@ IRef Trace::EmitUnary(IROpCode::Enum op, Type::Enum type, IRef a, int64_t data)
 		n.arity = IRNode::UNARY;
 		n.outShape = n.shape;
 	}
-	nodes.push_back(n);
-	return nodes.size()-1;
+	return Emit(n);
 }
 IRef Trace::EmitBinary(IROpCode::Enum op, Type::Enum type, IRef a, IRef b, int64_t data) {
 	IRNode n;
@@ -131,10 +152,18 @@ IRef Trace::EmitBinary(IROpCode::Enum op, Type::Enum type, IRef a, IRef b, int64
 	n.binary.a = a;
 	n.binary.b = b;
 	n.binary.data = data;
-	// TODO: this should really check to see if 
-	// the operands are the same length or are constants that we can insert
-	// a index and gather for. This length == 1 check will break on sum(a) + 1 which
-	// we can't fuse.
+	if(op == IROpCode::pow && nodes[b].op == IROpCode::constant &&
+		nodes[b].isDouble() && nodes[b].constant.d == -1) {
+		// x^-1 => 1/x. Constants are shared, so the -1 can't be turned into the 1.
+		union {
+			double d;
+			int64_t i;
+		};
+		d = 1.0;
+		return EmitBinary(IROpCode::div, type, EmitConstant(Type::Double, 1, i), a, data);
+	}
+	// operands arrive recycled to the trace's length (see Traces::GetRef),
+	// so only scalars differ from it
 	if(nodes[a].shape.length == 1)
 		n.shape = nodes[b].shape;
 	else if(nodes[b].shape.length == 1)
@@ -160,8 +189,7 @@ IRef Trace::EmitBinary(IROpCode::Enum op, Type::Enum type, IRef a, IRef b, int64
 		n.group = IRNode::MAP;
 		n.outShape = n.shape;
 	}
-	nodes.push_back(n);
-	return nodes.size()-1;
+	return Emit(n);
 }
 IRef Trace::EmitTrinary(IROpCode::Enum op, Type::Enum type, IRef a, IRef b, IRef c) {
 	IRNode n;
@@ -176,12 +204,11 @@ IRef Trace::EmitTrinary(IROpCode::Enum op, Type::Enum type, IRef a, IRef b, IRef
 	n.trinary.a = a;
 	n.trinary.b = b;
 	n.trinary.c = c;
-	nodes.push_back(n);
-	return nodes.size()-1;
+	return Emit(n);
 }
 
 IRef Trace::EmitFilter(IRef a, IRef b) {
-	// TODO: get rid of this assert and replace with recycle rule
+	// subset_op only traces a filter index of the vector's own length
 	assert(nodes[a].outShape == nodes[b].outShape);
 	IRNode n;
 	n.arity = IRNode::UNARY;
@@ -194,10 +221,17 @@ IRef Trace::EmitFilter(IRef a, IRef b) {
 	n.unary.a = b;
 	nodes.push_back(n);
 	IRef f = nodes.size()-1;
-	IRef r = EmitUnary(IROpCode::pos, nodes[a].type, a, 0);
-	nodes[r].shape.filter = f;
-	nodes[r].outShape.filter = f;
-	return r;
+	IRNode p;
+	p.arity = IRNode::UNARY;
+	p.group = IRNode::MAP;
+	p.op = IROpCode::pos;
+	p.type = nodes[a].type;
+	p.shape = nodes[a].outShape;
+	p.shape.filter = f;
+	p.outShape = p.shape;
+	p.unary.a = a;
+	p.unary.data = 0;
+	return Emit(p);
 }
 
 IRef Trace::EmitSplit(IRef x, IRef f, int64_t levels) {
@@ -213,12 +247,18 @@ IRef Trace::EmitSplit(IRef x, IRef f, int64_t levels) {
 	n.unary.a = f;
 	nodes.push_back(n);
 	IRef s = nodes.size()-1;
-	IRef r = EmitUnary(IROpCode::pos, nodes[x].type, x, 0);
-	nodes[r].shape.split = s;
-	nodes[r].shape.levels = levels;
-	nodes[r].outShape.split = s;
-	nodes[r].outShape.levels = levels;
-	return nodes.size()-1;
+	IRNode p;
+	p.arity = IRNode::UNARY;
+	p.group = IRNode::MAP;
+	p.op = IROpCode::pos;
+	p.type = nodes[x].type;
+	p.shape = nodes[x].outShape;
+	p.shape.split = s;
+	p.shape.levels = levels;
+	p.outShape = p.shape;
+	p.unary.a = x;
+	p.unary.data = 0;
+	return Emit(p);
 }
 
 IRef Trace::EmitGenerator(IROpCode::Enum op, Type::Enum type, int64_t length, int64_t a, int64_t b) {
@@ -231,8 +271,7 @@ IRef Trace::EmitGenerator(IROpCode::Enum op, Type::Enum type, int64_t length, in
 	n.outShape = n.shape;
 	n.sequence.ia = a;
 	n.sequence.ib = b;
-	nodes.push_back(n);
-	return nodes.size()-1;
+	return Emit(n);
 }
 
 IRef Trace::EmitRandom(int64_t length) {
@@ -270,8 +309,7 @@ IRef Trace::EmitConstant(Type::Enum type, int64_t length, int64_t c) {
 	n.shape = (IRNode::Shape) { length, -1, 1, -1, false };
 	n.outShape = n.shape;
 	n.constant.i = c;
-	nodes.push_back(n);
-	return nodes.size()-1;
+	return Emit(n);
 }
 IRef Trace::EmitGather(Value const& v, IRef i) {
 	IRNode n;
@@ -283,8 +321,7 @@ IRef Trace::EmitGather(Value const& v, IRef i) {
 	n.outShape = n.shape;
 	n.unary.a = i;
 	n.in = v;
-	nodes.push_back(n);
-	return nodes.size()-1;
+	return Emit(n);
 }
 
 IRef Trace::EmitLoad(Value const& v, int64_t length, int64_t offset) {
@@ -297,8 +334,7 @@ IRef Trace::EmitLoad(Value const& v, int64_t length, int64_t offset) {
 	n.outShape = n.shape;
 	n.constant.i = offset;
 	n.in = v;
-	nodes.push_back(n);
-	return nodes.size()-1;
+	return Emit(n);
 }
 
 Type::Enum UnifyTypes(Type::Enum a, Type::Enum b) {
@@ -319,8 +355,7 @@ IRef Trace::EmitIfElse(IRef a, IRef b, IRef cond) {
 	n.trinary.a = EmitCoerce(a, n.type);
 	n.trinary.b = EmitCoerce(b, n.type);
 	n.trinary.c = EmitCoerce(cond, Type::Logical);
-	nodes.push_back(n);
-	return nodes.size()-1;
+	return Emit(n);
 }
 
 IRef Trace::EmitSLoad(Value const& v) {
@@ -351,6 +386,126 @@ IRef Trace::EmitSStore(IRef ref, int64_t index, IRef v) {
 	return nodes.size()-1;
 }
 
+// The final value of reduction a, as a scalar for maps to read. It can
+// only be computed once the reduction has been, see JITPhases.
+IRef Trace::EmitBroadcast(IRef a) {
+	IRNode n;
+	n.arity = IRNode::UNARY;
+	n.group = IRNode::MAP;
+	n.op = IROpCode::broadcast;
+	n.type = nodes[a].type;
+	n.shape = (IRNode::Shape) { 1, -1, 1, -1, false };
+	n.outShape = n.shape;
+	n.unary.a = a;
+	n.unary.data = 0;
+	return Emit(n);
+}
+
+// Vector v, shorter than the trace, recycled to its length as R's
+// arithmetic does: element i reads v[i % v.length].
+IRef Trace::EmitRecycle(Value const& v) {
+	return EmitGather(v, EmitIndex(Size, v.length, 1));
+}
+
+static bool recyclable(Trace const& trace, IRef ref, std::vector<bool>& seen) {
+	if(seen[ref]) return true;
+	IRNode const& node = trace.nodes[ref];
+	if(node.shape.filter >= 0 || node.shape.split >= 0)
+		return false;
+	bool r;
+	switch(node.op) {
+		case IROpCode::constant:
+		case IROpCode::seq:
+			r = true;
+			break;
+		case IROpCode::index:
+			r = node.sequence.ia*node.sequence.ib > 0 &&
+				node.shape.length % (node.sequence.ia*node.sequence.ib) == 0;
+			break;
+		case IROpCode::load:
+			r = node.type != Type::Logical && node.constant.i == 0 &&
+				node.in.length == node.shape.length;
+			break;
+		case IROpCode::gather:
+			r = node.type != Type::Logical && recyclable(trace, node.unary.a, seen);
+			break;
+		case IROpCode::broadcast:
+		case IROpCode::pos:
+			r = false;
+			break;
+		default:
+			r = node.group == IRNode::MAP;
+			if(r && node.arity >= IRNode::UNARY)
+				r = recyclable(trace, node.unary.a, seen);
+			if(r && node.arity >= IRNode::BINARY)
+				r = recyclable(trace, node.binary.b, seen);
+			if(r && node.arity >= IRNode::TRINARY)
+				r = recyclable(trace, node.trinary.c, seen);
+			break;
+	}
+	seen[ref] = r;
+	return r;
+}
+
+// Whether node ref can be recorded again, by Recycle, in a trace whose
+// length is a multiple of this one's: maps over loads and generators that
+// don't depend on where in the vector they start.
+bool Trace::Recyclable(IRef ref) const {
+	std::vector<bool> seen(nodes.size(), false);
+	return recyclable(*this, ref, seen);
+}
+
+// see isTraceableType
+bool HasNA(Value const& v) {
+	if(!v.isLogical()) return false;
+	Logical const& l = (Logical const&)v;
+	for(int64_t i = 0; i < l.length; i++)
+		if(Logical::isNA(l[i])) return true;
+	return false;
+}
+
+IRef Trace::Recycle(Trace const& from, IRef ref, std::map<IRef, IRef>& done) {
+	std::map<IRef, IRef>::const_iterator i = done.find(ref);
+	if(i != done.end()) return i->second;
+
+	IRNode const& node = from.nodes[ref];
+	IRef r;
+	switch(node.op) {
+		case IROpCode::constant:
+			r = EmitConstant(node.type, node.shape.length == 1 ? 1 : Size, node.constant.i);
+			break;
+		case IROpCode::seq: {
+			IRef j = EmitCoerce(EmitIndex(Size, node.shape.length, 1), node.type);
+			r = EmitBinary(IROpCode::add, node.type,
+				EmitConstant(node.type, 1, node.sequence.ia),
+				EmitBinary(IROpCode::mul, node.type, j, EmitConstant(node.type, 1, node.sequence.ib), 0), 0);
+		} break;
+		case IROpCode::index:
+			r = EmitIndex(Size, node.sequence.ia, node.sequence.ib);
+			break;
+		case IROpCode::load:
+			r = EmitRecycle(node.in);
+			break;
+		case IROpCode::gather:
+			r = EmitGather(node.in, Recycle(from, node.unary.a, done));
+			break;
+		default: {
+			IRNode n = node;
+			if(node.arity >= IRNode::UNARY)
+				n.unary.a = Recycle(from, node.unary.a, done);
+			if(node.arity >= IRNode::BINARY)
+				n.binary.b = Recycle(from, node.binary.b, done);
+			if(node.arity >= IRNode::TRINARY)
+				n.trinary.c = Recycle(from, node.trinary.c, done);
+			if(node.shape.length != 1)
+				n.shape = n.outShape = (IRNode::Shape) { Size, -1, 1, -1, false };
+			r = Emit(n);
+		} break;
+	}
+	done[ref] = r;
+	return r;
+}
+
 void Trace::MarkLiveOutputs(Thread& thread) {
 	
 	// Can find live outputs in the stack or in the recorded set of environments
@@ -371,7 +526,7 @@ void Trace::MarkLiveOutputs(Thread& thread) {
 		}
 	}
 	
-	for(std::set<Environment*>::const_iterator i = liveEnvironments.begin(); i != liveEnvironments.end(); ++i) {
+	for(EnvironmentSet::const_iterator i = liveEnvironments.begin(); i != liveEnvironments.end(); ++i) {
 		for(Environment::const_iterator j = (*i)->begin(); j != (*i)->end(); ++j) {
 			Value const& v = j.value();
 			if(v.isFuture() && v.length == Size) {
@@ -517,12 +672,8 @@ void Trace::AlgebraicSimplification(Thread& thread) {
 				node.arity = IRNode::UNARY;
 				node.group = IRNode::MAP;
 				node.unary.a = node.binary.a;
-			} else if(nodes[node.binary.b].constant.d == -1) {
-				// x^-1 => 1/x
-				node.op = IROpCode::div;
-				nodes[node.binary.b].constant.d = 1;
-				std::swap(node.binary.a, node.binary.b);
 			}
+			// x^-1 => 1/x is done in EmitBinary, which can emit the 1
 			// could also do x^-2 => 1/x * 1/x and x^-0.5 => sqrt(1/x) ?
 		}
 
@@ -588,18 +739,19 @@ void Trace::AlgebraicSimplification(Thread& thread) {
 			node.arity = IRNode::UNARY;
 		}
 
+		// addc and mulc keep their constant in the node itself, over binary.b
 		if(node.op == IROpCode::addc && nodes[node.binary.a].op == IROpCode::addc) {
 			if(node.isInteger())
-				node.constant.i += nodes[node.binary.b].constant.i;
+				node.constant.i += nodes[node.binary.a].constant.i;
 			else
-				node.constant.d += nodes[node.binary.b].constant.d;
+				node.constant.d += nodes[node.binary.a].constant.d;
 			node.binary.a = nodes[node.binary.a].binary.a;
 		}
 		if(node.op == IROpCode::mulc && nodes[node.binary.a].op == IROpCode::mulc) {
 			if(node.isInteger())
-				nodes[node.binary.b].constant.i *= nodes[nodes[node.binary.a].binary.b].constant.i;
+				node.constant.i *= nodes[node.binary.a].constant.i;
 			else
-				nodes[node.binary.b].constant.d *= nodes[nodes[node.binary.a].binary.b].constant.d;
+				node.constant.d *= nodes[node.binary.a].constant.d;
 			node.binary.a = nodes[node.binary.a].binary.a;
 		}
 
@@ -731,43 +883,6 @@ void Trace::AlgebraicSimplification(Thread& thread) {
 	}
 }
 
-void Trace::CSEElimination(Thread& thread) {
-	// look for exact same op somewhere above, replace myself with pos of that one...
-	//std::tr1::unordered_set<IRNode, IRHash> hash;
-	for(IRef i = 0; i < (IRef)nodes.size(); i++) {
-		IRNode& node = nodes[i];
-		switch(node.arity) {
-			case IRNode::TRINARY:
-				if(nodes[node.trinary.c].op == IROpCode::pos)
-					node.trinary.c = nodes[node.trinary.c].unary.a;
-			case IRNode::BINARY:
-				if(nodes[node.binary.b].op == IROpCode::pos)
-					node.binary.b = nodes[node.binary.b].unary.a;
-			case IRNode::UNARY:
-				if(nodes[node.unary.a].op == IROpCode::pos)
-					node.unary.a = nodes[node.unary.a].unary.a;
-			case IRNode::NULLARY:
-			default:
-				if(node.shape.filter >= 0 && nodes[node.shape.filter].op == IROpCode::pos)
-					node.shape.filter = nodes[node.shape.filter].unary.a;
-				if(node.shape.split >= 0 && nodes[node.shape.split].op == IROpCode::pos)
-					node.shape.split = nodes[node.shape.split].unary.a;
-		}
-		/*std::ir1::unordered_set<IRNode, IRHash>::const_iterator j =
-			hash.find(node);
-		if(j != */
-		for(IRef j = 0; j < i; j++) {
-			if(node == nodes[j]) {
-				node.op = IROpCode::pos;
-				node.arity = IRNode::UNARY;
-				node.group = IRNode::MAP;
-				node.unary.a = j;
-				break;
-			}
-		}
-	}
-}
-
 // Propogate liveOut to live
 void Trace::UsePropogation(Thread& thread) {
 	for(size_t i = 0; i < nodes.size(); i++) {
@@ -902,8 +1017,10 @@ void Trace::ShapePropogation(Thread& thread) {
 
 void Trace::Optimize(Thread& thread) {
 
-	if(thread.state.verbose)
+	if(thread.state.verbose) {
 		printf("executing trace:\n%s\n",toString(thread).c_str());
+		printf("cse: %d emits shared an existing node\n", (int)n_shared);
+	}
 
 	MarkLiveOutputs(thread);
 	UsePropogation(thread);
@@ -915,12 +1032,12 @@ void Trace::Optimize(Thread& thread) {
 	// Turn these back on when I'm sure about optimizing across shape changes...
 	// E.g. a <- 1:64; a[a < 32]
 	AlgebraicSimplification(thread);
-	//CSEElimination(thread);
 
-	// move outputs up...
+	// move outputs up, but not past the pos that applies a filter
 	for(size_t i = 0; i < outputs.size(); i++) {
 		IRef& r = outputs[i].ref;
-		while(nodes[r].op == IROpCode::pos) {
+		while(nodes[r].op == IROpCode::pos &&
+			nodes[r].shape.filter == nodes[nodes[r].unary.a].outShape.filter) {
 			nodes[r].liveOut = false;
 			r = nodes[r].unary.a;
 		}
@@ -972,13 +1089,172 @@ void Trace::Execute(Thread & thread, IRef ref) {
 	Execute(thread);
 }
 
+Value Trace::ScalarOperand(IRef ref) const {
+	IRNode const& node = nodes[ref];
+	if(node.op == IROpCode::constant) {
+		switch(node.type) {
+			case Type::Double: return Double::c(node.constant.d);
+			case Type::Integer: return Integer::c(node.constant.i);
+			case Type::Logical: return Logical::c(node.constant.l);
+			default: _error("Unknown type in trace scalar");
+		}
+	}
+	return node.out;
+}
+
+// Maps over single values are cheaper done once here than in every
+// iteration of a compiled body, which would also have to store them.
+void Trace::EvaluateScalar(Thread & thread, IRNode& node) {
+	Value r;
+	switch(node.op) {
+		case IROpCode::broadcast:
+			r = nodes[node.unary.a].out;
+			break;
+		case IROpCode::cast:
+			r = ScalarOperand(node.unary.a);
+			break;
+		case IROpCode::addc:
+		case IROpCode::mulc: {
+			Value c = node.isDouble() ? (Value)Double::c(node.constant.d) : (Value)Integer::c(node.constant.i);
+			if(node.op == IROpCode::addc)
+				ArithBinary1Dispatch<addVOp>(thread, ScalarOperand(node.unary.a), c, r);
+			else
+				ArithBinary1Dispatch<mulVOp>(thread, ScalarOperand(node.unary.a), c, r);
+		} break;
+#define UNARY(Name, string, Group, ...) case IROpCode::Name: Group##Dispatch<Name##VOp>(thread, ScalarOperand(node.unary.a), r); break;
+#define BINARY(Name, string, Group, ...) case IROpCode::Name: Group##Dispatch<Name##VOp>(thread, ScalarOperand(node.binary.a), ScalarOperand(node.binary.b), r); break;
+		UNARY_BYTECODES(UNARY)
+		BINARY_BYTECODES(BINARY)
+#undef UNARY
+#undef BINARY
+		default:
+			_error(std::string("Unsupported scalar op in trace: ") + IROpCode::toString(node.op));
+	}
+	node.out = As(thread, node.type, r);
+}
+
+static bool isScalar(IRNode const& node) {
+	return node.group == IRNode::MAP && node.shape.length == 1;
+}
+
+// Maps that read a reduction recorded earlier in the same trace (x - mean(x))
+// can't run in the pass that computes it. Such traces run in phases: a
+// broadcast sits one phase after its reduction, everything else in the
+// phase of its latest operand. Each phase is compiled and run as a trace
+// of its own. Between phases GlobalReduce has merged the reductions, so
+// the broadcasts and the maps over them are evaluated here and go into
+// the next phase as constants. Vectors a later phase reads again are
+// recomputed there rather than kept in memory.
+void Trace::JITPhases(Thread & thread) {
+	std::vector<int64_t> phase(nodes.size(), 0);
+	int64_t phases = 1;
+	bool scalars = false;
+	for(IRef ref = 0; ref < (IRef)nodes.size(); ref++) {
+		IRNode const& node = nodes[ref];
+		int64_t& p = phase[ref];
+		switch(node.arity) {
+			case IRNode::TRINARY: p = std::max(p, phase[node.trinary.c]);
+			case IRNode::BINARY: p = std::max(p, phase[node.binary.b]);
+			case IRNode::UNARY: p = std::max(p, phase[node.unary.a]);
+			case IRNode::NULLARY: break;
+		}
+		if(node.shape.filter >= 0)
+			p = std::max(p, phase[node.shape.filter]);
+		if(node.shape.split >= 0)
+			p = std::max(p, phase[node.shape.split]);
+		if(node.op == IROpCode::broadcast)
+			p = phase[node.unary.a]+1;
+		phases = std::max(phases, p+1);
+		scalars = scalars || isScalar(node);
+	}
+
+	if(phases == 1 && !scalars) {
+		JIT(thread);
+		return;
+	}
+
+	for(int64_t p = 0; p < phases; p++) {
+		for(IRef ref = 0; ref < (IRef)nodes.size(); ref++) {
+			if(phase[ref] == p && isScalar(nodes[ref]))
+				EvaluateScalar(thread, nodes[ref]);
+		}
+
+		// this phase's vector outputs and reductions, and what they read.
+		// sload and sstore only read outputs, in GlobalReduce.
+		std::vector<bool> needed(nodes.size(), false);
+		bool any = false;
+		for(IRef ref = (IRef)nodes.size()-1; ref >= 0; ref--) {
+			IRNode const& node = nodes[ref];
+			if(phase[ref] == p && node.op != IROpCode::nop && !isScalar(node) &&
+				(node.liveOut || node.group == IRNode::FOLD || node.group == IRNode::SCALAR))
+				needed[ref] = any = true;
+			if(!needed[ref] || isScalar(node) || node.group == IRNode::SCALAR)
+				continue;
+			switch(node.arity) {
+				case IRNode::TRINARY: needed[node.trinary.c] = true;
+				case IRNode::BINARY: needed[node.binary.b] = true;
+				case IRNode::UNARY: needed[node.unary.a] = true;
+				case IRNode::NULLARY: break;
+			}
+			if(node.shape.filter >= 0)
+				needed[node.shape.filter] = true;
+			if(node.shape.split >= 0)
+				needed[node.shape.split] = true;
+		}
+		if(!any)
+			continue;
+
+		Trace t;
+		t.Size = Size;
+		t.nodes = nodes;
+		for(IRef ref = 0; ref < (IRef)nodes.size(); ref++) {
+			IRNode& node = t.nodes[ref];
+			if(!needed[ref]) {
+				node.op = IROpCode::nop;
+				node.arity = IRNode::NULLARY;
+				node.group = IRNode::NOP;
+				node.liveOut = false;
+			} else if(isScalar(node)) {
+				Value const& v = nodes[ref].out;
+				node.op = IROpCode::constant;
+				node.arity = IRNode::NULLARY;
+				node.group = IRNode::GENERATOR;
+				node.liveOut = false;
+				switch(node.type) {
+					case Type::Double: node.constant.d = ((Double const&)v)[0]; break;
+					case Type::Integer: node.constant.i = ((Integer const&)v)[0]; break;
+					case Type::Logical: node.constant.l = ((Logical const&)v)[0]; break;
+					default: _error("Unknown type in trace scalar");
+				}
+			} else if(phase[ref] < p) {
+				node.liveOut = false;
+			}
+		}
+
+		if(thread.state.verbose)
+			printf("trace phase %d of %d\n", (int)p+1, (int)phases);
+		t.JIT(thread);
+
+		for(IRef ref = 0; ref < (IRef)nodes.size(); ref++) {
+			if(needed[ref] && phase[ref] == p)
+				nodes[ref].out = t.nodes[ref].out;
+		}
+	}
+}
+
 // everything must be evaluated in the end...
 void Trace::Execute(Thread & thread) {
 	Optimize(thread);
 	// if there were any live outputs
 	if(outputs.size() > 0) {
-		JIT(thread);
+		JITPhases(thread);
 		WriteOutputs(thread);
 	}
+	if(thread.state.verbose) {
+		TracePool const& pool = thread.traces.pool;
+		printf("trace buffers: %d temporaries (%d reused, %d bytes), %d outputs (%d bytes)\n",
+			(int)pool.temps, (int)pool.reused, (int)pool.tempBytes,
+			(int)pool.outputs, (int)pool.outputBytes);
+	}
 	Reset();
 }
@@ -10,13 +10,22 @@
 //recording interpreter
 #define TRACE_MAX_RECORDED (1024)
 
-struct TraceCodeBuffer;
+// trace temporaries come in power of two sizes from 1 << TRACE_POOL_MIN_CLASS bytes
+#define TRACE_POOL_MIN_CLASS (10)
+#define TRACE_POOL_CLASSES (48)
+// most memory TracePool keeps for reuse between runs
+#define TRACE_POOL_BYTES (256LL << 20)
+
+struct TraceCache;
+bool HasNA(Value const& v);	// a logical holding an NA
+
 class Trace : public gc {
 
 	public:	
 
 		std::vector<IRNode, traceable_allocator<IRNode> > nodes;
-		std::set<Environment*> liveEnvironments;
+		typedef std::set<Environment*, std::less<Environment*>, traceable_allocator<Environment*> > EnvironmentSet;
+		EnvironmentSet liveEnvironments;
 
 		struct Output {
 			enum Type { REG, MEMORY };
@@ -28,16 +37,16 @@ class Trace : public gc {
 			IRef ref;	   //location of the associated store
 		};
 
-		std::vector<Output> outputs;
-
-		TraceCodeBuffer * code_buffer;
+		std::vector<Output, traceable_allocator<Output> > outputs;
 
 		size_t n_recorded_since_last_exec;
+		size_t n_shared;	// emits answered with an existing node
 
 		int64_t Size;
 
 		Trace();
 
+		IRef Emit(IRNode const& n);
 		IRef EmitCoerce(IRef a, Type::Enum dst_type);
 		IRef EmitUnary(IROpCode::Enum op, Type::Enum type, IRef a, int64_t data); 
 		IRef EmitBinary(IROpCode::Enum op, Type::Enum type, IRef a, IRef b, int64_t data);
@@ -57,10 +66,22 @@ class Trace : public gc {
 		IRef EmitLoad(Value const& v, int64_t length, int64_t offset);
 		IRef EmitSLoad(Value const& v);
 		IRef EmitSStore(IRef ref, int64_t index, IRef value);
+		IRef EmitBroadcast(IRef a);
+		IRef EmitRecycle(Value const& v);
+
+		bool Recyclable(IRef ref) const;
+		IRef Recycle(Trace const& from, IRef ref, std::map<IRef, IRef>& done);
 
 		IRef GetRef(Value const& v) {
-			if(v.isFuture()) return v.future.ref;
+			if(v.isFuture()) {
+				// maps read a reduction's final value, not its running one
+				IRNode const& node = nodes[v.future.ref];
+				if(node.group == IRNode::FOLD && node.outShape.length == 1)
+					return EmitBroadcast(v.future.ref);
+				return v.future.ref;
+			}
 			else if(v.length == 1) return EmitConstant(v.type, 1, v.i);
+			else if(v.length != Size) return EmitRecycle(v);
 			else return EmitLoad(v,v.length,0);
 		}
 
@@ -69,17 +90,23 @@ class Trace : public gc {
 		void Reset();
 
 	private:
+		// node hash to the nodes with it, for Emit
+		typedef std::multimap<uint64_t, IRef> CSETable;
+		CSETable cse;
+
 		void WriteOutputs(Thread & thread);
 		std::string toString(Thread & thread);
 
 		void Interpret(Thread & thread);
 		void Optimize(Thread& thread);
 		void JIT(Thread & thread);
+		void JITPhases(Thread & thread);
+		Value ScalarOperand(IRef ref) const;
+		void EvaluateScalar(Thread & thread, IRNode& node);
 
 		void MarkLiveOutputs(Thread& thread);
 		void SimplifyOps(Thread& thread);
 		void AlgebraicSimplification(Thread& thread);
-		void CSEElimination(Thread& thread);
 		void UsePropogation(Thread& thread);
 		void DefPropogation(Thread& thread);
 		void DeadCodeElimination(Thread& thread);
@@ -87,26 +114,114 @@ class Trace : public gc {
 		void ShapePropogation(Thread& thread);
 };
 
+// Memory a trace needs only while it runs: fold partials, filter masks,
+// filtered outputs before they're compacted and reductions nothing reads
+// afterwards. Buffers are handed out in power of two size classes and all
+// taken back once Traces::Bind or Flush is done, so the next run reuses
+// them rather than allocating from the collected heap. They never hold
+// pointers, so the collector doesn't need to see them. Outputs that outlive
+// the run are still ordinary vectors.
+class TracePool {
+	std::vector<void*> lists[TRACE_POOL_CLASSES];
+	std::vector<std::pair<int, void*> > taken;
+	int64_t held;	// bytes on the free lists
+
+public:
+	// counters for the trace being run, see Trace::Execute
+	int64_t temps, reused, tempBytes, outputs, outputBytes;
+
+	TracePool() : held(0) { ClearCounters(); }
+
+	void ClearCounters() {
+		temps = reused = tempBytes = outputs = outputBytes = 0;
+	}
+
+	template<class V>
+	V& Temp(Value& v, int64_t length) {
+		Value::Init(v, V::VectorType, length);
+		if(length > 1) {
+			// even length so SSE can work on the tail
+			uint64_t size = sizeof(typename V::Element)*(length + (length & 1));
+			int c = std::max(TRACE_POOL_MIN_CLASS, 64 - __builtin_clzll(size-1));
+			if(!lists[c].empty()) {
+				v.p = lists[c].back();
+				lists[c].pop_back();
+				held -= 1LL << c;
+				reused++;
+			}
+			else if(posix_memalign(&v.p, 64, 1ULL << c) != 0)
+				_error("Out of memory for trace temporaries");
+			taken.push_back(std::make_pair(c, v.p));
+			temps++;
+			tempBytes += 1LL << c;
+		}
+		return (V&)v;
+	}
+
+	// a vector that outlives the run, from the collected heap
+	template<class V>
+	V& Output(Value& v, int64_t length) {
+		V::Init(v, length);
+		outputs++;
+		outputBytes += sizeof(typename V::Element)*length;
+		return (V&)v;
+	}
+
+	// take back everything handed out, keeping up to TRACE_POOL_BYTES of it
+	void Release() {
+		for(size_t i = 0; i < taken.size(); i++) {
+			int c = taken[i].first;
+			if(held + (1LL << c) <= TRACE_POOL_BYTES) {
+				lists[c].push_back(taken[i].second);
+				held += 1LL << c;
+			}
+			else
+				free(taken[i].second);
+		}
+		taken.clear();
+		ClearCounters();
+	}
+};
+
 class Traces {
 private:
 	std::vector<Trace*, traceable_allocator<Trace*> > availableTraces;
 	std::map<int64_t, Trace*, std::less<int64_t>, traceable_allocator<std::pair<int64_t, Trace*> > > traces;
 
 public:
+	TraceCache* cache;	// compiled traces, see trace_compile.cpp
+	TracePool pool;
+
+	Traces() : cache(NULL) {}
 
 	Type::Enum futureType(Value const& v) const {
 		if(v.isFuture()) return v.future.typ;
 		else return v.type;
 	}
 
+	// Single values (see isScalarFuture) block everything but maps, which
+	// isTraceableScalar lets through separately.
 	IRNode::Shape futureShape(Value const& v) const {
 		if(v.isFuture()) {
-			return traces.find(v.length)->second->nodes[v.future.ref].outShape;
+			IRNode::Shape shape = traces.find(v.length)->second->nodes[v.future.ref].outShape;
+			if(shape.length == 1)
+				shape.blocking = true;
+			return shape;
 		}
 		else 
 			return (IRNode::Shape) { v.length, -1, 1, -1 };
 	}
 
+	// A single value computed by a trace: a reduction of a whole vector or a
+	// map over such reductions. Maps recorded later in the same trace read
+	// it as a broadcast scalar, computed in an earlier phase (see JITPhases).
+	bool isScalarFuture(Value const& v) const {
+		if(!v.isFuture()) return false;
+		IRNode const& node = traces.find(v.length)->second->nodes[v.future.ref];
+		return node.outShape.length == 1 &&
+			(node.group == IRNode::FOLD || node.group == IRNode::MAP);
+	}
+
 	Trace* getTrace(int64_t length) {
 		if(traces.find(length) == traces.end()) {
 			if(availableTraces.size() == 0) {
@@ -126,29 +241,40 @@ public:
 		return getTrace(a.length);
 	}
 
+	// operands of different lengths recycle to the longest, see isRecyclable
 	Trace* getTrace(Value const& a, Value const& b) {
-		int64_t la = a.length;
-		int64_t lb = b.length;
-		if(la == lb || la == 1)
-			return getTrace(lb);
-		else if(lb == 1)
-			return getTrace(la);
-		else
-			_error("Shouldn't get here");
+		return getTrace(std::max(a.length, b.length));
 	}
 
 	Trace* getTrace(Value const& a, Value const& b, Value const& c) {
-		int64_t la = a.length;
-		int64_t lb = b.length;
-		int64_t lc = c.length;
-		if(la != 1)
-			return getTrace(la);
-		else if(lb != 1)
-			return getTrace(lb);
-		else if(lc != 1)
-			return getTrace(lc);
-		else
-			_error("Shouldn't get here");
+		return getTrace(std::max(std::max(a.length, b.length), c.length));
+	}
+
+	// R recycles the shorter of two operands when its length divides the
+	// longer's. Both can then go in the longer's trace: a plain vector is read
+	// through a gather, a future from the shorter trace recorded again (see
+	// Trace::Recycle). A filtered or split future's length isn't known until
+	// it runs, so it can't take part.
+	bool isRecyclable(Value const& a, Value const& b) const {
+		if(a.length == b.length || a.length == 1 || b.length == 1)
+			return true;
+		Value const& s = a.length < b.length ? a : b;
+		Value const& l = a.length < b.length ? b : a;
+		IRNode::Shape shape = futureShape(l);
+		if(s.length == 0 || l.length % s.length != 0 ||
+			shape.filter >= 0 || shape.split >= 0)
+			return false;
+		if(s.isFuture())
+			return traces.find(s.length)->second->Recyclable(s.future.ref);
+		return s.isDouble() || s.isInteger();
+	}
+
+	IRef GetRef(Trace* trace, Value const& v) {
+		if(v.isFuture() && v.length != trace->Size) {
+			std::map<IRef, IRef> done;
+			return trace->Recycle(*traces.find(v.length)->second, v.future.ref, done);
+		}
+		return trace->GetRef(v);
 	}
 
 	template< template<class X> class Group >
@@ -157,14 +283,14 @@ public:
 		Trace* trace = getTrace(a);
 		trace->liveEnvironments.insert(env);
 		if(futureType(a) == Type::Double) {
-			r = trace->EmitUnary(op, Group<Double>::R::VectorType, trace->EmitCoerce(trace->GetRef(a), Group<Double>::MA::VectorType), data);
+			r = trace->EmitUnary(op, Group<Double>::R::VectorType, trace->EmitCoerce(GetRef(trace, a), Group<Double>::MA::VectorType), data);
 		} else if(futureType(a) == Type::Integer) {
-			r = trace->EmitUnary(op, Group<Integer>::R::VectorType, trace->EmitCoerce(trace->GetRef(a), Group<Integer>::MA::VectorType), data);
+			r = trace->EmitUnary(op, Group<Integer>::R::VectorType, trace->EmitCoerce(GetRef(trace, a), Group<Integer>::MA::VectorType), data);
 		} else if(futureType(a) == Type::Logical) {
-			r = trace->EmitUnary(op, Group<Logical>::R::VectorType, trace->EmitCoerce(trace->GetRef(a), Group<Logical>::MA::VectorType), data);
+			r = trace->EmitUnary(op, Group<Logical>::R::VectorType, trace->EmitCoerce(GetRef(trace, a), Group<Logical>::MA::VectorType), data);
 		} else _error("Attempting to record invalid type in EmitUnary");
 		Value v;
-		Future::Init(v, trace->nodes[r].type, trace->nodes[r].shape.length, r);
+		Future::Init(v, trace->nodes[r].type, trace->Size, r);
 		return v;
 	}
 
@@ -175,40 +301,43 @@ public:
 		trace->liveEnvironments.insert(env);
 		if(futureType(a) == Type::Double) {
 			if(futureType(b) == Type::Double)
-				r = trace->EmitBinary(op, Group<Double,Double>::R::VectorType, trace->EmitCoerce(trace->GetRef(a), Group<Double,Double>::MA::VectorType), trace->EmitCoerce(trace->GetRef(b), Group<Double,Double>::MB::VectorType), data);
+				r = trace->EmitBinary(op, Group<Double,Double>::R::VectorType, trace->EmitCoerce(GetRef(trace, a), Group<Double,Double>::MA::VectorType), trace->EmitCoerce(GetRef(trace, b), Group<Double,Double>::MB::VectorType), data);
 			else if(futureType(b) == Type::Integer)
-				r = trace->EmitBinary(op, Group<Double,Integer>::R::VectorType, trace->EmitCoerce(trace->GetRef(a), Group<Double,Integer>::MA::VectorType), trace->EmitCoerce(trace->GetRef(b), Group<Double,Integer>::MB::VectorType), data);
+				r = trace->EmitBinary(op, Group<Double,Integer>::R::VectorType, trace->EmitCoerce(GetRef(trace, a), Group<Double,Integer>::MA::VectorType), trace->EmitCoerce(GetRef(trace, b), Group<Double,Integer>::MB::VectorType), data);
 			else if(futureType(b) == Type::Logical)
-				r = trace->EmitBinary(op, Group<Double,Logical>::R::VectorType, trace->EmitCoerce(trace->GetRef(a), Group<Double,Logical>::MA::VectorType), trace->EmitCoerce(trace->GetRef(b), Group<Double,Logical>::MB::VectorType), data);
+				r = trace->EmitBinary(op, Group<Double,Logical>::R::VectorType, trace->EmitCoerce(GetRef(trace, a), Group<Double,Logical>::MA::VectorType), trace->EmitCoerce(GetRef(trace, b), Group<Double,Logical>::MB::VectorType), data);
 			else _error("Attempting to record invalid type in EmitBinary");
 		} else if(futureType(a) == Type::Integer) {
 			if(futureType(b) == Type::Double)
-				r = trace->EmitBinary(op, Group<Integer,Double>::R::VectorType, trace->EmitCoerce(trace->GetRef(a), Group<Integer,Double>::MA::VectorType), trace->EmitCoerce(trace->GetRef(b), Group<Integer,Double>::MB::VectorType), data);
+				r = trace->EmitBinary(op, Group<Integer,Double>::R::VectorType, trace->EmitCoerce(GetRef(trace, a), Group<Integer,Double>::MA::VectorType), trace->EmitCoerce(GetRef(trace, b), Group<Integer,Double>::MB::VectorType), data);
 			else if(futureType(b) == Type::Integer)
-				r = trace->EmitBinary(op, Group<Integer,Integer>::R::VectorType, trace->EmitCoerce(trace->GetRef(a), Group<Integer,Integer>::MA::VectorType), trace->EmitCoerce(trace->GetRef(b), Group<Integer,Integer>::MB::VectorType), data);
+				r = trace->EmitBinary(op, Group<Integer,Integer>::R::VectorType, trace->EmitCoerce(GetRef(trace, a), Group<Integer,Integer>::MA::VectorType), trace->EmitCoerce(GetRef(trace, b), Group<Integer,Integer>::MB::VectorType), data);
 			else if(futureType(b) == Type::Logical)
-				r = trace->EmitBinary(op, Group<Integer,Logical>::R::VectorType, trace->EmitCoerce(trace->GetRef(a), Group<Integer,Logical>::MA::VectorType), trace->EmitCoerce(trace->GetRef(b), Group<Integer,Logical>::MB::VectorType), data);
+				r = trace->EmitBinary(op, Group<Integer,Logical>::R::VectorType, trace->EmitCoerce(GetRef(trace, a), Group<Integer,Logical>::MA::VectorType), trace->EmitCoerce(GetRef(trace, b), Group<Integer,Logical>::MB::VectorType), data);
 			else _error("Attempting to record invalid type in EmitBinary");
 		} else if(futureType(a) == Type::Logical) {
 			if(futureType(b) == Type::Double)
-				r = trace->EmitBinary(op, Group<Logical,Double>::R::VectorType, trace->EmitCoerce(trace->GetRef(a), Group<Logical,Double>::MA::VectorType), trace->EmitCoerce(trace->GetRef(b), Group<Logical,Double>::MB::VectorType), data);
+				r = trace->EmitBinary(op, Group<Logical,Double>::R::VectorType, trace->EmitCoerce(GetRef(trace, a), Group<Logical,Double>::MA::VectorType), trace->EmitCoerce(GetRef(trace, b), Group<Logical,Double>::MB::VectorType), data);
 			else if(futureType(b) == Type::Integer)
-				r = trace->EmitBinary(op, Group<Logical,Integer>::R::VectorType, trace->EmitCoerce(trace->GetRef(a), Group<Logical,Integer>::MA::VectorType), trace->EmitCoerce(trace->GetRef(b), Group<Logical,Integer>::MB::VectorType), data);
+				r = trace->EmitBinary(op, Group<Logical,Integer>::R::VectorType, trace->EmitCoerce(GetRef(trace, a), Group<Logical,Integer>::MA::VectorType), trace->EmitCoerce(GetRef(trace, b), Group<Logical,Integer>::MB::VectorType), data);
 			else if(futureType(b) == Type::Logical)
-				r = trace->EmitBinary(op, Group<Logical,Logical>::R::VectorType, trace->EmitCoerce(trace->GetRef(a), Group<Logical,Logical>::MA::VectorType), trace->EmitCoerce(trace->GetRef(b), Group<Logical,Logical>::MB::VectorType), data);
+				r = trace->EmitBinary(op, Group<Logical,Logical>::R::VectorType, trace->EmitCoerce(GetRef(trace, a), Group<Logical,Logical>::MA::VectorType), trace->EmitCoerce(GetRef(trace, b), Group<Logical,Logical>::MB::VectorType), data);
 			else _error("Attempting to record invalid type in EmitBinary");
 		} else _error("Attempting to record invalid type in EmitBinary");
 		Value v;
-		Future::Init(v, trace->nodes[r].type, trace->nodes[r].shape.length, r);
+		Future::Init(v, trace->nodes[r].type, trace->Size, r);
 		return v;
 	}
 
+	// b holds R's 1-based factor codes, the trace's groups are 0-based
 	Value EmitSplit(Environment* env, Value const& a, Value const& b, int64_t data) {
 		Trace* trace = getTrace(a,b);
 		trace->liveEnvironments.insert(env);
-		IRef r = trace->EmitSplit(trace->GetRef(a), trace->EmitCoerce(trace->GetRef(b), Type::Integer), data);
+		IRef o = trace->EmitConstant(Type::Integer, 1, 1);
+		IRef f = trace->EmitBinary(IROpCode::sub, Type::Integer, trace->EmitCoerce(GetRef(trace, b), Type::Integer), o, 0);
+		IRef r = trace->EmitSplit(GetRef(trace, a), f, data);
 		Value v;
-		Future::Init(v, trace->nodes[r].type, trace->nodes[r].shape.length, r);
+		Future::Init(v, trace->nodes[r].type, trace->Size, r);
 		return v;
 	}
 
@@ -217,7 +346,7 @@ public:
 		trace->liveEnvironments.insert(env);
 		IRef r = trace->EmitConstant(type, length, c);
 		Value v;
-		Future::Init(v, trace->nodes[r].type, trace->nodes[r].shape.length, r);
+		Future::Init(v, trace->nodes[r].type, trace->Size, r);
 		return v;
 	}
 
@@ -226,7 +355,7 @@ public:
 		trace->liveEnvironments.insert(env);
 		IRef r = trace->EmitRandom(length);
 		Value v;
-		Future::Init(v, trace->nodes[r].type, trace->nodes[r].shape.length, r);
+		Future::Init(v, trace->nodes[r].type, trace->Size, r);
 		return v;
 	}
 
@@ -235,7 +364,7 @@ public:
 		trace->liveEnvironments.insert(env);
 		IRef r = trace->EmitBinary(IROpCode::add, Type::Integer, trace->EmitIndex(length, a, b), trace->EmitConstant(Type::Integer, length, 1), 0);
 		Value v;
-		Future::Init(v, trace->nodes[r].type, trace->nodes[r].shape.length, r);
+		Future::Init(v, trace->nodes[r].type, trace->Size, r);
 		return v;
 	}
 		
@@ -244,7 +373,7 @@ public:
 		trace->liveEnvironments.insert(env);
 		IRef r = trace->EmitSequence(length, a, b);
 		Value v;
-		Future::Init(v, trace->nodes[r].type, trace->nodes[r].shape.length, r);
+		Future::Init(v, trace->nodes[r].type, trace->Size, r);
 		return v;
 	}
 
@@ -253,7 +382,7 @@ public:
 		trace->liveEnvironments.insert(env);
 		IRef r = trace->EmitSequence(length, a, b);
 		Value v;
-		Future::Init(v, trace->nodes[r].type, trace->nodes[r].shape.length, r);
+		Future::Init(v, trace->nodes[r].type, trace->Size, r);
 		return v;
 	}
 
@@ -261,19 +390,19 @@ public:
 		Trace* trace = getTrace(i);
 		trace->liveEnvironments.insert(env);
 		IRef o = trace->EmitConstant(Type::Integer, 1, 1);
-		IRef im1 = trace->EmitBinary(IROpCode::sub, Type::Integer, trace->EmitCoerce(trace->GetRef(i), Type::Integer), o, 0);
+		IRef im1 = trace->EmitBinary(IROpCode::sub, Type::Integer, trace->EmitCoerce(GetRef(trace, i), Type::Integer), o, 0);
 		IRef r = trace->EmitGather(a, im1);
 		Value v;
-		Future::Init(v, trace->nodes[r].type, trace->nodes[r].shape.length, r);
+		Future::Init(v, trace->nodes[r].type, trace->Size, r);
 		return v;
 	}
 
 	Value EmitFilter(Environment* env, Value const& a, Value const& i) {
 		Trace* trace = getTrace(a);
 		trace->liveEnvironments.insert(env);
-		IRef r = trace->EmitFilter(trace->GetRef(a), trace->EmitCoerce(trace->GetRef(i), Type::Logical));
+		IRef r = trace->EmitFilter(GetRef(trace, a), trace->EmitCoerce(GetRef(trace, i), Type::Logical));
 		Value v;
-		Future::Init(v, trace->nodes[r].type, trace->nodes[r].shape.length, r);
+		Future::Init(v, trace->nodes[r].type, trace->Size, r);
 		return v;
 	}
 
@@ -281,11 +410,11 @@ public:
 		Trace* trace = getTrace(a,b,cond);
 		trace->liveEnvironments.insert(env);
 		
-		IRef r = trace->EmitIfElse( 	trace->GetRef(a),
-						trace->GetRef(b),
-						trace->GetRef(cond));
+		IRef r = trace->EmitIfElse( 	GetRef(trace, a),
+						GetRef(trace, b),
+						GetRef(trace, cond));
 		Value v;
-		Future::Init(v, trace->nodes[r].type, trace->nodes[r].shape.length, r);
+		Future::Init(v, trace->nodes[r].type, trace->Size, r);
 		return v;
 	}
 	
@@ -294,11 +423,13 @@ public:
 		trace->liveEnvironments.insert(env);
 		
 		IRef m = a.isFuture() ? a.future.ref : trace->EmitSLoad(a);
+		// GlobalReduce stores a reduction's final value itself
+		IRef x = b.isFuture() ? b.future.ref : GetRef(trace, b);
 
-		IRef r = trace->EmitSStore(m, index, trace->GetRef(b));
+		IRef r = trace->EmitSStore(m, index, x);
 		
 		Value v;
-		Future::Init(v, trace->nodes[r].type, trace->nodes[r].shape.length, r);
+		Future::Init(v, trace->nodes[r].type, trace->Size, r);
 		return v;
 	}
 	
@@ -325,6 +456,12 @@ public:
 		trace->Reset();
 		availableTraces.push_back(trace);
 		traces.erase(i);
+		pool.Release();
+	}
+
+	// traces recorded but not run yet
+	bool pending() const {
+		return !traces.empty();
 	}
 
 	void Flush(Thread & thread) {
@@ -334,6 +471,7 @@ public:
 			trace->Execute(thread);
 			trace->Reset();
 			availableTraces.push_back(trace);
+			pool.Release();
 		}
 		traces.clear();
 	}
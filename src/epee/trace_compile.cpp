@@ -1,11 +1,14 @@
 #include <sys/mman.h>
 #include <math.h>
 #include <pthread.h>
+#include <cpuid.h>
+#include <queue>
 
 #include "../interpreter.h"
 #include "../vector.h"
 #include "../ops.h"
 #include "../runtime.h"
+#include "../vmath.h"
 #include "assembler-x64.h"
 #include "register_set.h"
 
@@ -16,9 +19,20 @@
 using namespace v8::internal;
 
 #define SIMD_WIDTH (2 * sizeof(double))
+// most code a single trace may compile to
 #define CODE_BUFFER_SIZE (256 * 2048)
+// compiled traces are kept in executable chunks of this size
+#define TRACE_CODE_CHUNK (8 << 20)
+#define TRACE_CONSTANTS 8192
 
 #define BIG_CARDINALITY 1024 
+// outputs at least this big get their pages first touched in parallel when threads are pinned
+#define FIRST_TOUCH_BYTES (1 << 20)
+#define PAGE_BYTES 4096
+// filtered outputs are compacted in blocks of this many elements
+#define COMPACT_BLOCK 4096
+// grouped folds merge their per thread tables in blocks of this many levels
+#define MERGE_BLOCK 4096
 
 struct Constant {
 	Constant() {}
@@ -61,6 +75,7 @@ enum ConstantTableEntry {
 	C_NEG_MASK = 0x1,
 	C_NOT_MASK = 0x2,
 	C_PACK_LOGICAL = 0x3,
+	C_LOW_LANE = 0x4,
 	C_INTEGER_ONE  = 0x5,
 	C_INTEGER_TWO  = 0x6,
 	C_DOUBLE_ZERO = 0x7,
@@ -73,38 +88,140 @@ enum ConstantTableEntry {
 	C_FIRST_TRACE_CONST = 0xe
 };
 
-static int make_executable(char * data, size_t size) {
-	int64_t page = (int64_t)data & ~0x7FFF;
-	int64_t psize = (int64_t)data + size - page;
-	return mprotect((void*)page,psize, PROT_READ | PROT_WRITE | PROT_EXEC);
+// Whether the CPU and OS support 256-bit AVX (the OS must save the ymm
+// state on context switches, see XGETBV).
+static bool CpuHasAVX() {
+	unsigned int eax, ebx, ecx, edx;
+	if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return false;
+	if(!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX))
+		return false;
+	unsigned int lo, hi;
+	__asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+	return (lo & 0x6) == 0x6;
 }
 
-//scratch space that is reused across traces
-struct TraceCodeBuffer {
-	Constant constant_table[8192] __attribute__((aligned(16)));
-	char code[CODE_BUFFER_SIZE] __attribute__((aligned(16)));
-	TraceCodeBuffer() {
-		//make the code executable
-		if(0 != make_executable(code,CODE_BUFFER_SIZE)) {
-			_error("mprotect failed.");
-		}
+// A value the compiled code reads from its constant table that comes from
+// the trace rather than from the code: inputs, outputs and temporaries of
+// a node, and the constants lifted out of it. Rewritten on every run.
+struct Binding {
+	enum Kind {
+		CONSTANT,	// node.constant
+		SEQ_INITIAL,	// first two elements of a seq
+		SEQ_STEP,	// a seq's increment per iteration
+		INPUT,		// where a load or gather reads from
+		TEMP,		// node.in: fold accumulators and filter masks
+		OUTPUT		// node.out
+	};
+	Kind kind;
+	IRef ref;
+	uint32_t slot;
+};
+
+// A compiled trace body. Code is only reused for traces with the same
+// key, so everything but its bindings can be baked into it.
+struct TraceCode {
+	std::vector<int64_t> key;
+	char* code;
+	Constant* constants;	// what the code runs against
+	Constant* initial;	// the table as compiled, literals and fold identities
+	uint32_t slots;
+	std::vector<Binding> bindings;
+	uint64_t runs;
+	uint32_t spills;	// values the register allocator evicted
+	uint32_t spillSlots;	// stack slots they shared
+	// what the body, its compaction and its merge cost per element
+	Grain grain, count, scatter, merge;
+
+	TraceCode() : grain(128), count(1), scatter(1), merge(1) {}
+};
+
+// Compiled traces of one thread, keyed on the structure of their IR.
+struct TraceCache {
+	Constant scratch[TRACE_CONSTANTS] __attribute__((aligned(16)));
+
+	std::map<uint64_t, std::vector<TraceCode*> > entries;
+	char* chunk;		// executable region new code is placed in
+	uint64_t used;
+
+	uint64_t lookups, hits, compiles;
+
+	bool avx;
+
+	TraceCache() : chunk(0), used(0), lookups(0), hits(0), compiles(0), avx(CpuHasAVX()) {
 		//fill in the constant table
-		constant_table[C_ABS_MASK] = Constant((uint64_t)0x7FFFFFFFFFFFFFFFULL);
-		constant_table[C_NEG_MASK] = Constant((uint64_t)0x8000000000000000ULL);
-		constant_table[C_NOT_MASK] = Constant((uint64_t)0xFFFFFFFFFFFFFFFFULL);
-		constant_table[C_PACK_LOGICAL] = Constant((uint64_t)0x0706050403020800LL,(uint64_t)0x0F0E0D0C0B0A0901LL);
-		constant_table[C_INTEGER_ONE] = Constant((int64_t)1LL,(int64_t)1LL);
-		constant_table[C_INTEGER_TWO] = Constant((int64_t)2LL,(int64_t)2LL);
-		constant_table[C_DOUBLE_ZERO] = Constant(0.0, 0.0);
-		constant_table[C_DOUBLE_ONE] = Constant(1.0, 1.0);
-		constant_table[C_DOUBLE_NA] = Constant(Double::NAelement, Double::NAelement);
-		constant_table[C_INTEGER_MIN] = Constant((int64_t)std::numeric_limits<int64_t>::min(),(int64_t)std::numeric_limits<int64_t>::min());
-		constant_table[C_INTEGER_MAX] = Constant((int64_t)std::numeric_limits<int64_t>::max(),(int64_t)std::numeric_limits<int64_t>::max());
-		constant_table[C_DOUBLE_MIN] = Constant(-std::numeric_limits<double>::infinity(),-std::numeric_limits<double>::infinity());
-		constant_table[C_DOUBLE_MAX] = Constant(std::numeric_limits<double>::infinity(),std::numeric_limits<double>::infinity());
+		scratch[C_ABS_MASK] = Constant((uint64_t)0x7FFFFFFFFFFFFFFFULL);
+		scratch[C_NEG_MASK] = Constant((uint64_t)0x8000000000000000ULL);
+		scratch[C_NOT_MASK] = Constant((uint64_t)0xFFFFFFFFFFFFFFFFULL);
+		scratch[C_PACK_LOGICAL] = Constant((uint64_t)0x0706050403020800LL,(uint64_t)0x0F0E0D0C0B0A0901LL);
+		scratch[C_LOW_LANE] = Constant((int64_t)-1LL,(int64_t)0LL);
+		scratch[C_INTEGER_ONE] = Constant((int64_t)1LL,(int64_t)1LL);
+		scratch[C_INTEGER_TWO] = Constant((int64_t)2LL,(int64_t)2LL);
+		scratch[C_DOUBLE_ZERO] = Constant(0.0, 0.0);
+		scratch[C_DOUBLE_ONE] = Constant(1.0, 1.0);
+		scratch[C_DOUBLE_NA] = Constant(Double::NAelement, Double::NAelement);
+		scratch[C_INTEGER_MIN] = Constant((int64_t)std::numeric_limits<int64_t>::min(),(int64_t)std::numeric_limits<int64_t>::min());
+		scratch[C_INTEGER_MAX] = Constant((int64_t)std::numeric_limits<int64_t>::max(),(int64_t)std::numeric_limits<int64_t>::max());
+		scratch[C_DOUBLE_MIN] = Constant(-std::numeric_limits<double>::infinity(),-std::numeric_limits<double>::infinity());
+		scratch[C_DOUBLE_MAX] = Constant(std::numeric_limits<double>::infinity(),std::numeric_limits<double>::infinity());
+	}
+
+	// where the next trace will be compiled, with room for CODE_BUFFER_SIZE bytes
+	char* reserve() {
+		if(chunk == 0 || used + CODE_BUFFER_SIZE > TRACE_CODE_CHUNK) {
+			void* p = mmap(0, TRACE_CODE_CHUNK, PROT_READ | PROT_WRITE | PROT_EXEC,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if(p == MAP_FAILED)
+				_error("mmap failed.");
+			chunk = (char*)p;
+			used = 0;
+		}
+		return chunk + used;
+	}
+
+	static uint64_t hash(std::vector<int64_t> const& key) {
+		uint64_t h = 14695981039346656037ULL;
+		for(size_t i = 0; i < key.size(); i++) {
+			h ^= (uint64_t)key[i];
+			h *= 1099511628211ULL;
+		}
+		return h;
+	}
+
+	TraceCode* find(std::vector<int64_t> const& key) {
+		lookups++;
+		std::map<uint64_t, std::vector<TraceCode*> >::const_iterator i = entries.find(hash(key));
+		if(i != entries.end()) {
+			for(size_t j = 0; j < i->second.size(); j++) {
+				if(i->second[j]->key == key) {
+					hits++;
+					return i->second[j];
+				}
+			}
+		}
+		return 0;
+	}
+
+	// keep the code just compiled at reserve() along with the constant table it used
+	TraceCode* insert(std::vector<int64_t> const& key, uint64_t size, uint32_t slots, std::vector<Binding> const& bindings) {
+		TraceCode* c = new TraceCode();
+		c->key = key;
+		c->code = chunk + used;
+		c->slots = slots;
+		// TraceCode lives outside the collected heap, so its tables can't be collected either
+		c->constants = new (NoGC) Constant[slots];
+		c->initial = new (NoGC) Constant[slots];
+		memcpy(c->initial, scratch, slots*sizeof(Constant));
+		c->bindings = bindings;
+		c->runs = 0;
+		used += (size + 15) & ~15;
+		compiles++;
+		entries[hash(key)].push_back(c);
+		return c;
 	}
 };
 
+
 #include <xmmintrin.h>
 
 double debug_print(int64_t offset, __m128 a) {
@@ -262,17 +379,23 @@ static __m128d castl2i(__m128d input) {
 }
 
 static __m128d exp_d(__m128d input) {
-       SSEValue v;
-       v.D = input;
-       for(int i = 0; i < 2; i++) v.d[i] = exp(v.d[i]);
-       return v.D;
+	return vexp(input);
 }
 
 static __m128d log_d(__m128d input) {
-       SSEValue v;
-       v.D = input;
-       for(int i = 0; i < 2; i++) v.d[i] = log(v.d[i]);
-       return v.D;
+	return vlog(input);
+}
+
+static __m128d sin_d(__m128d input) {
+	return vsin(input);
+}
+
+static __m128d cos_d(__m128d input) {
+	return vcos(input);
+}
+
+static __m128d pow_d(__m128d a, __m128d b) {
+	return vpow(a, b);
 }
 
 static __m128d random_d(__m128d input) {
@@ -298,44 +421,6 @@ static __m128d random_d(__m128d input) {
 	return o.D;
 }
 
-static void double_push(Double* d, double v) {
-	if(d->length >= 1) {
-		if(d->length == (int64_t)nextPow2(d->length)) {
-			// reallocate and copy
-			Double n(nextPow2(d->length+1));
-			memcpy(n.v(), d->v(), d->length*sizeof(double));
-			d->p = n.p;
-		}
-		(*d)[d->length++] = v;
-	} else {
-		Double::InitScalar(*d, v);
-	} 
-}
-
-static __m128d store_conditional(__m128d input, __m128i mask, Value* out) {
-	SSEValue i, m; 
-	i.D = input;
-	m.I = mask;
-	if(m.i[0] == -1)
-		double_push((Double*)out, i.d[0]); 
-		//((double*)(out->p))[out->length++] = i.d[0];
-	if(m.i[1] == -1) 
-		double_push((Double*)out, i.d[1]); 
-		//((double*)(out->p))[out->length++] = i.d[1];
-	return input;
-}
-
-static __m128d store_conditional_l(__m128d input, __m128i mask, Value* out) {
-	SSEValue i, m; 
-	i.D = input;
-	m.I = mask;
-	if(m.i[0] == -1) 
-		((char*)(out->p))[out->length++] = (char)i.i[0];
-	if(m.i[1] == -1) 
-		((char*)(out->p))[out->length++] = (char)i.i[1];
-	return input;
-}
-
 static __m128d sequenceStart_d(__m128d a, int64_t vector_index) {
 	SSEValue s, v;
 	s.D = a;
@@ -398,20 +483,32 @@ SCAN_FN(cumprodd, double , *)
 SCAN_FN(cumsumi, int64_t, +)
 SCAN_FN(cumsumd, double , +)
 
+// vmovmskpd bits to logical bytes
+static const uint32_t expand_mask_bytes[16] = {
+	0x00000000, 0x000000FF, 0x0000FF00, 0x0000FFFF,
+	0x00FF0000, 0x00FF00FF, 0x00FFFF00, 0x00FFFFFF,
+	0xFF000000, 0xFF0000FF, 0xFF00FF00, 0xFF00FFFF,
+	0xFFFF0000, 0xFFFF00FF, 0xFFFFFF00, 0xFFFFFFFF
+};
+
 struct TraceJIT {
-	TraceJIT(Trace * t, Thread& thread)
-	:  trace(t), thread(thread), asm_(t->code_buffer->code,CODE_BUFFER_SIZE), alloc(XMMRegister::kNumAllocatableRegisters-2), next_constant_slot(C_FIRST_TRACE_CONST) {
+	TraceJIT(Trace * t, Thread& thread, TraceCache& cache)
+	:  trace(t), thread(thread), code(cache.reserve()), constant_table(cache.scratch), asm_(code,CODE_BUFFER_SIZE), alloc(XMMRegister::kNumAllocatableRegisters-2), next_constant_slot(C_FIRST_TRACE_CONST), wide(false), tail(false) {
 		// preserve the last register (xmm15) as a temporary exchange register
 		// to make code gen easier for now 
 		live_registers = new (PointerFreeGC) RegisterSet[trace->nodes.size()];
-		allocated_register = new (PointerFreeGC) int8_t[trace->nodes.size()];
+		allocated_register = new (PointerFreeGC) int16_t[trace->nodes.size()];
 
 	}
 
 	Trace * trace;
 	Thread const& thread;
+	char* code;
+	Constant* constant_table;
+	std::vector<Binding> bindings;
+	std::map<std::pair<int, IRef>, uint32_t> bound;
 	RegisterSet* live_registers;
-	int8_t* allocated_register;
+	int16_t* allocated_register;
 	Assembler asm_;
 	RegisterAllocator alloc;
 
@@ -421,11 +518,14 @@ struct TraceJIT {
 	Register load_addr; //holds address of input vectors
 	Register vector_length; //holds length of long vector
 	uint32_t next_constant_slot;
-	uint64_t spills;
+
+	bool wide;		// 4 doubles per register (AVX) rather than 2 (SSE)
+	bool tail;		// emitting the masked last iteration of the loop
+	int64_t tailMask;	// stack offset of the wide tail's lane mask
 
 	struct RegisterAssignment {
 		int8_t r;
-		int8_t o;
+		int16_t o;	// where the value was before, a register or a spill slot
 	};
 
 	struct OpAssignment {
@@ -435,59 +535,108 @@ struct TraceJIT {
 	std::vector<OpAssignment> assignment;
 	IRef liveRegisters[14]; 
 
-	bool usesNode(IRef ref, IRef use) {
-		IRNode node = trace->nodes[ref];
+	// Every position at which a node is defined or read, ascending, packed
+	// into one array: node i's are uses[useStart[i]] to uses[useStart[i+1]-1].
+	// Allocation walks the trace backwards, so useCursor[i] only moves down
+	// and finding a node's nearest earlier use is amortized constant time.
+	std::vector<IRef> uses;
+	std::vector<int32_t> useStart;
+	std::vector<int32_t> useCursor;
+
+	// Spill slots whose last holder's definition the allocation has passed,
+	// keyed on that definition; a slot can go to any value live only before it.
+	std::priority_queue< std::pair<IRef, int16_t> > freeSlots;
+	std::vector<int16_t> spillSlot;
+	int16_t spillSlots;
+	uint32_t spillCount;
+
+	void addUse(IRef ref, IRef use, bool count) {
+		if(use < 0) return;
+		if(count) useStart[use+1]++;
+		else uses[useCursor[use]++] = ref;
+	}
+
+	void addUses(IRef ref, bool count) {
+		IRNode const& node = trace->nodes[ref];
 		switch(node.arity) {
 		case IRNode::TRINARY:
-			if(node.trinary.c == use) return true;
+			addUse(ref, node.trinary.c, count);
 		case IRNode::BINARY:
-			if(node.binary.b == use) return true;
+			addUse(ref, node.binary.b, count);
 		case IRNode::UNARY:
-			if(node.unary.a == use) return true;
+			addUse(ref, node.unary.a, count);
 		default:
-			if(ref == use) return true;
-			if(node.shape.filter == use) return true;
-			if(node.shape.split == use) return true;
+			addUse(ref, ref, count);
+			addUse(ref, node.shape.filter, count);
+			addUse(ref, node.shape.split, count);
 		}
-		return false;
 	}
 
+	void LiveIntervals() {
+		size_t n = trace->nodes.size();
+		useStart.assign(n+1, 0);
+		for(IRef ref = 0; ref < (IRef)n; ref++)
+			addUses(ref, true);
+		for(size_t i = 0; i < n; i++)
+			useStart[i+1] += useStart[i];
+		uses.resize(useStart[n]);
+		useCursor.assign(useStart.begin(), useStart.end()-1);
+		for(IRef ref = 0; ref < (IRef)n; ref++)
+			addUses(ref, false);
+		// point each cursor at the node's last use
+		for(size_t i = 0; i < n; i++)
+			useCursor[i]--;
+	}
+
+	// the last position at or before currentOp where node is defined or read
+	IRef nearestUse(IRef node, IRef currentOp) {
+		int32_t& c = useCursor[node];
+		while(c >= useStart[node] && uses[c] > currentOp)
+			c--;
+		return c >= useStart[node] ? uses[c] : -1;
+	}
+
+	int16_t assignSlot(IRef node) {
+		IRef last = uses[useStart[node+1]-1];
+		int16_t slot;
+		if(!freeSlots.empty() && freeSlots.top().first > last) {
+			slot = freeSlots.top().second;
+			freeSlots.pop();
+		} else {
+			slot = spillSlots++;
+		}
+		spillSlot[node] = slot;
+		return slot;
+	}
+
+	// evict the live value whose next use (going backwards) is farthest away
 	int8_t spillRegister(IRef currentOp) {
-		spills++;
-		// look for register with the farthest away use?
-		// for now just do slow search backwards
+		spillCount++;
 		IRef minUse = 1000000;
 		int8_t minReg = 0;
 		for(int8_t i = 0; i < 14; i++) {
-			IRef ref = currentOp;
-			for(; ref >= 0; ref--) {
-				if(usesNode(ref, liveRegisters[i])) {
-					if(ref < minUse) {
-						minUse = ref;
-						minReg = i;
-					}
-					break;
-				}
+			IRef use = nearestUse(liveRegisters[i], currentOp);
+			if(use >= 0 && use < minUse) {
+				minUse = use;
+				minReg = i;
 			}
 		}
 		int8_t r = minReg;
-		//printf("spilled r%d (replaced n%d with n%d)\n", minReg, liveRegisters[r], currentOp);
-		allocated_register[liveRegisters[r]] = spills++; // mark node as spilled
+		allocated_register[liveRegisters[r]] = assignSlot(liveRegisters[r]); // mark node as spilled
 		liveRegisters[r] = -1;	// unassign spilled register
 		return r;
 	}
 
 	void allocate(IRef currentOp, IRef node, RegisterAssignment& assignment, int8_t preferred) {
-		int8_t r = allocated_register[node];
+		int16_t o = allocated_register[node];
+		int8_t r = (int8_t)o;
 		// if b is not already assigned to a register
-		assignment.o = r;
-		if(r < 0 || r >= 14) {
+		assignment.o = o;
+		if(o < 0 || o >= 14) {
 			// Attempt to allocate
 			if(!alloc.allocate(preferred, &r)) {
-				//printf("spilling\n");
 				r = spillRegister(currentOp);
 			}
-			//printf("Assigned n%d to r%d\n", node, r);
 		}
 		assignment.r = r;
 		allocated_register[node] = r;
@@ -495,21 +644,26 @@ struct TraceJIT {
 	}
 
 	int8_t deallocate(IRef node) {
-		int8_t r = allocated_register[node];
+		int16_t r = allocated_register[node];
 		if(r >= 0) {
 			allocated_register[node] = -1;
 			liveRegisters[r] = -1;
 			alloc.free(r);
 		}
-		return r;
+		return (int8_t)r;
 	}
 
 	void RegisterAllocate() {
-		spills = 16;
+		// slots are numbered past the registers so the two can share
+		// allocated_register
+		spillSlots = 16;
+		spillCount = 0;
+		spillSlot.assign(trace->nodes.size(), -1);
 		assignment.resize(trace->nodes.size());
 		for(size_t i = 0; i < trace->nodes.size(); i++) {
 			allocated_register[i] = -1;
 		}
+		LiveIntervals();
 		
 		for(IRef ref = trace->nodes.size()-1; ref >= 0; ref--) {
 			IRNode & node = trace->nodes[ref];
@@ -534,27 +688,80 @@ struct TraceJIT {
 				deallocate(ref);
 			}
 			live_registers[ref] = alloc.live_registers();
+
+			// nothing before its definition reads the slot
+			if(spillSlot[ref] >= 0)
+				freeSlots.push(std::make_pair(ref, spillSlot[ref]));
 		}
 		
 	}
 
-	void unspill(RegisterAssignment const& a, int8_t& r) {
+	void unspill(RegisterAssignment const& a, int16_t& r) {
 		if(a.r != r) {
 			assert(a.r >= 0 && a.r < 14);
-			asm_.movdqa(XMMRegister::FromAllocationIndex(a.r),
+			if(wide)
+				asm_.vmovupd(XMMRegister::FromAllocationIndex(a.r),
+					Operand(rsp, r*0x20));
+			else
+				asm_.movdqa(XMMRegister::FromAllocationIndex(a.r),
 					Operand(rsp, r*0x10));
 			r = a.r;
 		}
 	}
 
-	void spill(RegisterAssignment const& a, int8_t& r) {
+	void spill(RegisterAssignment const& a, int16_t& r) {
 		if(a.o >= 14) {
-			asm_.movdqa(Operand(rsp, a.o*0x10),
-				XMMRegister::FromAllocationIndex(a.r));
+			if(wide)
+				asm_.vmovupd(Operand(rsp, a.o*0x20),
+					XMMRegister::FromAllocationIndex(a.r));
+			else
+				asm_.movdqa(Operand(rsp, a.o*0x10),
+					XMMRegister::FromAllocationIndex(a.r));
 		}
 		r = a.o;
 	}
 
+	void UnspillOperands(IRef ref) {
+		IRNode & node = trace->nodes[ref];
+		if(node.group != IRNode::SCALAR) {
+			switch(node.arity) {
+				case IRNode::TRINARY: 
+					unspill(assignment[ref].c, allocated_register[node.trinary.c]);
+				case IRNode::BINARY:
+					unspill(assignment[ref].b, allocated_register[node.binary.b]);
+				case IRNode::UNARY:
+					unspill(assignment[ref].a, allocated_register[node.unary.a]);
+				default:
+					if(node.shape.filter >= 0)
+						unspill(assignment[ref].f, allocated_register[node.shape.filter]);
+					if(node.shape.split >= 0)
+						unspill(assignment[ref].s, allocated_register[node.shape.split]);
+			}
+			allocated_register[ref] = assignment[ref].r.r;
+		}
+	}
+
+	void SpillOperands(IRef ref) {
+		IRNode & node = trace->nodes[ref];
+		if(node.group != IRNode::SCALAR) {
+			switch(node.arity) {
+				case IRNode::TRINARY: 
+					spill(assignment[ref].c, allocated_register[node.trinary.c]);
+				case IRNode::BINARY:
+					spill(assignment[ref].b, allocated_register[node.binary.b]);
+				case IRNode::UNARY:
+					spill(assignment[ref].a, allocated_register[node.unary.a]);
+				default:
+					if(node.shape.filter >= 0)
+						spill(assignment[ref].f, allocated_register[node.shape.filter]);
+					if(node.shape.split >= 0)
+						spill(assignment[ref].s, allocated_register[node.shape.split]);
+
+					spill(assignment[ref].r, allocated_register[ref]);
+			}
+		}
+	}
+
 	// a*1+(a*2+(a*3+(a*4+(a*5+(a*6+(a*7+(a*8+(a*9+(a*10+(a*11+(a*12+(a*13+(a*14+(a*15))))))))))))))
 
 	XMMRegister RegR(IRef r) {
@@ -581,6 +788,32 @@ struct TraceJIT {
 		return XMMRegister::FromAllocationIndex(assignment[r].s.r);
 	}
 
+	// A grouped fold keeps a table per thread in node.in, at the offset held
+	// on the stack. Up to BIG_CARDINALITY levels the two lanes have a slot
+	// each, interleaved; above it they share one and update a lane at a time.
+	// Leaves the lanes' slots in r8 and r9. In the SSE tail the padding lane
+	// takes the low lane's group; its update is masked to the identity.
+	void EmitGroupSlots(IRef ref, Operand offset) {
+		asm_.movapd(xmm15, RegS(ref));
+		if(tail)
+			asm_.movlhps(xmm15, xmm15);
+		if(trace->nodes[ref].shape.levels <= BIG_CARDINALITY)
+			asm_.paddq(xmm15, xmm15);
+		asm_.paddq(xmm15, offset);
+		asm_.movq(r8, xmm15);
+		asm_.movhlps(xmm15, xmm15);
+		asm_.movq(r9, xmm15);
+	}
+
+	// Zeroes the lanes of r a fold skips: those the filter drops and, in the
+	// SSE tail, the padding lane.
+	void EmitFoldMask(IRef ref, XMMRegister r) {
+		if(trace->nodes[ref].shape.filter >= 0)
+			asm_.pand(r, RegF(ref));
+		if(tail)
+			asm_.pand(r, ConstantTable(C_LOW_LANE));
+	}
+
 	XMMRegister MoveA2R(IRef r) {
 		XMMRegister a = RegA(r);
 		XMMRegister d = RegR(r);
@@ -593,8 +826,6 @@ struct TraceJIT {
 	void InstructionSelection() {
 		//pass 2 instruction selection
 
-		int qq = 0;
-
 		//registers are callee saved so that we can make external function calls without saving the registers the tight loop
 		//we need to explicitly save and restore these on entrace and exit to the function
 		thread_index = rbp;
@@ -615,7 +846,7 @@ struct TraceJIT {
 		// TODO: do this in register allocation
 		//  so that loop carried variables can be placed in registers.
 		//  Make this stack allocation simply part of spilling code.
-		int64_t stackSpace = spills*0x10;
+		int64_t stackSpace = spillSlots*0x10;
 		for(IRef ref = 0; ref < (int64_t)trace->nodes.size(); ref++) {
 			IRNode & node = trace->nodes[ref];
 			
@@ -627,67 +858,26 @@ struct TraceJIT {
 				stackSpace += 0x10;
 			else if(node.group == IRNode::FOLD)
 				stackSpace += 0x10;
-
-
-			// TODO: allocate thread split filtered output (how to maintain ordering?)
-			// allocate temporary space for folds (put in IRNode::in)
-			if(node.group == IRNode::FOLD) {
-				int64_t size = node.shape.levels <= BIG_CARDINALITY ? node.shape.levels*2 : node.shape.levels;
-				if(node.type == Type::Double) {
-					// 16 min fills possibly unaligned cache line
-					node.in = Double((size+16LL)*thread.state.nThreads);
-				} else if(node.type == Type::Integer) {
-					node.in = Integer((size+16LL)*thread.state.nThreads);
-				} else if(node.type == Type::Logical) {
-					node.in = Logical((size+128LL)*thread.state.nThreads);
-				} else {
-					_error("Unknown type in initialize temporary space");
-				}
-			}
-
-			// allocate outputs
-			if(node.liveOut || (node.group == IRNode::FOLD && node.outShape.length <= BIG_CARDINALITY)) { 
-				int64_t length = node.outShape.length;
-				
-				if(node.shape.levels != 1 && node.group != IRNode::FOLD)
-					_error("Group by without aggregate not yet supported");
-				if(node.shape.filter >= 0 && node.group != IRNode::FOLD)
-					length = 0;
-				
-				if(node.type == Type::Double) {
-					node.out = Double(length);
-				} else if(node.type == Type::Integer) {
-					node.out = Integer(length);
-				} else if(node.type == Type::Logical) {
-					node.out = Logical(length);
-				} else if(node.type == Type::List) {
-					node.out = List(length);
-				} else {
-					_error("Unknown type in initialize outputs");
-				}
-			}
 		}
 		asm_.subq(rsp, Immediate(stackSpace));
 
 		asm_.movq(thread_index, rdi);
-		asm_.movq(constant_base, &trace->code_buffer->constant_table[0]);
+		asm_.movq(constant_base, rcx);
 		asm_.movq(vector_index, rsi);
 		asm_.movq(vector_length, rdx);
 
-		int64_t stackOffset = spills*0x10;
+		int64_t stackOffset = spillSlots*0x10;
 		for(IRef ref = 0; ref < (int64_t)trace->nodes.size(); ref++) {
 			IRNode & node = trace->nodes[ref];
 			if(node.op == IROpCode::seq) {
 				if(node.isDouble()) {
-					Constant initial(node.sequence.da, node.sequence.db);
-					Operand o_initial = PushConstant(initial);
+					Operand o_initial = BindConstant(Binding::SEQ_INITIAL, ref);
 					asm_.movdqa(xmm0, o_initial);
 					asm_.movq(rdi,vector_index);
 					EmitCall((void*)sequenceStart_d); 
 					asm_.movdqa(Operand(rsp, stackOffset), xmm0);
 				} else {
-					Constant initial(node.sequence.ia, node.sequence.ib);
-					Operand o_initial = PushConstant(initial);
+					Operand o_initial = BindConstant(Binding::SEQ_INITIAL, ref);
 					asm_.movdqa(xmm0, o_initial);
 					asm_.movq(rdi,vector_index);
 					EmitCall((void*)sequenceStart_i); 
@@ -726,91 +916,89 @@ struct TraceJIT {
 			}
 		}
 
+		// The loop steps over pairs. Only the last chunk can end on an odd
+		// index; its last element runs through a second copy of the body
+		// that keeps the padding lane out of folds, gathers and group slots.
+		Label begin, last, done;
+
+		asm_.lea(rax, Operand(vector_index, 2));
+		asm_.cmpq(rax, vector_length);
+		asm_.j(greater, &last);
+
+		asm_.bind(&begin);
+		tail = false;
+		Body();
+		asm_.addq(vector_index, Immediate(2));
+		asm_.lea(rax, Operand(vector_index, 2));
+		asm_.cmpq(rax, vector_length);
+		asm_.j(less_equal, &begin);
+
+		asm_.bind(&last);
+		asm_.cmpq(vector_index, vector_length);
+		asm_.j(greater_equal, &done);
+		tail = true;
+		Body();
+
+		asm_.bind(&done);
+		asm_.addq(rsp, Immediate(stackSpace));
+		asm_.addq(rsp, Immediate(0x8));
+		asm_.pop(rbx);
+		asm_.pop(vector_length);
+		asm_.pop(load_addr);
+		asm_.pop(vector_index);
+		asm_.pop(constant_base);
+		asm_.pop(thread_index);
+		asm_.ret(0);
+	}
+
+	void Body() {
 		// clear register assignments
 		for(size_t i = 0; i < trace->nodes.size(); i++) {
 			allocated_register[i] = -1;
 		}
-		
-		Label begin;
 
-		asm_.bind(&begin);
-
-		stackOffset = spills*0x10;
+		int64_t stackOffset = spillSlots*0x10;
 		for(IRef ref = 0; ref < (int64_t)trace->nodes.size(); ref++) {
 			IRNode & node = trace->nodes[ref];
 
 
-			// unspill if necessary...
-			if(node.group != IRNode::SCALAR) {
-				switch(node.arity) {
-					case IRNode::TRINARY: 
-						unspill(assignment[ref].c, allocated_register[node.trinary.c]);
-					case IRNode::BINARY:
-						unspill(assignment[ref].b, allocated_register[node.binary.b]);
-					case IRNode::UNARY:
-						unspill(assignment[ref].a, allocated_register[node.unary.a]);
-					default:
-						if(node.shape.filter >= 0)
-							unspill(assignment[ref].f, allocated_register[node.shape.filter]);
-						if(node.shape.split >= 0)
-							unspill(assignment[ref].s, allocated_register[node.shape.split]);
-				}
-				allocated_register[ref] = assignment[ref].r.r;
-			}
+			UnspillOperands(ref);
 			switch(node.op) {
 
 			case IROpCode::constant: {
-				Constant c;
-				switch(node.type) {
-					case Type::Integer: c = Constant(node.constant.i); break;
-					case Type::Logical: c = Constant(node.constant.l); break;
-					case Type::Double:  c = Constant(node.constant.d); break;
-					default: _error("unexpected type");
-				}
-				asm_.movdqa(RegR(ref),PushConstant(c));
+				asm_.movdqa(RegR(ref),BindConstant(Binding::CONSTANT, ref));
 			} break;
 			case IROpCode::load: {
-				void* p;
-				if(node.in.isLogical())
-					p = ((Logical&)node.in).v();
-				else if(node.in.isInteger())
-					p = ((Integer&)node.in).v();
-				else if(node.in.isDouble())
-					p = ((Double&)node.in).v();
-				else
-					_error("Unsupported type");
-				//printf("load: %x\n", p);
 				int64_t offset = node.constant.i;
 				if(offset % 2 == 0) {
 					if(node.isLogical())
-						asm_.pmovsxbq(RegR(ref), EncodeOperand((char*)p+offset, vector_index, times_1));
+						asm_.pmovsxbq(RegR(ref), BoundOperand(Binding::INPUT, ref, vector_index, times_1));
 					else
-						asm_.movdqa(RegR(ref),EncodeOperand((char*)p+offset*8,vector_index,times_8));
+						asm_.movdqa(RegR(ref),BoundOperand(Binding::INPUT, ref, vector_index, times_8));
 				} else {
 					if(node.isLogical())
 						_error("NYI: unaligned load of logical");
 					else
-						asm_.movdqu(RegR(ref),EncodeOperand((char*)p+offset*8,vector_index,times_8));
+						asm_.movdqu(RegR(ref),BoundOperand(Binding::INPUT, ref, vector_index, times_8));
 				}
 			} break;
 			case IROpCode::gather: {
-				void* p;
 				if(node.in.isLogical()) {
-					p = ((Logical&)node.in).v();
 					_error("NYI: gather of logical");
 				} else {
-					if(node.in.isInteger())
-						p = ((Integer&)node.in).v();
-					else if(node.in.isDouble())
-						p = ((Double&)node.in).v();
-					else
+					if(!node.in.isInteger() && !node.in.isDouble())
 						_error("Unsupported type");
 			
 					asm_.movq(r8, RegA(ref));
-					asm_.movhlps(RegR(ref), RegA(ref));
-					asm_.movq(r9, RegR(ref));
-					asm_.movlpd(RegR(ref),EncodeOperand(p,r8,times_8));
-					asm_.movhpd(RegR(ref),EncodeOperand(p,r9,times_8));
+					if(tail) {
+						// the padding lane's index may be out of range
+						asm_.movq(r9, r8);
+					} else {
+						asm_.movhlps(RegR(ref), RegA(ref));
+						asm_.movq(r9, RegR(ref));
+					}
+					asm_.movlpd(RegR(ref),BoundOperand(Binding::INPUT, ref, r8, times_8));
+					asm_.movhpd(RegR(ref),BoundOperand(Binding::INPUT, ref, r9, times_8));
 				}
 			} break;
 
@@ -819,8 +1007,8 @@ struct TraceJIT {
 				else		 	asm_.paddq(MoveA2R(ref),RegB(ref));
 			} break;
 			case IROpCode::addc: {
-				if(node.isDouble()) 	asm_.addpd(MoveA2R(ref),PushConstant(Constant(node.constant.d))); 
-				else 			asm_.paddq(MoveA2R(ref),PushConstant(Constant(node.constant.i)));
+				if(node.isDouble()) 	asm_.addpd(MoveA2R(ref),BindConstant(Binding::CONSTANT, ref)); 
+				else 			asm_.paddq(MoveA2R(ref),BindConstant(Binding::CONSTANT, ref));
 			} break;
 			case IROpCode::sub: {
 				if(node.isDouble()) 	asm_.subpd(MoveA2R(ref),RegB(ref)); 
@@ -831,7 +1019,7 @@ struct TraceJIT {
 				else			EmitVectorizedBinaryFunction(ref,mul_i);
 			} break;
 			case IROpCode::mulc: {
-				if(node.isDouble()) 	asm_.mulpd(MoveA2R(ref),PushConstant(Constant(node.constant.d))); 
+				if(node.isDouble()) 	asm_.mulpd(MoveA2R(ref),BindConstant(Binding::CONSTANT, ref)); 
 				else {
 					EmitVectorizedUCFunction(ref,(void*)mul_i);
 				}
@@ -853,6 +1041,13 @@ struct TraceJIT {
 					_error("NYI: pmin on integers");
 				}
 			} break;
+			case IROpCode::pmax: {
+				if(node.isDouble()) {
+					asm_.maxpd(MoveA2R(ref), RegB(ref));
+				} else {
+					_error("NYI: pmax on integers");
+				}
+			} break;
 
 			case IROpCode::sqrt: 	asm_.sqrtpd(RegR(ref),RegA(ref)); break;
 			//case IROpCode::round:	asm_.roundpd(RegR(ref),RegA(ref), Assembler::kRoundToNearest); break;
@@ -893,13 +1088,13 @@ struct TraceJIT {
 #else
 			case IROpCode::exp: 	EmitVectorizedUnaryFunction(ref,exp_d); break;
 			case IROpCode::log: 	EmitVectorizedUnaryFunction(ref,log_d); break;
-			case IROpCode::cos: 	EmitUnaryFunction(ref,cos); break;
-			case IROpCode::sin: 	EmitUnaryFunction(ref,sin); break;
+			case IROpCode::cos: 	EmitVectorizedUnaryFunction(ref,cos_d); break;
+			case IROpCode::sin: 	EmitVectorizedUnaryFunction(ref,sin_d); break;
 			case IROpCode::tan: 	EmitUnaryFunction(ref,tan); break;
 			case IROpCode::acos: 	EmitUnaryFunction(ref,acos); break;
 			case IROpCode::asin: 	EmitUnaryFunction(ref,asin); break;
 			case IROpCode::atan: 	EmitUnaryFunction(ref,atan); break;
-			case IROpCode::pow: 	EmitBinaryFunction(ref,pow); break;
+			case IROpCode::pow: 	EmitVectorizedBinaryFunction(ref,pow_d); break;
 			case IROpCode::atan2: 	EmitBinaryFunction(ref,atan2); break;
 			case IROpCode::hypot: 	EmitBinaryFunction(ref,hypot); break;
 #endif
@@ -1005,14 +1200,12 @@ struct TraceJIT {
 			} break;
 			case IROpCode::seq: {
 				if(node.isDouble()) {
-					Constant step(2*node.sequence.db, 2*node.sequence.db);
-					Operand o_step = PushConstant(step);
+					Operand o_step = BindConstant(Binding::SEQ_STEP, ref);
 					asm_.movdqa(RegR(ref), Operand(rsp, stackOffset));
 					asm_.addpd(RegR(ref), o_step);
 					asm_.movdqa(Operand(rsp, stackOffset), RegR(ref));
 				} else {
-					Constant step(2*node.sequence.ib, 2*node.sequence.ib);
-					Operand o_step = PushConstant(step);
+					Operand o_step = BindConstant(Binding::SEQ_STEP, ref);
 					asm_.movdqa(RegR(ref), Operand(rsp, stackOffset));
 					asm_.paddq(RegR(ref), o_step);
 					asm_.movdqa(Operand(rsp, stackOffset), RegR(ref));
@@ -1029,28 +1222,15 @@ struct TraceJIT {
 				stackOffset += 0x10;
 			} break;
 			case IROpCode::sum:  {
-				// relying on doubles and integers to be the same length
-				memset(node.in.p, 0, node.in.length*sizeof(double));
 				//printf("sum intermediate: %x\n", node.in.p);	
 				MoveA2R(ref);
-				if(node.shape.filter >= 0) {
-					asm_.pand(RegR(ref), RegF(ref));
-				}
+				EmitFoldMask(ref, RegR(ref));
 
 				Operand offset = Operand(rsp, stackOffset);
 				if(node.shape.split >= 0 && node.shape.levels > 1) {
-					if(qq == 0) {
-					asm_.movapd(xmm15, RegS(ref));
-					if(node.shape.levels <= BIG_CARDINALITY)
-						asm_.paddq(xmm15, xmm15);
-					asm_.paddq(xmm15, offset);
-					asm_.movq(r8, xmm15);
-					asm_.movhlps(xmm15, xmm15);
-					asm_.movq(r9, xmm15);
-					qq++;
-					}
-					Operand operand0 = EncodeOperand(node.in.p, r8, times_8);
-					Operand operand1 = EncodeOperand(node.in.p, r9, times_8);
+					EmitGroupSlots(ref, offset);
+					Operand operand0 = BoundOperand(Binding::TEMP, ref, r8, times_8);
+					Operand operand1 = BoundOperand(Binding::TEMP, ref, r9, times_8);
 				
 					if(node.shape.levels > BIG_CARDINALITY) {
 						asm_.movhlps(xmm15, RegR(ref));
@@ -1077,7 +1257,7 @@ struct TraceJIT {
 					}
 				} else {
 					asm_.movq(r8, offset);
-					Operand operand = EncodeOperand(node.in.p, r8, times_8);
+					Operand operand = BoundOperand(Binding::TEMP, ref, r8, times_8);
 					if(node.isDouble()) 	asm_.addpd(RegR(ref), operand);
 					else			asm_.paddq(RegR(ref), operand);
 					asm_.movdqa(operand, RegR(ref));
@@ -1086,8 +1266,6 @@ struct TraceJIT {
 			} break;
 
 			case IROpCode::length: {
-				// relying on doubles and integers to be the same length
-				memset(node.in.p, 0, node.in.length*sizeof(double));
 				
 				Operand offset = Operand(rsp, stackOffset);
 
@@ -1096,22 +1274,14 @@ struct TraceJIT {
 				else 	
 					asm_.movdqa(RegR(ref), ConstantTable(C_DOUBLE_ONE));
 
-				if(node.shape.filter >= 0) {
-					asm_.pand(RegR(ref), RegF(ref));
-				}
+				EmitFoldMask(ref, RegR(ref));
 				
 				if(node.shape.split >= 0 && node.shape.levels > 1) {
-					asm_.movapd(xmm15, RegS(ref));
-					if(node.shape.levels <= BIG_CARDINALITY)
-						asm_.paddq(xmm15, xmm15);
-					asm_.paddq(xmm15, offset);
-					asm_.movq(r8, xmm15);
-					asm_.movhlps(xmm15, xmm15);
-					asm_.movq(r9, xmm15);
-					Operand operand0 = EncodeOperand(node.in.p, r8, times_8);
-					Operand operand1 = EncodeOperand(node.in.p, r9, times_8);
+					EmitGroupSlots(ref, offset);
+					Operand operand0 = BoundOperand(Binding::TEMP, ref, r8, times_8);
+					Operand operand1 = BoundOperand(Binding::TEMP, ref, r9, times_8);
 				
-					if(node.shape.levels <= BIG_CARDINALITY) {
+					if(node.shape.levels > BIG_CARDINALITY) {
 						asm_.movhlps(xmm15, RegR(ref));
 						if(node.isDouble())	asm_.addsd(RegR(ref), operand0);
 						else {
@@ -1127,16 +1297,16 @@ struct TraceJIT {
 						asm_.movq(operand1, xmm15);
 						asm_.movlhps(RegR(ref), xmm15);
 					} else {
-						asm_.movlpd(RegR(ref), operand0);
-						asm_.movhpd(RegR(ref), operand1);
-						if(node.isDouble())	asm_.addpd(RegR(ref), operand0);
-						else 			asm_.paddq(RegR(ref), operand1);
+						asm_.movlpd(xmm15, operand0);
+						asm_.movhpd(xmm15, operand1);
+						if(node.isDouble())	asm_.addpd(RegR(ref), xmm15);
+						else 			asm_.paddq(RegR(ref), xmm15);
 						asm_.movlpd(operand0, RegR(ref));
 						asm_.movhpd(operand1, RegR(ref));
 					}
 				} else {
 					asm_.movq(r8, offset);
-					Operand operand = EncodeOperand(node.in.p, r8, times_8);
+					Operand operand = BoundOperand(Binding::TEMP, ref, r8, times_8);
 					if(node.isDouble()) 	asm_.addpd(RegR(ref), operand);
 					else			asm_.paddq(RegR(ref), operand);
 					asm_.movdqa(operand, RegR(ref));
@@ -1145,8 +1315,6 @@ struct TraceJIT {
 			} break;
 
 			case IROpCode::mean: {
-				// relying on doubles and integers to be the same length
-				memset(node.in.p, 0, node.in.length*sizeof(double));
 				
 				// m' = m + 1/n * (x-m)
 				// (x-m) must be in RegR at the end
@@ -1156,15 +1324,9 @@ struct TraceJIT {
 				MoveA2R(ref);		// x
 				
 				if(node.shape.split >= 0 && node.shape.levels > 1) {
-					asm_.movapd(xmm15, RegS(ref));
-					if(node.shape.levels <= BIG_CARDINALITY)
-						asm_.paddq(xmm15, xmm15);
-					asm_.paddq(xmm15, offset);
-					asm_.movq(r8, xmm15);
-					asm_.movhlps(xmm15, xmm15);
-					asm_.movq(r9, xmm15);
-					Operand operand0 = EncodeOperand(node.in.p, r8, times_8);
-					Operand operand1 = EncodeOperand(node.in.p, r9, times_8);
+					EmitGroupSlots(ref, offset);
+					Operand operand0 = BoundOperand(Binding::TEMP, ref, r8, times_8);
+					Operand operand1 = BoundOperand(Binding::TEMP, ref, r9, times_8);
 				
 					if(node.shape.levels > BIG_CARDINALITY) {
 						asm_.movhlps(xmm15, RegR(ref));
@@ -1172,9 +1334,7 @@ struct TraceJIT {
 						asm_.subsd(RegR(ref), operand0);
 						asm_.movapd(xmm14, RegR(ref));
 						asm_.mulsd(xmm14, RegB(ref));
-						if(node.shape.filter >= 0) {
-							asm_.pand(xmm14, RegF(ref));
-						}
+						EmitFoldMask(ref, xmm14);
 						asm_.addsd(xmm14, operand0);
 						asm_.movq(operand0, xmm14);
 
@@ -1182,12 +1342,14 @@ struct TraceJIT {
 						asm_.subsd(xmm15, operand1);
 						asm_.movlhps(RegR(ref), xmm15);
 						asm_.mulsd(xmm15, xmm14);
-						if(node.shape.filter >= 0) {
-							asm_.pand(xmm15, RegF(ref));
+						if(tail) {
+							asm_.pxor(xmm15, xmm15);
+						} else if(node.shape.filter >= 0) {
+							asm_.movhlps(xmm14, RegF(ref));
+							asm_.pand(xmm15, xmm14);
 						}
 						asm_.addsd(xmm15, operand1);
 						asm_.movq(operand1, xmm15);
-						asm_.movlhps(RegR(ref), xmm15);
 					} else {
 						asm_.movlpd(xmm14, operand0);
 						asm_.movhpd(xmm14, operand1);
@@ -1195,22 +1357,18 @@ struct TraceJIT {
 						asm_.subpd(RegR(ref), xmm14);
 						asm_.movapd(xmm15, RegR(ref));
 						asm_.mulpd(xmm15, RegB(ref));
-						if(node.shape.filter >= 0) {
-							asm_.pand(xmm15, RegF(ref));
-						}
+						EmitFoldMask(ref, xmm15);
 						asm_.addpd(xmm15, xmm14);
 						asm_.movlpd(operand0, xmm15);
 						asm_.movhpd(operand1, xmm15);
 					}
 				} else {
 					asm_.movq(r8, offset);
-					Operand operand = EncodeOperand(node.in.p, r8, times_8);
+					Operand operand = BoundOperand(Binding::TEMP, ref, r8, times_8);
 					asm_.subpd(RegR(ref), operand);
 					asm_.movapd(xmm15, RegR(ref));
 					asm_.mulpd(xmm15, RegB(ref));
-					if(node.shape.filter >= 0) {
-						asm_.pand(xmm15, RegF(ref));
-					}
+					EmitFoldMask(ref, xmm15);
 					asm_.addpd(xmm15, operand);
 					asm_.movdqa(operand, xmm15);
 				}
@@ -1221,7 +1379,6 @@ struct TraceJIT {
 				// c' = c + (n-1)/n * (s-m1) * (t-m2)
 				// (s-m1) is in a, (t-m2) is in b, 1/n is in c
 				// compute as c' = c + (1-1/n)*(s-m1)*(t-m2) 
-				memset(node.in.p, 0, node.in.length*sizeof(double));
 				
 				Operand offset = Operand(rsp, stackOffset);
 				
@@ -1230,20 +1387,12 @@ struct TraceJIT {
 				asm_.movdqa(xmm15, ConstantTable(C_DOUBLE_ONE));
 				asm_.subpd(xmm15, RegC(ref));
 				asm_.mulpd(RegR(ref), xmm15);
-				if(node.shape.filter >= 0) {
-					asm_.pand(RegR(ref), RegF(ref));
-				}
+				EmitFoldMask(ref, RegR(ref));
 
 				if(node.shape.split >= 0 && node.shape.levels > 1) {
-					asm_.movapd(xmm15, RegS(ref));
-					if(node.shape.levels <= BIG_CARDINALITY)
-						asm_.paddq(xmm15, xmm15);
-					asm_.paddq(xmm15, offset);
-					asm_.movq(r8, xmm15);
-					asm_.movhlps(xmm15, xmm15);
-					asm_.movq(r9, xmm15);
-					Operand operand0 = EncodeOperand(node.in.p, r8, times_8);
-					Operand operand1 = EncodeOperand(node.in.p, r9, times_8);
+					EmitGroupSlots(ref, offset);
+					Operand operand0 = BoundOperand(Binding::TEMP, ref, r8, times_8);
+					Operand operand1 = BoundOperand(Binding::TEMP, ref, r9, times_8);
 				
 					if(node.shape.levels > BIG_CARDINALITY) {
 						asm_.movhlps(xmm15, RegR(ref));
@@ -1260,7 +1409,7 @@ struct TraceJIT {
 					}
 				} else {
 					asm_.movq(r8, offset);
-					Operand operand = EncodeOperand(node.in.p, r8, times_8);
+					Operand operand = BoundOperand(Binding::TEMP, ref, r8, times_8);
 					asm_.addpd(RegR(ref), operand);
 					asm_.movdqa(operand, RegR(ref));
 				}
@@ -1268,31 +1417,25 @@ struct TraceJIT {
 			} break;
 			
 			case IROpCode::min:  {
-				for(int64_t i = 0; i < node.in.length; i++)
-					((double*)node.in.p)[i] = std::numeric_limits<double>::infinity();
 				
 				Operand offset = Operand(rsp, stackOffset);
 				
 				MoveA2R(ref);
-				if(node.shape.filter >= 0) {
-					asm_.pand(RegR(ref), RegF(ref));
-					asm_.pxor(EmitMove(xmm14, RegF(ref)), ConstantTable(C_NOT_MASK));
+				if(node.shape.filter >= 0 || tail) {
+					asm_.movdqa(xmm14, ConstantTable(C_NOT_MASK));
+					EmitFoldMask(ref, xmm14);
+					asm_.pand(RegR(ref), xmm14);
+					asm_.pxor(xmm14, ConstantTable(C_NOT_MASK));
 					asm_.pand(xmm14, ConstantTable(C_DOUBLE_MAX));
 					asm_.por(RegR(ref), xmm14);
 				}
 
 				if(node.shape.split >= 0 && node.shape.levels > 1) {
-					asm_.movapd(xmm15, RegS(ref));
-					if(node.shape.levels <= BIG_CARDINALITY)
-						asm_.paddq(xmm15, xmm15);
-					asm_.paddq(xmm15, offset);
-					asm_.movq(r8, xmm15);
-					asm_.movhlps(xmm15, xmm15);
-					asm_.movq(r9, xmm15);
-					Operand operand0 = EncodeOperand(node.in.p, r8, times_8);
-					Operand operand1 = EncodeOperand(node.in.p, r9, times_8);
+					EmitGroupSlots(ref, offset);
+					Operand operand0 = BoundOperand(Binding::TEMP, ref, r8, times_8);
+					Operand operand1 = BoundOperand(Binding::TEMP, ref, r9, times_8);
 				
-					if(node.shape.levels <= BIG_CARDINALITY) {
+					if(node.shape.levels > BIG_CARDINALITY) {
 						asm_.movhlps(xmm15, RegR(ref));
 						if(node.isDouble())	asm_.minsd(RegR(ref), operand0);
 						else			_error("NYI: min on integers");
@@ -1302,16 +1445,16 @@ struct TraceJIT {
 						asm_.movq(operand1, xmm15);
 						asm_.movlhps(RegR(ref), xmm15);
 					} else {
-						asm_.movlpd(RegR(ref), operand0);
-						asm_.movhpd(RegR(ref), operand1);
-						if(node.isDouble())	asm_.minpd(RegR(ref), operand0);
+						asm_.movlpd(xmm15, operand0);
+						asm_.movhpd(xmm15, operand1);
+						if(node.isDouble())	asm_.minpd(RegR(ref), xmm15);
 						else 			_error("NYI: min on integers");
 						asm_.movlpd(operand0, RegR(ref));
 						asm_.movhpd(operand1, RegR(ref));
 					}
 				} else {
 					asm_.movq(r8, offset);
-					Operand operand = EncodeOperand(node.in.p, r8, times_8);
+					Operand operand = BoundOperand(Binding::TEMP, ref, r8, times_8);
 					if(node.isDouble()) 	asm_.minpd(RegR(ref), operand);
 					else			_error("NYI: min on integers");
 					asm_.movdqa(operand, RegR(ref));
@@ -1320,32 +1463,25 @@ struct TraceJIT {
 			} break;
 
 			case IROpCode::max:  {
-				// relying on doubles and integers to be the same length
-				for(int64_t i = 0; i < node.in.length; i++)
-					((double*)node.in.p)[i] = -std::numeric_limits<double>::infinity();
 				
 				Operand offset = Operand(rsp, stackOffset);
 				
 				MoveA2R(ref);
-				if(node.shape.filter >= 0) {
-					asm_.pand(RegR(ref), RegF(ref));
-					asm_.pxor(EmitMove(xmm14, RegF(ref)), ConstantTable(C_NOT_MASK));
+				if(node.shape.filter >= 0 || tail) {
+					asm_.movdqa(xmm14, ConstantTable(C_NOT_MASK));
+					EmitFoldMask(ref, xmm14);
+					asm_.pand(RegR(ref), xmm14);
+					asm_.pxor(xmm14, ConstantTable(C_NOT_MASK));
 					asm_.pand(xmm14, ConstantTable(C_DOUBLE_MIN));
 					asm_.por(RegR(ref), xmm14);
 				}
 
 				if(node.shape.split >= 0 && node.shape.levels > 1) {
-					asm_.movapd(xmm15, RegS(ref));
-					if(node.shape.levels <= BIG_CARDINALITY)
-						asm_.paddq(xmm15, xmm15);
-					asm_.paddq(xmm15, offset);
-					asm_.movq(r8, xmm15);
-					asm_.movhlps(xmm15, xmm15);
-					asm_.movq(r9, xmm15);
-					Operand operand0 = EncodeOperand(node.in.p, r8, times_8);
-					Operand operand1 = EncodeOperand(node.in.p, r9, times_8);
+					EmitGroupSlots(ref, offset);
+					Operand operand0 = BoundOperand(Binding::TEMP, ref, r8, times_8);
+					Operand operand1 = BoundOperand(Binding::TEMP, ref, r9, times_8);
 				
-					if(node.shape.levels <= BIG_CARDINALITY) {
+					if(node.shape.levels > BIG_CARDINALITY) {
 						asm_.movhlps(xmm15, RegR(ref));
 						if(node.isDouble())	asm_.maxsd(RegR(ref), operand0);
 						else			_error("NYI: max on integers");
@@ -1355,16 +1491,16 @@ struct TraceJIT {
 						asm_.movq(operand1, xmm15);
 						asm_.movlhps(RegR(ref), xmm15);
 					} else {
-						asm_.movlpd(RegR(ref), operand0);
-						asm_.movhpd(RegR(ref), operand1);
-						if(node.isDouble())	asm_.maxpd(RegR(ref), operand0);
+						asm_.movlpd(xmm15, operand0);
+						asm_.movhpd(xmm15, operand1);
+						if(node.isDouble())	asm_.maxpd(RegR(ref), xmm15);
 						else 			_error("NYI: max on integers");
 						asm_.movlpd(operand0, RegR(ref));
 						asm_.movhpd(operand1, RegR(ref));
 					}
 				} else {
 					asm_.movq(r8, offset);
-					Operand operand = EncodeOperand(node.in.p, r8, times_8);
+					Operand operand = BoundOperand(Binding::TEMP, ref, r8, times_8);
 					if(node.isDouble()) 	asm_.maxpd(RegR(ref), operand);
 					else			_error("NYI: max on integers");
 					asm_.movdqa(operand, RegR(ref));
@@ -1373,19 +1509,50 @@ struct TraceJIT {
 			} break;
 
 			case IROpCode::prod: { 
-				if(node.isDouble()) {
-					/*assert(store_inst[ref] != NULL);
-					IRNode & str = *store_inst[ref];
-					for(uint64_t i = 0; i < 128; i++)
-						((double*)str.store.dst.p)[i] = 1.0;
-					Operand op = EncodeOperand(str.store.dst.p, thread_index, times_8);
-					asm_.mulpd(RegR(ref),op);
-					asm_.movdqa(op,RegR(ref));*/
-					EmitFoldFunction(ref,(void*)prodd,Constant(0.0)); break;
+				if(!node.isDouble()) {
+					EmitFoldFunction(ref,(void*)prodi,Constant((int64_t)1LL));
+					stackOffset += 0x10;
+					break;
 				}
-				else {
-					EmitFoldFunction(ref,(void*)prodi,Constant((int64_t)0LL)); break;
+
+				Operand offset = Operand(rsp, stackOffset);
+				
+				MoveA2R(ref);
+				if(node.shape.filter >= 0 || tail) {
+					asm_.movdqa(xmm14, ConstantTable(C_NOT_MASK));
+					EmitFoldMask(ref, xmm14);
+					asm_.pand(RegR(ref), xmm14);
+					asm_.pxor(xmm14, ConstantTable(C_NOT_MASK));
+					asm_.pand(xmm14, ConstantTable(C_DOUBLE_ONE));
+					asm_.por(RegR(ref), xmm14);
+				}
+
+				if(node.shape.split >= 0 && node.shape.levels > 1) {
+					EmitGroupSlots(ref, offset);
+					Operand operand0 = BoundOperand(Binding::TEMP, ref, r8, times_8);
+					Operand operand1 = BoundOperand(Binding::TEMP, ref, r9, times_8);
+				
+					if(node.shape.levels > BIG_CARDINALITY) {
+						asm_.movhlps(xmm15, RegR(ref));
+						asm_.mulsd(RegR(ref), operand0);
+						asm_.movq(operand0, RegR(ref));
+						asm_.mulsd(xmm15, operand1);
+						asm_.movq(operand1, xmm15);
+						asm_.movlhps(RegR(ref), xmm15);
+					} else {
+						asm_.movlpd(xmm15, operand0);
+						asm_.movhpd(xmm15, operand1);
+						asm_.mulpd(RegR(ref), xmm15);
+						asm_.movlpd(operand0, RegR(ref));
+						asm_.movhpd(operand1, RegR(ref));
+					}
+				} else {
+					asm_.movq(r8, offset);
+					Operand operand = BoundOperand(Binding::TEMP, ref, r8, times_8);
+					asm_.mulpd(RegR(ref), operand);
+					asm_.movdqa(operand, RegR(ref));
 				}
+				stackOffset += 0x10;
 			} break;
 	
 			//placeholder for now
@@ -1420,9 +1587,18 @@ struct TraceJIT {
 				break;
 
 			case IROpCode::filter:
-				MoveA2R(ref);
+				// folds and Compact both take the mask as all zeros or all ones
+				// (logicals holding an NA aren't traced, see isTraceableType)
+				asm_.pcmpeqq(MoveA2R(ref), ConstantTable(C_NOT_MASK));
 				if(node.shape.filter >= 0)
 					asm_.pand(RegR(ref),RegF(ref));
+				if(node.in.isLogical()) {
+					// some output is filtered by us, save the mask for Compact
+					EmitMove(xmm15, RegR(ref));
+					asm_.pshufb(xmm15,ConstantTable(C_PACK_LOGICAL));
+					asm_.movq(rbx, xmm15);
+					asm_.movw(BoundOperand(Binding::TEMP, ref, vector_index, times_1),rbx);
+				}
 			break;
 
 			case IROpCode::ifelse:
@@ -1470,9 +1646,9 @@ struct TraceJIT {
 					case IRNode::MAP:
 					case IRNode::GENERATOR: {
 						if(Type::Logical == node.type)
-							EmitLogicalStore(ref, node.out, node.shape);
+							EmitLogicalStore(ref);
 						else
-							EmitVectorStore(ref, node.out, node.shape);
+							EmitVectorStore(ref);
 					} break;
 					default:
 						// do nothing...
@@ -1481,30 +1657,137 @@ struct TraceJIT {
 			}
 
 
-			// spill if necessary...
-			if(node.group != IRNode::SCALAR) {
-				switch(node.arity) {
-					case IRNode::TRINARY: 
-						spill(assignment[ref].c, allocated_register[node.trinary.c]);
-					case IRNode::BINARY:
-						spill(assignment[ref].b, allocated_register[node.binary.b]);
-					case IRNode::UNARY:
-						spill(assignment[ref].a, allocated_register[node.unary.a]);
-					default:
-						if(node.shape.filter >= 0)
-							spill(assignment[ref].f, allocated_register[node.shape.filter]);
-						if(node.shape.split >= 0)
-							spill(assignment[ref].s, allocated_register[node.shape.split]);
+			SpillOperands(ref);
+		}
+	}
+	
+	// The AVX tier handles 4 doubles per register. Only traces made of the
+	// ops below are compiled wide; integers, gathers, sequences and grouped
+	// folds stay on SSE.
+	bool WideSupported() {
+		for(IRef ref = 0; ref < (int64_t)trace->nodes.size(); ref++) {
+			IRNode const& node = trace->nodes[ref];
+			if(node.op == IROpCode::nop)
+				continue;
+			if(node.shape.split >= 0 || node.shape.levels != 1)
+				return false;
+			switch(node.op) {
+				case IROpCode::load:
+					if(!node.isDouble() || !node.in.isDouble()) return false;
+					break;
+				case IROpCode::constant:
+				case IROpCode::add: case IROpCode::sub: 
+				case IROpCode::mul: case IROpCode::div:
+				case IROpCode::addc: case IROpCode::mulc:
+				case IROpCode::idiv: case IROpCode::mod: case IROpCode::pmin: case IROpCode::pmax:
+				case IROpCode::sqrt: case IROpCode::floor: 
+				case IROpCode::ceiling: case IROpCode::trunc:
+				case IROpCode::abs: case IROpCode::neg:
+				case IROpCode::exp: case IROpCode::log: 
+				case IROpCode::cos: case IROpCode::sin: case IROpCode::tan:
+				case IROpCode::acos: case IROpCode::asin: case IROpCode::atan:
+				case IROpCode::pow: case IROpCode::atan2: case IROpCode::hypot:
+				case IROpCode::sum: case IROpCode::min: case IROpCode::max:
+					if(!node.isDouble()) return false;
+					break;
+				case IROpCode::eq: case IROpCode::lt: 
+				case IROpCode::le: case IROpCode::neq:
+					if(!trace->nodes[node.binary.a].isDouble()) return false;
+					break;
+				case IROpCode::land: case IROpCode::lor: case IROpCode::lnot:
+				case IROpCode::filter:
+					break;
+				case IROpCode::cast:
+					if(node.type != trace->nodes[node.unary.a].type) return false;
+				case IROpCode::pos: case IROpCode::ifelse:
+					if(!node.isDouble() && !node.isLogical()) return false;
+					break;
+				default:
+					return false;
+			}
+		}
+		return true;
+	}
 
-						spill(assignment[ref].r, allocated_register[ref]);
-				}
+	// Same frame and register assignment as InstructionSelection, but the
+	// loop steps by 4 and the last 1-3 elements of a chunk run through a
+	// second copy of the body that masks its loads, stores and folds.
+	void WideInstructionSelection() {
+		thread_index = rbp;
+		constant_base = r12;
+		vector_index = r13;
+		load_addr = r14;
+		vector_length = r15;
+		
+		asm_.push(thread_index);
+		asm_.push(constant_base);
+		asm_.push(vector_index);
+		asm_.push(load_addr);
+		asm_.push(vector_length);
+		asm_.push(rbx);
+		asm_.subq(rsp, Immediate(0x8));
+
+		int64_t stackSpace = spillSlots*0x20;
+		for(IRef ref = 0; ref < (int64_t)trace->nodes.size(); ref++) {
+			if(trace->nodes[ref].group == IRNode::FOLD)
+				stackSpace += 0x10;
+		}
+		tailMask = stackSpace;
+		stackSpace += 0x20;
+		asm_.subq(rsp, Immediate(stackSpace));
+
+		asm_.movq(thread_index, rdi);
+		asm_.movq(constant_base, rcx);
+		asm_.movq(vector_index, rsi);
+		asm_.movq(vector_length, rdx);
+
+		int64_t stackOffset = spillSlots*0x20;
+		for(IRef ref = 0; ref < (int64_t)trace->nodes.size(); ref++) {
+			IRNode & node = trace->nodes[ref];
+			if(node.group == IRNode::FOLD) { 
+				int64_t step = node.in.length / thread.state.nThreads;
+				asm_.movq(r11, Immediate(step));
+				asm_.imulq(r11, thread_index);
+				asm_.movq(Operand(rsp, stackOffset), r11);
+				stackOffset += 0x10;
 			}
 		}
 
-		asm_.addq(vector_index, Immediate(2));
-		asm_.cmpq(vector_index,vector_length);
-		asm_.j(less,&begin);
+		// lane masks for 1, 2 and 3 remaining elements
+		uint64_t masks = PushConstantOffset(Constant((int64_t)-1, (int64_t)0));
+		PushConstantOffset(Constant((int64_t)0, (int64_t)0));
+		PushConstantOffset(Constant((int64_t)-1, (int64_t)-1));
+		PushConstantOffset(Constant((int64_t)0, (int64_t)0));
+		PushConstantOffset(Constant((int64_t)-1, (int64_t)-1));
+		PushConstantOffset(Constant((int64_t)-1, (int64_t)0));
 
+		Label begin, last, done;
+
+		asm_.lea(rax, Operand(vector_index, 4));
+		asm_.cmpq(rax, vector_length);
+		asm_.j(greater, &last);
+
+		asm_.bind(&begin);
+		tail = false;
+		WideBody();
+		asm_.addq(vector_index, Immediate(4));
+		asm_.lea(rax, Operand(vector_index, 4));
+		asm_.cmpq(rax, vector_length);
+		asm_.j(less_equal, &begin);
+
+		asm_.bind(&last);
+		asm_.cmpq(vector_index, vector_length);
+		asm_.j(greater_equal, &done);
+		asm_.movq(rax, vector_length);
+		asm_.subq(rax, vector_index);
+		asm_.shl(rax, Immediate(5));
+		asm_.vmovupd(xmm15, Operand(constant_base, rax, times_1, masks*sizeof(Constant) - 0x20));
+		asm_.vmovupd(Operand(rsp, tailMask), xmm15);
+		tail = true;
+		WideBody();
+
+		asm_.bind(&done);
+		asm_.vzeroupper();
 		asm_.addq(rsp, Immediate(stackSpace));
 		asm_.addq(rsp, Immediate(0x8));
 		asm_.pop(rbx);
@@ -1515,6 +1798,272 @@ struct TraceJIT {
 		asm_.pop(thread_index);
 		asm_.ret(0);
 	}
+
+	void WideBody() {
+		for(size_t i = 0; i < trace->nodes.size(); i++) {
+			allocated_register[i] = -1;
+		}
+
+		int64_t stackOffset = spillSlots*0x20;
+		for(IRef ref = 0; ref < (int64_t)trace->nodes.size(); ref++) {
+			IRNode & node = trace->nodes[ref];
+
+			UnspillOperands(ref);
+			switch(node.op) {
+
+			case IROpCode::constant:
+				asm_.vbroadcastsd(RegR(ref), BindConstant(Binding::CONSTANT, ref));
+				break;
+			case IROpCode::load: {
+				Operand src = BoundOperand(Binding::INPUT, ref, vector_index, times_8);
+				if(tail) {
+					asm_.vmovupd(xmm15, Operand(rsp, tailMask));
+					asm_.vmaskmovpd(RegR(ref), xmm15, src);
+				} else {
+					asm_.vmovupd(RegR(ref), src);
+				}
+			} break;
+
+			case IROpCode::add: asm_.vaddpd(RegR(ref), RegA(ref), RegB(ref)); break;
+			case IROpCode::sub: asm_.vsubpd(RegR(ref), RegA(ref), RegB(ref)); break;
+			case IROpCode::mul: asm_.vmulpd(RegR(ref), RegA(ref), RegB(ref)); break;
+			case IROpCode::div: asm_.vdivpd(RegR(ref), RegA(ref), RegB(ref)); break;
+			case IROpCode::pmin: asm_.vminpd(RegR(ref), RegA(ref), RegB(ref)); break;
+			case IROpCode::pmax: asm_.vmaxpd(RegR(ref), RegA(ref), RegB(ref)); break;
+			case IROpCode::addc:
+				asm_.vaddpd(RegR(ref), RegA(ref), Broadcast(BindConstant(Binding::CONSTANT, ref)));
+				break;
+			case IROpCode::mulc:
+				asm_.vmulpd(RegR(ref), RegA(ref), Broadcast(BindConstant(Binding::CONSTANT, ref)));
+				break;
+			case IROpCode::idiv:
+				asm_.vdivpd(RegR(ref), RegA(ref), RegB(ref));
+				asm_.vroundpd(RegR(ref), RegR(ref), Assembler::kRoundDown);
+				break;
+			case IROpCode::mod:
+				asm_.vdivpd(xmm15, RegA(ref), RegB(ref));
+				asm_.vroundpd(xmm15, xmm15, Assembler::kRoundDown);
+				asm_.vmulpd(xmm15, xmm15, RegB(ref));
+				asm_.vsubpd(RegR(ref), RegA(ref), xmm15);
+				break;
+
+			case IROpCode::sqrt: 	asm_.vsqrtpd(RegR(ref), RegA(ref)); break;
+			case IROpCode::floor: 	asm_.vroundpd(RegR(ref), RegA(ref), Assembler::kRoundDown); break;
+			case IROpCode::ceiling:	asm_.vroundpd(RegR(ref), RegA(ref), Assembler::kRoundUp); break;
+			case IROpCode::trunc: 	asm_.vroundpd(RegR(ref), RegA(ref), Assembler::kRoundToZero); break;
+			case IROpCode::abs:
+				asm_.vandpd(RegR(ref), RegA(ref), Broadcast(ConstantTable(C_ABS_MASK)));
+				break;
+			case IROpCode::neg:
+				asm_.vxorpd(RegR(ref), RegA(ref), Broadcast(ConstantTable(C_NEG_MASK)));
+				break;
+			case IROpCode::pos:
+			case IROpCode::cast:
+				WideMoveA2R(ref);
+				break;
+#ifdef USE_AMD_LIBM
+			case IROpCode::exp: 	EmitWideCall(ref, (void*)amd_vrd2_exp, true); break;
+			case IROpCode::log: 	EmitWideCall(ref, (void*)amd_vrd2_log, true); break;
+			case IROpCode::cos: 	EmitWideCall(ref, (void*)amd_vrd2_cos, true); break;
+			case IROpCode::sin: 	EmitWideCall(ref, (void*)amd_vrd2_sin, true); break;
+			case IROpCode::tan: 	EmitWideCall(ref, (void*)amd_vrd2_tan, true); break;
+			case IROpCode::pow: 	EmitWideCall(ref, (void*)amd_vrd2_pow, true); break;
+			case IROpCode::acos: 	EmitWideCall(ref, (void*)amd_acos, false); break;
+			case IROpCode::asin: 	EmitWideCall(ref, (void*)amd_asin, false); break;
+			case IROpCode::atan: 	EmitWideCall(ref, (void*)amd_atan, false); break;
+			case IROpCode::atan2: 	EmitWideCall(ref, (void*)amd_atan2, false); break;
+			case IROpCode::hypot: 	EmitWideCall(ref, (void*)amd_hypot, false); break;
+#else
+			case IROpCode::exp: 	EmitWideCall(ref, (void*)exp_d, true); break;
+			case IROpCode::log: 	EmitWideCall(ref, (void*)log_d, true); break;
+			case IROpCode::cos: 	EmitWideCall(ref, (void*)cos_d, true); break;
+			case IROpCode::sin: 	EmitWideCall(ref, (void*)sin_d, true); break;
+			case IROpCode::tan: 	EmitWideCall(ref, (void*)(double(*)(double))tan, false); break;
+			case IROpCode::acos: 	EmitWideCall(ref, (void*)(double(*)(double))acos, false); break;
+			case IROpCode::asin: 	EmitWideCall(ref, (void*)(double(*)(double))asin, false); break;
+			case IROpCode::atan: 	EmitWideCall(ref, (void*)(double(*)(double))atan, false); break;
+			case IROpCode::pow: 	EmitWideCall(ref, (void*)pow_d, true); break;
+			case IROpCode::atan2: 	EmitWideCall(ref, (void*)(double(*)(double,double))atan2, false); break;
+			case IROpCode::hypot: 	EmitWideCall(ref, (void*)(double(*)(double,double))hypot, false); break;
+#endif
+
+			case IROpCode::eq: asm_.vcmppd(RegR(ref), RegA(ref), RegB(ref), Assembler::kEQ); break;
+			case IROpCode::lt: asm_.vcmppd(RegR(ref), RegA(ref), RegB(ref), Assembler::kLT); break;
+			case IROpCode::le: asm_.vcmppd(RegR(ref), RegA(ref), RegB(ref), Assembler::kLE); break;
+			case IROpCode::neq: asm_.vcmppd(RegR(ref), RegA(ref), RegB(ref), Assembler::kNEQ); break;
+
+			case IROpCode::land: asm_.vandpd(RegR(ref), RegA(ref), RegB(ref)); break;
+			case IROpCode::lor: asm_.vorpd(RegR(ref), RegA(ref), RegB(ref)); break;
+			case IROpCode::lnot:
+				asm_.vxorpd(RegR(ref), RegA(ref), Broadcast(ConstantTable(C_NOT_MASK)));
+				break;
+
+			case IROpCode::ifelse:
+				asm_.vblendvpd(RegR(ref), RegA(ref), RegB(ref), RegC(ref));
+				break;
+
+			case IROpCode::filter:
+				if(node.shape.filter >= 0)
+					asm_.vandpd(RegR(ref), RegA(ref), RegF(ref));
+				else
+					WideMoveA2R(ref);
+				if(node.in.isLogical()) {
+					// some output is filtered by us, save the mask for Compact
+					EmitWideMaskStore(Binding::TEMP, ref, RegR(ref));
+				}
+				break;
+
+			case IROpCode::sum:
+			case IROpCode::min:
+			case IROpCode::max: {
+				// lanes filtered out or past the end contribute the identity
+				XMMRegister mask = no_xmm;
+				if(tail) {
+					asm_.vmovupd(xmm15, Operand(rsp, tailMask));
+					if(node.shape.filter >= 0)
+						asm_.vandpd(xmm15, xmm15, RegF(ref));
+					mask = xmm15;
+				} else if(node.shape.filter >= 0) {
+					mask = RegF(ref);
+				}
+				if(mask.is(no_xmm)) {
+					WideMoveA2R(ref);
+				} else if(node.op == IROpCode::sum) {
+					asm_.vandpd(RegR(ref), RegA(ref), mask);
+				} else {
+					asm_.vbroadcastsd(xmm14, ConstantTable(node.op == IROpCode::min ? C_DOUBLE_MAX : C_DOUBLE_MIN));
+					asm_.vblendvpd(RegR(ref), xmm14, RegA(ref), mask);
+				}
+
+				// fold the upper two lanes into the lower two, then into
+				// this thread's pair of accumulators as the SSE code keeps them
+				asm_.vextractf128(xmm15, RegR(ref), 1);
+				asm_.movq(r8, Operand(rsp, stackOffset));
+				Operand acc = BoundOperand(Binding::TEMP, ref, r8, times_8);
+				if(node.op == IROpCode::sum) {
+					asm_.vaddpd(xmm15, xmm15, RegR(ref), Assembler::kVex128);
+					asm_.vaddpd(xmm15, xmm15, acc, Assembler::kVex128);
+				} else if(node.op == IROpCode::min) {
+					asm_.vminpd(xmm15, xmm15, RegR(ref), Assembler::kVex128);
+					asm_.vminpd(xmm15, xmm15, acc, Assembler::kVex128);
+				} else {
+					asm_.vmaxpd(xmm15, xmm15, RegR(ref), Assembler::kVex128);
+					asm_.vmaxpd(xmm15, xmm15, acc, Assembler::kVex128);
+				}
+				asm_.vmovupd(acc, xmm15, Assembler::kVex128);
+				stackOffset += 0x10;
+			} break;
+
+			case IROpCode::nop:
+			break;
+
+			default:	_error("unimplemented op"); break;
+			}
+
+			if(node.liveOut && node.group == IRNode::MAP) {
+				if(node.isLogical())
+					EmitWideMaskStore(Binding::OUTPUT, ref, RegR(ref));
+				else
+					EmitWideStore(ref);
+			}
+
+			SpillOperands(ref);
+		}
+	}
+
+	XMMRegister WideMoveA2R(IRef r) {
+		if(!RegA(r).is(RegR(r)))
+			asm_.vmovapd(RegR(r), RegA(r));
+		return RegR(r);
+	}
+
+	// xmm15 holding the double at o in every lane
+	XMMRegister Broadcast(Operand o) {
+		asm_.vbroadcastsd(xmm15, o);
+		return xmm15;
+	}
+
+	void EmitWideStore(IRef ref) {
+		Operand dst = BoundOperand(Binding::OUTPUT, ref, vector_index, times_8);
+		if(tail) {
+			asm_.vmovupd(xmm15, Operand(rsp, tailMask));
+			asm_.vmaskmovpd(dst, xmm15, RegR(ref));
+		} else {
+			asm_.vmovupd(dst, RegR(ref));
+		}
+	}
+
+	// store 4 lane masks as logical bytes, only those before the end in the tail
+	void EmitWideMaskStore(Binding::Kind kind, IRef ref, XMMRegister src) {
+		asm_.vmovmskpd(rbx, src);
+		asm_.movq(load_addr, (void*)expand_mask_bytes);
+		asm_.movl(rbx, Operand(load_addr, rbx, times_4, 0));
+		asm_.movq(load_addr, BindConstant(kind, ref));
+		if(!tail) {
+			asm_.movl(Operand(load_addr, vector_index, times_1, 0), rbx);
+		} else {
+			Label done;
+			asm_.movq(rax, vector_length);
+			asm_.subq(rax, vector_index);
+			for(int i = 0; i < 3; i++) {
+				asm_.movb(Operand(load_addr, vector_index, times_1, i), rbx);
+				if(i < 2) {
+					asm_.cmpq(rax, Immediate(i+1));
+					asm_.j(equal, &done);
+					asm_.shrl(rbx, Immediate(8));
+				}
+			}
+			asm_.bind(&done);
+		}
+	}
+
+	// Call an SSE helper on the 128-bit halves of RegA (and RegB for the
+	// binary ops) when vectorized, otherwise a scalar libm function per lane.
+	void EmitWideCall(IRef ref, void * fn, bool vectorized) {
+		IRNode & node = trace->nodes[ref];
+		bool binary = node.arity == IRNode::BINARY;
+
+		// [rsp, rsp+0x40) holds the arguments, live registers go above
+		RegisterSet regs = live_registers[ref];
+		regs |= (1 << allocated_register[ref]);
+		asm_.subq(rsp, Immediate(0x40 + 14*0x20));
+		uint64_t index = 0x40;
+		for(RegisterIterator it(regs); !it.done(); it.next()) {
+			asm_.vmovupd(Operand(rsp, index), XMMRegister::FromAllocationIndex(it.value()));
+			index += 0x20;
+		}
+		asm_.vmovupd(Operand(rsp, 0), RegA(ref));
+		if(binary)
+			asm_.vmovupd(Operand(rsp, 0x20), RegB(ref));
+		// no dirty upper halves going into code compiled for SSE
+		asm_.vzeroupper();
+
+		if(vectorized) {
+			for(int i = 0; i < 0x20; i += 0x10) {
+				asm_.movdqu(xmm0, Operand(rsp, i));
+				if(binary)
+					asm_.movdqu(xmm1, Operand(rsp, 0x20+i));
+				EmitCall(fn);
+				asm_.movdqu(Operand(rsp, i), xmm0);
+			}
+		} else {
+			for(int i = 0; i < 0x20; i += 0x8) {
+				asm_.movsd(xmm0, Operand(rsp, i));
+				if(binary)
+					asm_.movsd(xmm1, Operand(rsp, 0x20+i));
+				EmitCall(fn);
+				asm_.movsd(Operand(rsp, i), xmm0);
+			}
+		}
+
+		asm_.vmovupd(RegR(ref), Operand(rsp, 0));
+		index = 0x40;
+		for(RegisterIterator it(regs); !it.done(); it.next()) {
+			asm_.vmovupd(XMMRegister::FromAllocationIndex(it.value()), Operand(rsp, index));
+			index += 0x20;
+		}
+		asm_.addq(rsp, Immediate(0x40 + 14*0x20));
+	}
 	
 	XMMRegister EmitMove(XMMRegister dst, XMMRegister src) {
 		if(!dst.is(src)) {
@@ -1523,27 +2072,64 @@ struct TraceJIT {
 		return dst;
 	}
 
-	Operand EncodeOperand(void * dst, Register idx, ScaleFactor scale) {
-		int64_t diff = (int64_t)dst - (int64_t)trace->code_buffer->constant_table;
-		if(is_int32(diff)) {
-			return Operand(constant_base,idx,scale,diff);
-		} else {
-			asm_.movq(load_addr,dst);
-			return Operand(load_addr,idx,scale,0);
+	static Constant BindingValue(IRNode const& node, Binding::Kind kind) {
+		switch(kind) {
+			case Binding::CONSTANT:
+				if(node.isDouble()) return Constant(node.constant.d);
+				else if(node.isLogical()) return Constant(node.constant.l);
+				else return Constant(node.constant.i);
+			case Binding::SEQ_INITIAL:
+				if(node.isDouble()) return Constant(node.sequence.da, node.sequence.db);
+				else return Constant(node.sequence.ia, node.sequence.ib);
+			case Binding::SEQ_STEP:
+				if(node.isDouble()) return Constant(2*node.sequence.db, 2*node.sequence.db);
+				else return Constant(2*node.sequence.ib, 2*node.sequence.ib);
+			case Binding::INPUT: {
+				char* p;
+				if(node.in.isLogical())
+					p = ((Logical&)node.in).v();
+				else if(node.in.isInteger())
+					p = (char*)((Integer&)node.in).v();
+				else if(node.in.isDouble())
+					p = (char*)((Double&)node.in).v();
+				else
+					_error("Unsupported type");
+				if(node.op == IROpCode::load)
+					p += node.constant.i * (node.isLogical() ? 1 : 8);
+				return Constant((void*)p);
+			}
+			case Binding::TEMP: return Constant(node.in.p);
+			case Binding::OUTPUT: return Constant(node.out.p);
 		}
+		return Constant((int64_t)0);
 	}
-	Operand EncodeOperand(void * src) {
-		int64_t diff = (int64_t)src - (int64_t)trace->code_buffer->constant_table;
-		if(is_int32(diff)) {
-			return Operand(constant_base,diff);
-		} else {
-			asm_.movq(load_addr,src);
-			return Operand(load_addr,0);
-		}
+
+	uint32_t BindSlot(Binding::Kind kind, IRef ref) {
+		std::pair<int, IRef> k(kind, ref);
+		std::map<std::pair<int, IRef>, uint32_t>::const_iterator i = bound.find(k);
+		if(i != bound.end())
+			return i->second;
+		Binding b;
+		b.kind = kind;
+		b.ref = ref;
+		b.slot = PushConstantOffset(BindingValue(trace->nodes[ref], kind));
+		bindings.push_back(b);
+		bound[k] = b.slot;
+		return b.slot;
+	}
+
+	Operand BindConstant(Binding::Kind kind, IRef ref) {
+		return ConstantTable(BindSlot(kind, ref));
+	}
+
+	// element idx of the vector bound to ref
+	Operand BoundOperand(Binding::Kind kind, IRef ref, Register idx, ScaleFactor scale) {
+		asm_.movq(load_addr, BindConstant(kind, ref));
+		return Operand(load_addr,idx,scale,0);
 	}
 
 	void EmitCall(void * fn) {
-		int64_t diff = (int64_t)(trace->code_buffer + asm_.pc_offset() + 5 - (int64_t) fn);
+		int64_t diff = (int64_t)(code + asm_.pc_offset() + 5) - (int64_t)fn;
 		if(is_int32(diff)) {
 			asm_.call((byte*)fn);
 		} else {
@@ -1560,10 +2146,10 @@ struct TraceJIT {
 	}
 	uint64_t PushConstantOffset(const Constant& data) {
 		uint32_t offset = next_constant_slot;
-		if(next_constant_slot > 8192) {
-			printf("Used up all the constants!: %d\n", next_constant_slot);
+		if(next_constant_slot >= TRACE_CONSTANTS) {
+			_error("Trace uses too many constants");
 		}
-		trace->code_buffer->constant_table[offset] = data;
+		constant_table[offset] = data;
 		next_constant_slot++;
 		return offset;
 	}
@@ -1572,7 +2158,9 @@ struct TraceJIT {
 		uint64_t offset = PushConstantOffset(identity);
 		SaveRegisters(ref);
 		EmitMove(xmm0,RegA(ref));
-		asm_.movq(rdi,(void*)&trace->code_buffer->constant_table[offset]);
+		if(tail)
+			asm_.movhpd(xmm0, PushConstant(identity));
+		asm_.lea(rdi,ConstantTable(offset));
 		EmitCall(fn);
 		EmitMove(RegR(ref),xmm0);
 		RestoreRegisters(ref);
@@ -1586,41 +2174,16 @@ struct TraceJIT {
 		else 		EmitMove(xmm1, r1);
 	}
 
-	void EmitVectorStore(IRef ref, Value& dst, IRNode::Shape const& shape) {
-		XMMRegister src = RegR(ref);
-		if(shape.filter < 0)
-			asm_.movdqa(EncodeOperand(dst.p,vector_index,times_8),src);
-		else {
-			dst.length = 0;
-			XMMRegister filter = RegF(ref);
-			
-			SaveRegisters(ref);
-			Arguments2(src, filter);
-			asm_.movq(rdi,&dst);
-			EmitCall((void*)store_conditional);
-			EmitMove(RegR(ref),xmm0);
-			RestoreRegisters(ref);
-		}
+	void EmitVectorStore(IRef ref) {
+		asm_.movdqa(BoundOperand(Binding::OUTPUT, ref, vector_index, times_8),RegR(ref));
 	}
 
-	void EmitLogicalStore(IRef ref, Value& dst, IRNode::Shape const& shape) {
+	void EmitLogicalStore(IRef ref) {
 		XMMRegister src = RegR(ref);
-                if(shape.filter < 0) {
-			asm_.pshufb(src,ConstantTable(C_PACK_LOGICAL));
-			asm_.movq(rbx, src);
-			asm_.movw(EncodeOperand(dst.p,vector_index,times_1),rbx);
-       	         	asm_.pshufb(src,ConstantTable(C_PACK_LOGICAL));
-		} else {
-			dst.length = 0;
-			XMMRegister filter = RegF(ref);
-			
-			SaveRegisters(ref);
-			Arguments2(src, filter);
-			asm_.movq(rdi,&dst);
-			EmitCall((void*)store_conditional_l);
-			EmitMove(RegR(ref),xmm0);
-			RestoreRegisters(ref);
-		}
+		asm_.pshufb(src,ConstantTable(C_PACK_LOGICAL));
+		asm_.movq(rbx, src);
+		asm_.movw(BoundOperand(Binding::OUTPUT, ref, vector_index, times_1),rbx);
+		asm_.pshufb(src,ConstantTable(C_PACK_LOGICAL));
 	}
 
 	void EmitVectorizedUnaryFunction(IRef ref, __m128d (*fn)(__m128d)) {
@@ -1658,7 +2221,7 @@ struct TraceJIT {
 		SaveRegisters(ref);
 
 		EmitMove(xmm0, RegA(ref));
-		asm_.movdqa(xmm1, PushConstant(Constant(trace->nodes[ref].constant.i)));
+		asm_.movdqa(xmm1, BindConstant(Binding::CONSTANT, ref));
 		EmitCall(fn);
 		EmitMove(RegR(ref),xmm0);
 
@@ -1723,7 +2286,7 @@ struct TraceJIT {
 		RestoreRegisters(i);*/
 	}
 
-	void EmitGather(XMMRegister dest, IRNode const& node, XMMRegister index, Operand offset) {
+	void EmitGather(XMMRegister dest, IRef ref, XMMRegister index, Operand offset) {
 		// TODO: other fast cases here when index is a known seq
 		if(!index.is(no_xmm)) {
 			EmitMove(dest, index);
@@ -1732,21 +2295,21 @@ struct TraceJIT {
 			asm_.movq(r8, dest);
 			asm_.movhlps(dest, dest);
 			asm_.movq(r9, dest);
-			asm_.movlpd(dest, EncodeOperand(node.in.p, r8, times_8));
-			asm_.movhpd(dest, EncodeOperand(node.in.p, r9, times_8));
+			asm_.movlpd(dest, BoundOperand(Binding::TEMP, ref, r8, times_8));
+			asm_.movhpd(dest, BoundOperand(Binding::TEMP, ref, r9, times_8));
 		} else {
 			asm_.movq(r8, offset);
-			asm_.movdqa(dest, EncodeOperand(node.in.p, r8, times_8));
+			asm_.movdqa(dest, BoundOperand(Binding::TEMP, ref, r8, times_8));
 		}
 	}
 
-	void EmitScatter(IRNode const& node, XMMRegister src, XMMRegister index) {
+	void EmitScatter(IRef ref, XMMRegister src, XMMRegister index) {
 		if(!index.is(no_xmm)) {
-			asm_.movlpd(EncodeOperand(node.in.p, r8, times_8), src);
-			asm_.movhpd(EncodeOperand(node.in.p, r9, times_8), src);
+			asm_.movlpd(BoundOperand(Binding::TEMP, ref, r8, times_8), src);
+			asm_.movhpd(BoundOperand(Binding::TEMP, ref, r9, times_8), src);
 		}
 		else {
-			asm_.movdqa(EncodeOperand(node.in.p, r8, times_8), src);
+			asm_.movdqa(BoundOperand(Binding::TEMP, ref, r8, times_8), src);
 		}
 	}
 	
@@ -1788,34 +2351,280 @@ struct TraceJIT {
 		}
 	}
 
-	typedef void (*fn) (uint64_t thread_index, uint64_t start, uint64_t end);
+	typedef void (*fn) (uint64_t thread_index, uint64_t start, uint64_t end, Constant* constants);
 	
 	static void executebody(void* args, void* h, uint64_t start, uint64_t end, Thread& thread) {
 		//printf("%d: called with %d to %d\n", thread.index, start, end);
-		fn code = (fn)args;
-		code(thread.index, start, end);	
+		TraceCode* code = (TraceCode*)args;
+		((fn)code->code)(thread.index, start, end, code->constants);
+	}
+
+	// The cache key: everything about the trace that the generated code
+	// depends on. Refs are made relative, and constants, seq parameters and
+	// the addresses of inputs and outputs are left out; they are bound at
+	// run time instead (see Bind).
+	void Key(std::vector<int64_t>& key) {
+		key.push_back(thread.state.nThreads);
+		key.push_back(wide);
+		for(IRef ref = 0; ref < (int64_t)trace->nodes.size(); ref++) {
+			IRNode const& node = trace->nodes[ref];
+			key.push_back(node.op);
+			if(node.op == IROpCode::nop)
+				continue;
+			key.push_back(node.type);
+			key.push_back(node.group);
+			key.push_back(node.liveOut);
+			key.push_back(node.shape.levels);
+			key.push_back(node.shape.filter >= 0 ? ref - node.shape.filter : 0);
+			key.push_back(node.shape.split >= 0 ? ref - node.shape.split : 0);
+			switch(node.arity) {
+				case IRNode::TRINARY: key.push_back(ref - node.trinary.c);
+				case IRNode::BINARY: key.push_back(ref - node.binary.b);
+				case IRNode::UNARY: key.push_back(ref - node.unary.a);
+				case IRNode::NULLARY: break;
+			}
+			if(node.op == IROpCode::load) {
+				key.push_back(node.in.type);
+				key.push_back(node.constant.i % 2);
+			} else if(node.op == IROpCode::gather) {
+				key.push_back(node.in.type);
+			} else if(node.op == IROpCode::index) {
+				// picks between three code sequences
+				key.push_back(node.sequence.ia);
+				key.push_back(node.sequence.ib);
+				key.push_back(node.shape.length);
+			}
+		}
 	}
 
+	// Allocate outputs and temporary space for this run.
+	// Temporaries come from the thread's TracePool. The exception is a fold
+	// with many levels, whose partials become its output (see GlobalReduce).
+	void Allocate(Thread& thread) {
+		TracePool& pool = thread.traces.pool;
+		for(IRef ref = 0; ref < (int64_t)trace->nodes.size(); ref++) {
+			IRNode & node = trace->nodes[ref];
+
+			// allocate temporary space for folds (put in IRNode::in)
+			if(node.group == IRNode::FILTER) {
+				node.in = Null::Singleton();
+			}
+			else if(node.group == IRNode::FOLD) {
+				int64_t size = node.shape.levels <= BIG_CARDINALITY ? node.shape.levels*2 : node.shape.levels;
+				bool escapes = node.liveOut && node.shape.levels > BIG_CARDINALITY;
+				if(node.type == Type::Double) {
+					// 16 min fills possibly unaligned cache line
+					int64_t length = (size+16LL)*thread.state.nThreads;
+					if(escapes) pool.Output<Double>(node.in, length);
+					else pool.Temp<Double>(node.in, length);
+				} else if(node.type == Type::Integer) {
+					int64_t length = (size+16LL)*thread.state.nThreads;
+					if(escapes) pool.Output<Integer>(node.in, length);
+					else pool.Temp<Integer>(node.in, length);
+				} else if(node.type == Type::Logical) {
+					int64_t length = (size+128LL)*thread.state.nThreads;
+					if(escapes) pool.Output<Logical>(node.in, length);
+					else pool.Temp<Logical>(node.in, length);
+				} else {
+					_error("Unknown type in initialize temporary space");
+				}
+				// start from the fold's identity, relying on doubles and
+				// integers to be the same length
+				if(node.op == IROpCode::min) {
+					for(int64_t i = 0; i < node.in.length; i++)
+						((double*)node.in.p)[i] = std::numeric_limits<double>::infinity();
+				} else if(node.op == IROpCode::max) {
+					for(int64_t i = 0; i < node.in.length; i++)
+						((double*)node.in.p)[i] = -std::numeric_limits<double>::infinity();
+				} else if(node.op == IROpCode::prod && node.isDouble()) {
+					for(int64_t i = 0; i < node.in.length; i++)
+						((double*)node.in.p)[i] = 1.0;
+				} else if(node.op == IROpCode::sum || node.op == IROpCode::length ||
+						node.op == IROpCode::mean || node.op == IROpCode::cm2) {
+					memset(node.in.p, 0, node.in.length*sizeof(double));
+				}
+			}
+
+			// allocate outputs
+			if(node.liveOut || (node.group == IRNode::FOLD && node.outShape.length <= BIG_CARDINALITY)) { 
+				int64_t length = node.outShape.length;
+				
+				if(node.shape.levels != 1 && node.group != IRNode::FOLD)
+					_error("Group by without aggregate not yet supported");
+				// filtered outputs are stored densely along with their filter's
+				// mask and compacted after the trace runs (see Compact)
+				bool dense = node.shape.filter >= 0 && node.group != IRNode::FOLD;
+				if(dense && !trace->nodes[node.shape.filter].in.isLogical())
+					pool.Temp<Logical>(trace->nodes[node.shape.filter].in, node.shape.length);
+				
+				// dense and unread outputs are only needed during the run
+				bool temp = dense || !node.liveOut;
+				if(node.type == Type::Double) {
+					if(temp) pool.Temp<Double>(node.out, length);
+					else pool.Output<Double>(node.out, length);
+				} else if(node.type == Type::Integer) {
+					if(temp) pool.Temp<Integer>(node.out, length);
+					else pool.Output<Integer>(node.out, length);
+				} else if(node.type == Type::Logical) {
+					if(temp) pool.Temp<Logical>(node.out, length);
+					else pool.Output<Logical>(node.out, length);
+				} else if(node.type == Type::List) {
+					pool.Output<List>(node.out, length);
+				} else {
+					_error("Unknown type in initialize outputs");
+				}
+			}
+		}
+	}
 
-	void Compile() {
-		memset(allocated_register,-1,sizeof(char) * trace->nodes.size());
+	TraceCode* Compile(TraceCache& cache, std::vector<int64_t> const& key) {
+		memset(allocated_register,-1,sizeof(int16_t) * trace->nodes.size());
 
 		RegisterAllocate();
-		InstructionSelection();
+		if(wide)
+			WideInstructionSelection();
+		else
+			InstructionSelection();
+		TraceCode* c = cache.insert(key, asm_.pc_offset(), next_constant_slot, bindings);
+		c->spills = spillCount;
+		c->spillSlots = spillSlots - 16;
+		return c;
+	}
+
+	// Point a compiled trace at this trace's data.
+	void Bind(TraceCode* code) {
+		memcpy(code->constants, code->initial, code->slots*sizeof(Constant));
+		for(size_t i = 0; i < code->bindings.size(); i++) {
+			Binding const& b = code->bindings[i];
+			code->constants[b.slot] = BindingValue(trace->nodes[b.ref], b.kind);
+		}
+		code->runs++;
+	}
+
+	static void firsttouchbody(void* args, void* h, uint64_t start, uint64_t end, Thread& thread) {
+		char* p = (char*)args;
+		for(uint64_t i = start; i < end; i++)
+			p[i*PAGE_BYTES] = 0;
 	}
 
-	void Execute(Thread & thread) {
-		fn trace_code = (fn) trace->code_buffer->code;
+	// Spread the pages of large outputs across the workers that will write them,
+	// so on NUMA machines each chunk's memory lands on its own socket.
+	void FirstTouch(Thread & thread) {
+		for(IRef ref = 0; ref < (int64_t)trace->nodes.size(); ref++) {
+			IRNode & node = trace->nodes[ref];
+			if(!node.liveOut || node.group == IRNode::FOLD || node.type == Type::List)
+				continue;
+			uint64_t bytes = node.out.length * (node.isLogical() ? sizeof(char) : sizeof(double));
+			if(bytes >= FIRST_TOUCH_BYTES) {
+				uint64_t pages = (bytes + PAGE_BYTES - 1) / PAGE_BYTES;
+				thread.doall(NULL, firsttouchbody, node.out.p, 0, pages, 1, pages / thread.state.nThreads);
+			}
+		}
+	}
+
+	void Execute(Thread & thread, TraceCode* code) {
+		if(thread.state.pinned && thread.state.nThreads > 1)
+			FirstTouch(thread);
+		thread.doall(NULL, executebody, (void*)code, 0, trace->Size, 4, 0, &code->grain); 
 		if(thread.state.verbose) {
-			//timespec begin;
-			//get_time(begin);
-			thread.doall(NULL, executebody, (void*)trace_code, 0, trace->Size, 4, 1024); 
-			//trace_code(thread.index, 0, trace->length);
-			//double s = trace->length / (time_elapsed(begin) * 10e9);
-			//printf("elements computed / us: %f\n",s);
-		} else {
-			thread.doall(NULL, executebody, (void*)trace_code, 0, trace->Size, 4, 1024); 
-			//trace_code(thread.index, 0, trace->length);
+			printf("trace grain: %d elements/chunk (%.2f ns/element, %d samples)\n",
+				(int)code->grain.chosen, code->grain.cost*1e9, (int)code->grain.samples);
+		}
+		//trace_code(thread.index, 0, trace->length);
+	}
+
+	// Filtered outputs come out of the trace dense, with the filter's mask
+	// alongside. Each block of COMPACT_BLOCK elements counts its survivors,
+	// a prefix sum over the counts gives every block its offset in the
+	// result, and the blocks then scatter their survivors in parallel.
+	struct Compaction {
+		Trace* trace;
+		IRef filter;
+		std::vector<IRef> outputs;
+		std::vector<Value> dense;	// outputs as the trace stored them
+		std::vector<int64_t> offsets;	// survivors before each block
+	};
+
+	static void countbody(void* args, void* h, uint64_t start, uint64_t end, Thread& thread) {
+		Compaction& c = *(Compaction*)args;
+		Logical const& mask = (Logical const&)c.trace->nodes[c.filter].in;
+		char const* m = mask.v();
+		for(uint64_t b = start; b < end; b++) {
+			int64_t i = b*COMPACT_BLOCK;
+			int64_t e = std::min(i+COMPACT_BLOCK, mask.length);
+			int64_t bits = 0, n = 0;
+			// the mask is 0x00 or 0xff per element
+			for(; i+8 <= e; i += 8)
+				bits += __builtin_popcountll(*(uint64_t const*)(m+i));
+			for(; i < e; i++)
+				n += m[i] != 0;
+			c.offsets[b+1] = bits/8 + n;
+		}
+	}
+
+	static void scatterbody(void* args, void* h, uint64_t start, uint64_t end, Thread& thread) {
+		Compaction& c = *(Compaction*)args;
+		Logical const& mask = (Logical const&)c.trace->nodes[c.filter].in;
+		char const* m = mask.v();
+		for(uint64_t b = start; b < end; b++) {
+			int64_t s = b*COMPACT_BLOCK;
+			int64_t e = std::min(s+COMPACT_BLOCK, mask.length);
+			for(size_t k = 0; k < c.outputs.size(); k++) {
+				IRNode& node = c.trace->nodes[c.outputs[k]];
+				int64_t j = c.offsets[b];
+				if(node.isLogical()) {
+					char const* src = ((Logical const&)c.dense[k]).v();
+					char* dst = ((Logical&)node.out).v();
+					for(int64_t i = s; i < e; i++)
+						if(m[i]) dst[j++] = src[i];
+				} else {
+					int64_t const* src = (int64_t const*)c.dense[k].p;
+					int64_t* dst = node.isDouble() ? 
+						(int64_t*)((Double&)node.out).v() :
+						(int64_t*)((Integer&)node.out).v();
+					for(int64_t i = s; i < e; i++)
+						if(m[i]) dst[j++] = src[i];
+				}
+			}
+		}
+	}
+
+	void Compact(Thread& thread, TraceCode* code) {
+		for(IRef f = 0; f < (int64_t)trace->nodes.size(); f++) {
+			if(trace->nodes[f].group != IRNode::FILTER || !trace->nodes[f].in.isLogical())
+				continue;
+
+			Compaction c;
+			c.trace = trace;
+			c.filter = f;
+			for(IRef ref = f+1; ref < (int64_t)trace->nodes.size(); ref++) {
+				IRNode& node = trace->nodes[ref];
+				if(node.liveOut && node.shape.filter == f && node.group != IRNode::FOLD) {
+					c.outputs.push_back(ref);
+					c.dense.push_back(node.out);
+				}
+			}
+
+			int64_t length = trace->nodes[f].in.length;
+			uint64_t blocks = (length+COMPACT_BLOCK-1)/COMPACT_BLOCK;
+			c.offsets.resize(blocks+1);
+			c.offsets[0] = 0;
+			thread.doall(NULL, countbody, &c, 0, blocks, 1, 1, &code->count);
+			for(uint64_t b = 0; b < blocks; b++)
+				c.offsets[b+1] += c.offsets[b];
+
+			int64_t kept = c.offsets[blocks];
+			for(size_t k = 0; k < c.outputs.size(); k++) {
+				IRNode& node = trace->nodes[c.outputs[k]];
+				if(node.isDouble()) thread.traces.pool.Output<Double>(node.out, kept);
+				else if(node.isInteger()) thread.traces.pool.Output<Integer>(node.out, kept);
+				else if(node.isLogical()) thread.traces.pool.Output<Logical>(node.out, kept);
+				else _error("Unsupported type in filtered output");
+			}
+			thread.doall(NULL, scatterbody, &c, 0, blocks, 1, 1, &code->scatter);
+
+			if(thread.state.verbose)
+				printf("compacted n%d: kept %d of %d elements\n", (int)f, (int)kept, (int)length);
 		}
 	}
 
@@ -1895,89 +2704,86 @@ struct TraceJIT {
 		}
 	}
 
-	void GlobalReduce(Thread& thread) {
-		// merge across vector lanes
+	void merge(IRNode& node, int64_t a, int64_t b) {
+		switch(node.op) {
+			case IROpCode::sum: 
+				mergeSum(node, a, b);
+				break;
+			case IROpCode::prod:
+				mergeProd(node, a, b);
+				break;
+			case IROpCode::length:
+				mergeLength(node, a, b);
+				break;
+			case IROpCode::mean:
+				mergeMean(node, a, b);
+				break;
+			case IROpCode::cm2:
+				mergeCm2(node, a, b);
+				break;
+			case IROpCode::min:
+				mergeMin(node, a, b);
+				break;
+			case IROpCode::max:
+				mergeMax(node, a, b);
+				break;
+			default: /* do nothing */ break;
+		}
+	}
+
+	// Merge levels [lo, hi) of every fold into thread 0's table, first
+	// across vector lanes, then across threads a thread at a time: merging a
+	// mean needs the count merged so far, and cm2 the means' differences
+	// left in j. Both only look at the same level, so ranges of levels can
+	// be merged independently.
+	void MergeLevels(int64_t lo, int64_t hi) {
+		int64_t nThreads = thread.state.nThreads;
 		for(IRef ref = 0; ref < (int64_t)trace->nodes.size(); ref++) {
 			IRNode & node = trace->nodes[ref];
-
 			if(node.group == IRNode::FOLD && node.outShape.length <= BIG_CARDINALITY) {
-				int64_t step = node.in.length/thread.state.nThreads;
-
-				for(int64_t j = 0; j < thread.state.nThreads; j++) {
-					for(int64_t i = 0; i < node.outShape.length; i++) {
-						int64_t a = j*step+i*2;
-						int64_t b = j*step+i*2+1;
-
-						switch(node.op) {
-							case IROpCode::sum: 
-								mergeSum(node, a, b);
-								break;
-							case IROpCode::prod:
-								mergeProd(node, a, b);
-								break;
-							case IROpCode::length:
-								mergeLength(node, a, b);
-								break;
-							case IROpCode::mean:
-								mergeMean(node, a, b);
-								break;
-							case IROpCode::cm2:
-								mergeCm2(node, a, b);
-								break;
-							case IROpCode::min:
-								mergeMin(node, a, b);
-								break;
-							case IROpCode::max:
-								mergeMax(node, a, b);
-								break;
-							default: // do nothing
-								break;
-						}
-					}
+				int64_t step = node.in.length/nThreads;
+				int64_t end = std::min(hi, node.outShape.length);
+				for(int64_t j = 0; j < nThreads; j++)
+					for(int64_t i = lo; i < end; i++)
+						merge(node, j*step+i*2, j*step+i*2+1);
+			}
+		}
+
+		for(int64_t j = 1; j < nThreads; j++) {
+			for(IRef ref = 0; ref < (int64_t)trace->nodes.size(); ref++) {
+				IRNode & node = trace->nodes[ref];
+				if(node.group == IRNode::FOLD) {
+					int64_t step = node.in.length/nThreads;
+					int64_t stride = node.outShape.length <= BIG_CARDINALITY ? 2 : 1;
+					int64_t end = std::min(hi, node.outShape.length);
+					for(int64_t i = lo; i < end; i++)
+						merge(node, i*stride, j*step+i*stride);
 				}
 			}
 		}
+	}
 
-		// merge across threads
+	static void mergebody(void* args, void* h, uint64_t start, uint64_t end, Thread& thread) {
+		TraceJIT& t = *(TraceJIT*)args;
+		for(uint64_t b = start; b < end; b++)
+			t.MergeLevels(b*MERGE_BLOCK, (b+1)*MERGE_BLOCK);
+	}
+
+	void GlobalReduce(Thread& thread, TraceCode* code) {
+		// grouped folds with many levels merge in blocks spread over the threads
+		int64_t levels = 0;
 		for(IRef ref = 0; ref < (int64_t)trace->nodes.size(); ref++) {
 			IRNode & node = trace->nodes[ref];
-	
-			if(node.group == IRNode::FOLD) {
-				int64_t step = node.in.length/thread.state.nThreads;
-				for(int64_t j = 1; j < thread.state.nThreads; j++) {
-					for(int64_t i = 0; i < node.outShape.length; i++) {
-						int64_t a = 0*step+i;
-						int64_t b = j*step+i;
-						switch(node.op) {
-							case IROpCode::sum: 
-								mergeSum(node, a, b);
-								break;
-							case IROpCode::prod:
-								mergeProd(node, a, b);
-								break;
-							case IROpCode::length:
-								mergeLength(node, a, b);
-								break;
-							case IROpCode::mean:
-								mergeMean(node, a, b);
-								break;
-							case IROpCode::cm2:
-								mergeCm2(node, a, b);
-								break;
-							case IROpCode::min:
-								mergeMin(node, a, b);
-								break;
-							case IROpCode::max:
-								mergeMax(node, a, b);
-								break;
-							default: /* do nothing */ break;
-						}
-					}
-				}
-			}
+			if(node.group == IRNode::FOLD)
+				levels = std::max(levels, node.outShape.length);
 		}
+		uint64_t blocks = (levels+MERGE_BLOCK-1)/MERGE_BLOCK;
+		if(blocks > 1 && thread.state.nThreads > 1)
+			thread.doall(NULL, mergebody, this, 0, blocks, 1, 1, &code->merge);
+		else if(levels > 0)
+			MergeLevels(0, levels);
 
-		// TODO: merge filtered vectors!
+		Compact(thread, code);
 
 		// copy to output vector
 		for(IRef ref = 0; ref < (int64_t)trace->nodes.size(); ref++) {
@@ -2022,12 +2828,30 @@ struct TraceJIT {
 };
 
 void Trace::JIT(Thread & thread) {
-	if(code_buffer == NULL) { //since it is expensive to reallocate this, we reuse it across traces
-		code_buffer = new TraceCodeBuffer();
+	TraceCache*& cache = thread.traces.cache;
+	if(cache == NULL) {
+		cache = new TraceCache();
+	}
+
+	TraceJIT trace_code(this, thread, *cache);
+	trace_code.Allocate(thread);
+	trace_code.wide = cache->avx && !thread.state.sseOnly && trace_code.WideSupported();
+
+	std::vector<int64_t> key;
+	trace_code.Key(key);
+	TraceCode* code = cache->find(key);
+	if(code == NULL)
+		code = trace_code.Compile(*cache, key);
+	trace_code.Bind(code);
+
+	if(thread.state.verbose) {
+		printf("trace cache: %s %s (%d compiled, %d of %d lookups hit, this body run %d times)\n",
+			trace_code.wide ? "avx" : "sse", code->runs > 1 ? "hit" : "compiled",
+			(int)cache->compiles, (int)cache->hits, (int)cache->lookups, (int)code->runs);
+		printf("trace registers: %d nodes, %d spills in %d slots\n",
+			(int)nodes.size(), (int)code->spills, (int)code->spillSlots);
 	}
 
-	TraceJIT trace_code(this, thread);
-	trace_code.Compile();
-	trace_code.Execute(thread);
-	trace_code.GlobalReduce(thread);
+	trace_code.Execute(thread, code);
+	trace_code.GlobalReduce(thread, code);
 }
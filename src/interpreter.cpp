@@ -17,9 +17,11 @@
 
 Thread::RandomSeed Thread::seed[100];
 
-Thread::Thread(State& state, uint64_t index) : state(state), index(index), steals(1) {
-	registers = new (GC) Value[DEFAULT_NUM_REGISTERS];
+Thread::Thread(State& state, uint64_t index) : state(state), index(index), cpu(-1), socket(0), steals(1), victimSeed(0x9E3779B97F4A7C15ULL * (index+1)) {
+	registers = AllocateValues(DEFAULT_NUM_REGISTERS);
 	this->base = registers + DEFAULT_NUM_REGISTERS;
+	memset(owned, 0, sizeof(owned));
+	ownedLow = registers + DEFAULT_NUM_REGISTERS;
 	RandomSeed& r = seed[index];
 
 	r.v[0] = 1;
@@ -33,10 +35,14 @@ Thread::Thread(State& state, uint64_t index) : state(state), index(index), steal
 		r.v[0] = r.v[0] * r.m[0] + r.a[0];
 		r.v[1] = r.v[1] * r.m[1] + r.a[1];
 	}
+#ifdef COUNT_DISPATCHES
+	memset(dispatches, 0, sizeof(dispatches));
+#endif
 }
 
 extern Instruction const* mov_op(Thread& thread, Instruction const& inst) ALWAYS_INLINE;
 extern Instruction const* fastmov_op(Thread& thread, Instruction const& inst) ALWAYS_INLINE;
+extern Instruction const* force_op(Thread& thread, Instruction const& inst) ALWAYS_INLINE;
 extern Instruction const* assign_op(Thread& thread, Instruction const& inst) ALWAYS_INLINE;
 extern Instruction const* forend_op(Thread& thread, Instruction const& inst) ALWAYS_INLINE;
 extern Instruction const* add_op(Thread& thread, Instruction const& inst) ALWAYS_INLINE;
@@ -44,6 +50,12 @@ extern Instruction const* subset_op(Thread& thread, Instruction const& inst) ALW
 extern Instruction const* subset2_op(Thread& thread, Instruction const& inst) ALWAYS_INLINE;
 extern Instruction const* jc_op(Thread& thread, Instruction const& inst) ALWAYS_INLINE;
 extern Instruction const* lt_op(Thread& thread, Instruction const& inst) ALWAYS_INLINE;
+extern Instruction const* le_op(Thread& thread, Instruction const& inst) ALWAYS_INLINE;
+extern Instruction const* gt_op(Thread& thread, Instruction const& inst) ALWAYS_INLINE;
+extern Instruction const* ge_op(Thread& thread, Instruction const& inst) ALWAYS_INLINE;
+extern Instruction const* eq_op(Thread& thread, Instruction const& inst) ALWAYS_INLINE;
+extern Instruction const* neq_op(Thread& thread, Instruction const& inst) ALWAYS_INLINE;
+extern Instruction const* jmp_op(Thread& thread, Instruction const& inst) ALWAYS_INLINE;
 extern Instruction const* ret_op(Thread& thread, Instruction const& inst) ALWAYS_INLINE;
 extern Instruction const* retp_op(Thread& thread, Instruction const& inst) ALWAYS_INLINE;
 extern Instruction const* internal_op(Thread& thread, Instruction const& inst) ALWAYS_INLINE;
@@ -73,14 +85,55 @@ Instruction const* forceReg(Thread& thread, Instruction const& inst, Value const
 	}
 }
 
+// A parameter's frame slot holds what MatchArgs bound to it until it's first
+// read. Promises and defaults are evaluated in the environment they carry,
+// with the result going back to the slot, and inst is run again.
+static __attribute__((noinline)) Instruction const* forceSlot(Thread& thread, Instruction const& inst, Value const& a, String name) {
+	StackFrame const& frame = thread.frame;
+	if(frame.prototype->frameless && frame.caller == 0 && frame.environment->has(name)) {
+		// moved to the frame's environment by FrameEnvironment, force it there
+		Value const& v = frame.environment->get(name);
+		if(v.isConcrete()) {
+			REGISTER(inst.a) = v;
+			return &inst+1;
+		}
+		return forceReg(thread, inst, &v, name);
+	}
+	if(a.isPromise() || a.isDefault()) {
+		Function const& f = (Function const&)a;
+		assert(f.environment());
+		Instruction const* i = buildStackFrame(thread, f.environment(), f.prototype(), &inst, thread.frame.prototype->registers);
+		thread.frame.dest = inst.a;
+		thread.frame.env = 0;
+		return i;
+	} else if(a.isDotdot()) {
+		Value const& t = ((Environment*)a.p)->dots[a.length].v;
+		if(t.isConcrete()) {
+			REGISTER(inst.a) = t;
+			return &inst+1;
+		}
+		return forceDot(thread, inst, &t, (Environment*)a.p, a.length);
+	} else {
+		_error(std::string("argument \"") + thread.externStr(name) + "\" is missing, with no default");
+	}
+}
+
 // Tracing stuff
 
-//track the heat of back edge operations and invoke the recorder on hot traces
-//unused until we begin tracing loops again
-static Instruction const * profile_back_edge(Thread & thread, Instruction const * inst) {
+//track the heat of back edge operations; once a loop the method JIT can
+//compile gets hot its head starts dispatching into the compiled loop
+static Instruction const * profile_back_edge(Thread & thread, Prototype const* prototype, Instruction const * inst) {
+#ifdef ENABLE_EPEE
+	if(__builtin_expect(!prototype->loops.empty(), false))
+		return HotLoop(thread, inst);
+#endif
 	return inst;
 }
 
+static Instruction const * profile_back_edge(Thread & thread, Instruction const * inst) {
+	return profile_back_edge(thread, thread.frame.prototype, inst);
+}
+
 // Control flow instructions
 
 Instruction const* call_op(Thread& thread, Instruction const& inst) {
@@ -90,10 +143,13 @@ Instruction const* call_op(Thread& thread, Instruction const& inst) {
 	Function const& func = (Function const&)f;
 	
 	CompiledCall const& call = thread.frame.prototype->calls[inst.b];
-	Environment* fenv = CreateEnvironment(thread, func.environment(), thread.frame.environment, call.call);
+	Environment* env = FrameEnvironment(thread);
+	Environment* fenv = FunctionEnvironment(thread, func, env, call.call);
 	
-	MatchArgs(thread, thread.frame.environment, fenv, func, call);
-	return buildStackFrame(thread, fenv, func.prototype(), inst.c, &inst+1);
+	Instruction const* pc = buildStackFrame(thread, fenv, func.prototype(), inst.c, &inst+1);
+	FunctionFrame(thread, env, call.call);
+	MatchArgs(thread, env, fenv, func, call);
+	return pc;
 }
 
 Instruction const* ncall_op(Thread& thread, Instruction const& inst) {
@@ -103,10 +159,13 @@ Instruction const* ncall_op(Thread& thread, Instruction const& inst) {
 	Function const& func = (Function const&)f;
 	
 	CompiledCall const& call = thread.frame.prototype->calls[inst.b];
-	Environment* fenv = CreateEnvironment(thread, func.environment(), thread.frame.environment, call.call);
+	Environment* env = FrameEnvironment(thread);
+	Environment* fenv = FunctionEnvironment(thread, func, env, call.call);
 	
-	MatchNamedArgs(thread, thread.frame.environment, fenv, func, call);
-	return buildStackFrame(thread, fenv, func.prototype(), inst.c, &inst+1);
+	Instruction const* pc = buildStackFrame(thread, fenv, func.prototype(), inst.c, &inst+1);
+	FunctionFrame(thread, env, call.call);
+	MatchNamedArgs(thread, env, fenv, func, call);
+	return pc;
 }
 
 Instruction const* ret_op(Thread& thread, Instruction const& inst) {
@@ -116,13 +175,16 @@ Instruction const* ret_op(Thread& thread, Instruction const& inst) {
 	// We can free this environment for reuse
 	// as long as we don't return a closure...
 	// TODO: but also can't if an assignment to an out of scope variable occurs (<<-, assign) with a value of a closure!
-	if(result.isClosureSafe()) {
+	// A frameless function's environment is its closure's, which isn't ours
+	// to free, unless a call gave it its own (see FrameEnvironment).
+	if((!thread.frame.prototype->frameless || thread.frame.caller == 0) && result.isClosureSafe()) {
 		thread.environments.push_back(thread.frame.environment);
 		thread.traces.KillEnvironment(thread.frame.environment);
 	}
 
 	REGISTER(0) = result;
 	
+	thread.disown(thread.base);
 	thread.base = thread.frame.returnbase;
 	Instruction const* returnpc = thread.frame.returnpc;
 	
@@ -154,12 +216,16 @@ Instruction const* retp_op(Thread& thread, Instruction const& inst) {
 	// we can return futures from promises, so don't BIND
 	OPERAND(result, inst.a); FORCE(result, inst.a);	
 	
-	if(thread.frame.dest > 0) {
+	if(thread.frame.env == 0) {
+		// a parameter's frame slot, see forceSlot
+		thread.frame.returnbase[thread.frame.dest] = result;
+	} else if(thread.frame.dest > 0) {
 		thread.frame.env->insert((String)thread.frame.dest) = result;
+		thread.traces.LiveEnvironment(thread.frame.env, result);
 	} else {
 		thread.frame.env->dots[-thread.frame.dest].v = result;
+		thread.traces.LiveEnvironment(thread.frame.env, result);
 	}
-	thread.traces.LiveEnvironment(thread.frame.env, result);
 	
 	thread.base = thread.frame.returnbase;
 	Instruction const* returnpc = thread.frame.returnpc;
@@ -169,13 +235,14 @@ Instruction const* retp_op(Thread& thread, Instruction const& inst) {
 }
 
 Instruction const* jmp_op(Thread& thread, Instruction const& inst) {
+	if(inst.a <= 0) return profile_back_edge(thread, &inst+inst.a);
 	return &inst+inst.a;
 }
 
 Instruction const* jc_op(Thread& thread, Instruction const& inst) {
 	OPERAND(c, inst.c);
 	if(c.isLogical1()) {
-		if(Logical::isTrue(c.c)) return &inst+inst.a;
+		if(Logical::isTrue(c.c)) return inst.a > 0 ? &inst+inst.a : profile_back_edge(thread, &inst+inst.a);
 		else if(Logical::isFalse(c.c)) return &inst+inst.b;
 		else _error("NA where TRUE/FALSE needed"); 
 	} else if(c.isInteger1()) {
@@ -216,13 +283,13 @@ Instruction const* branch_op(Thread& thread, Instruction const& inst) {
 }
 
 Instruction const* forbegin_op(Thread& thread, Instruction const& inst) {
-	// a = loop variable (e.g. i), b = loop vector(e.g. 1:100), c = counter register
+	// a = loop variable (e.g. i, or a frame slot register), b = loop vector(e.g. 1:100), c = counter register
 	// following instruction is a jmp that contains offset
 	OPERAND(vec, inst.b); FORCE(vec, inst.b); BIND(vec);
 	if((int64_t)vec.length <= 0) {
 		return &inst+(&inst+1)->a;	// offset is in following JMP, dispatch together
 	} else {
-		Element2(vec, 0, thread.frame.environment->insert((String)inst.a));
+		Element2(vec, 0, inst.a <= 0 ? REGISTER(inst.a) : thread.frame.environment->insert((String)inst.a));
 		Value& counter = REGISTER(inst.c);
 		counter.header = vec.length;	// warning: not a valid object, but saves a shift
 		counter.i = 1;
@@ -233,7 +300,7 @@ Instruction const* forend_op(Thread& thread, Instruction const& inst) {
 	Value& counter = REGISTER(inst.c);
 	if(__builtin_expect((counter.i) < counter.header, true)) {
 		OPERAND(vec, inst.b); //FORCE(vec, inst.b); BIND(vec); // this must have necessarily been forced by the forbegin.
-		Element2(vec, counter.i, thread.frame.environment->insert((String)inst.a));
+		Element2(vec, counter.i, inst.a <= 0 ? REGISTER(inst.a) : thread.frame.environment->insert((String)inst.a));
 		counter.i++;
 		return profile_back_edge(thread,&inst+(&inst+1)->a);
 	} else {
@@ -320,6 +387,14 @@ Instruction const* mov_op(Thread& thread, Instruction const& inst) {
 	return &inst+1;
 }
 
+Instruction const* force_op(Thread& thread, Instruction const& inst) {
+	// a = parameter's frame slot, b = its name
+	Value const& a = REGISTER(inst.a);
+	if(__builtin_expect(a.isConcrete(), true))
+		return &inst+1;
+	return forceSlot(thread, inst, a, (String)inst.b);
+}
+
 Instruction const* fastmov_op(Thread& thread, Instruction const& inst) {
 	OPERAND(value, inst.a); FORCE(value, inst.a); // fastmov assumes we don't need to bind. So next op better be able to handle a future 
 	OUT(thread, inst.c) = value;
@@ -340,6 +415,32 @@ Instruction const* dotdot_op(Thread& thread, Instruction const& inst) {
 	return &inst+1;
 }
 
+static inline bool isSlot(Thread const& thread, int64_t operand) {
+	Prototype const* p = thread.frame.prototype;
+	return (uint64_t)(-operand - (int64_t)p->constants.size()) < (uint64_t)p->slots;
+}
+
+// [<- and [[<- on a slot that only they and reads that keep nothing use (see
+// Compiler::replaceInPlace). Once the slot owns its vector nothing else can
+// see it change, so it's updated in place, growing geometrically when a
+// scalar index runs off the end. Traces still to run might read it though.
+template<void (*Assign)(Thread&, Value const&, bool, Value const&, Value const&, Value&)>
+static void SlotAssign(Thread& thread, Value& slot, Value const& index, Value const& value) {
+	Thread::Owned const& o = thread.owner(&slot);
+	bool owned = o.slot == &slot && o.p == slot.p && slot.isVector() && slot.length > 1 &&
+		!thread.traces.pending();
+	int64_t capacity = owned ? o.capacity : 0;
+	if(owned && value.length == 1 && (index.isInteger1() || index.isDouble1())) {
+		double i = index.isInteger1() ? (double)index.i : index.d;
+		if(i > slot.length)
+			Grow(thread, slot, capacity, (int64_t)i);
+	}
+	Value dest = slot;
+	Assign(thread, dest, !owned, index, value, slot);
+	if(slot.isVector() && slot.length > 1)
+		thread.own(&slot, owned && slot.p == dest.p ? capacity : slot.length);
+}
+
 Instruction const* iassign_op(Thread& thread, Instruction const& inst) {
 	// a = value, b = index, c = dest 
 	OPERAND(value, inst.a); FORCE(value, inst.a); 
@@ -361,7 +462,10 @@ Instruction const* iassign_op(Thread& thread, Instruction const& inst) {
 	}
 
 	BIND(value);
-	SubsetAssign(thread, dest, true, index, value, OUT(thread,inst.c));
+	if(isSlot(thread, inst.c))
+		SlotAssign<SubsetAssign>(thread, OUT(thread, inst.c), index, value);
+	else
+		SubsetAssign(thread, dest, true, index, value, OUT(thread,inst.c));
 	return &inst+1;
 }
 Instruction const* eassign_op(Thread& thread, Instruction const& inst) {
@@ -385,7 +489,10 @@ Instruction const* eassign_op(Thread& thread, Instruction const& inst) {
 
 	BIND(dest);
 	BIND(value);
-	Subset2Assign(thread, dest, true, index, value, OUT(thread,inst.c));
+	if(isSlot(thread, inst.c))
+		SlotAssign<Subset2Assign>(thread, OUT(thread, inst.c), index, value);
+	else
+		Subset2Assign(thread, dest, true, index, value, OUT(thread,inst.c));
 	return &inst+1; 
 }
 
@@ -394,9 +501,18 @@ Instruction const* subset_op(Thread& thread, Instruction const& inst) {
 	OPERAND(i, inst.b);
 
 	if(a.isVector()) {
-		if(i.isDouble1()) { Element(a, i.d-1, OUT(thread, inst.c)); return &inst+1; }
-		else if(i.isInteger1()) { Element(a, i.i-1, OUT(thread, inst.c)); return &inst+1; }
-		else if(i.isLogical1()) { Element(a, Logical::isTrue(i.c) ? 0 : -1, OUT(thread, inst.c)); return &inst+1; }
+		// SubsetSlow gives NA for out of bounds indices
+		if(i.isDouble1()) { 
+			if(i.d >= 1 && i.d < a.length+1) Element(a, i.d-1, OUT(thread, inst.c)); 
+			else SubsetSlow(thread, a, i, OUT(thread, inst.c)); 
+			return &inst+1; 
+		}
+		else if(i.isInteger1()) { 
+			if(i.i >= 1 && i.i <= a.length) Element(a, i.i-1, OUT(thread, inst.c)); 
+			else SubsetSlow(thread, a, i, OUT(thread, inst.c)); 
+			return &inst+1; 
+		}
+		else if(i.isLogical1() && Logical::isTrue(i.c) && a.length == 1) { Element(a, 0, OUT(thread, inst.c)); return &inst+1; }
 		else if(i.isCharacter1()) { _error("Subscript out of bounds"); }
 	}
 
@@ -768,31 +884,185 @@ Instruction const* internal_op(Thread& thread, Instruction const& inst) {
 	return &inst+1;
 }
 
+// Superinstructions
+
+#define OP(Name, string, First, Second) \
+Instruction const* Name##_op(Thread& thread, Instruction const& inst) { \
+	Instruction const* next = First##_op(thread, inst); \
+	if(__builtin_expect(next == &inst+1, true)) \
+		return Second##_op(thread, *next); \
+	return next; \
+}
+FUSED_BYTECODES(OP)
+#undef OP
+
+Instruction const* forsubset_op(Thread& thread, Instruction const& inst) {
+	Instruction const* next = forend_op(thread, inst);
+	if(__builtin_expect(next != &inst+2, true))
+		return subset_op(thread, *next);
+	return next;
+}
+
+// Register fast paths
+
+// The interpreter loop keeps base and the frame's prototype in locals. They
+// only change when a frame is pushed or popped, which only the ops' full
+// handlers do, so the loop reloads them after running one. Fast<op>::run
+// covers an op's common case (register operands, scalars) on those locals
+// and returns false to leave anything else to the handler.
+template<ByteCode::Enum bc> struct Fast {
+	static bool run(Thread& thread, Value* base, Prototype const* prototype, Instruction const*& pc) { return false; }
+};
+
+template<> struct Fast<ByteCode::fastmov> {
+	static bool run(Thread& thread, Value* base, Prototype const* prototype, Instruction const*& pc) {
+		if(pc->a > 0) return false;
+		base[pc->c] = base[pc->a];
+		pc++;
+		return true;
+	}
+};
+
+template<> struct Fast<ByteCode::force> {
+	static bool run(Thread& thread, Value* base, Prototype const* prototype, Instruction const*& pc) {
+		if(!base[pc->a].isConcrete()) return false;
+		pc++;
+		return true;
+	}
+};
+
+template<> struct Fast<ByteCode::jmp> {
+	static bool run(Thread& thread, Value* base, Prototype const* prototype, Instruction const*& pc) {
+		pc = pc->a > 0 ? pc+pc->a : profile_back_edge(thread, prototype, pc+pc->a);
+		return true;
+	}
+};
+
+template<> struct Fast<ByteCode::jc> {
+	static bool run(Thread& thread, Value* base, Prototype const* prototype, Instruction const*& pc) {
+		if(pc->c > 0) return false;
+		Value const& c = base[pc->c];
+		if(!c.isLogical1()) return false;
+		if(Logical::isTrue(c.c)) pc = pc->a > 0 ? pc+pc->a : profile_back_edge(thread, prototype, pc+pc->a);
+		else if(Logical::isFalse(c.c)) pc += pc->b;
+		else return false;
+		return true;
+	}
+};
+
+template<> struct Fast<ByteCode::forend> {
+	static bool run(Thread& thread, Value* base, Prototype const* prototype, Instruction const*& pc) {
+		if(pc->a > 0 || pc->b > 0) return false;
+		Value& counter = base[pc->c];
+		if(__builtin_expect(counter.i < counter.header, true)) {
+			Element2(base[pc->b], counter.i, base[pc->a]);
+			counter.i++;
+			pc = profile_back_edge(thread, prototype, pc+(pc+1)->a);
+		} else {
+			pc += 2;
+		}
+		return true;
+	}
+};
+
+#define FAST(Name, string, Group, Func) \
+template<> struct Fast<ByteCode::Name> { \
+	static bool run(Thread& thread, Value* base, Prototype const* prototype, Instruction const*& pc) { \
+		if(pc->a > 0 || pc->b > 0) return false; \
+		Value const& a = base[pc->a]; \
+		Value const& b = base[pc->b]; \
+		Value& c = base[pc->c]; \
+		if(a.isDouble1()) { \
+			if(b.isDouble1()) Name##VOp<Double,Double>::Scalar(thread, a.d, b.d, c); \
+			else if(b.isInteger1()) Name##VOp<Double,Integer>::Scalar(thread, a.d, b.i, c); \
+			else return false; \
+		} \
+		else if(a.isInteger1()) { \
+			if(b.isDouble1()) Name##VOp<Integer,Double>::Scalar(thread, a.i, b.d, c); \
+			else if(b.isInteger1()) Name##VOp<Integer,Integer>::Scalar(thread, a.i, b.i, c); \
+			else return false; \
+		} \
+		else return false; \
+		pc++; \
+		return true; \
+	} \
+};
+ARITH_BINARY_BYTECODES(FAST)
+ORDINAL_BINARY_BYTECODES(FAST)
+#undef FAST
+
+// Superinstructions whose second op has a fast path too. If only the first
+// one's applies, the loop dispatches to the second op on its own.
+#define FAST(Name, string, First, Second) \
+template<> struct Fast<ByteCode::Name> { \
+	static bool run(Thread& thread, Value* base, Prototype const* prototype, Instruction const*& pc) { \
+		if(!Fast<ByteCode::First>::run(thread, base, prototype, pc)) return false; \
+		Fast<ByteCode::Second>::run(thread, base, prototype, pc); \
+		return true; \
+	} \
+};
+FAST(ltjc, "ltjc", lt, jc)
+FAST(lejc, "lejc", le, jc)
+FAST(gtjc, "gtjc", gt, jc)
+FAST(gejc, "gejc", ge, jc)
+FAST(eqjc, "eqjc", eq, jc)
+FAST(neqjc, "neqjc", neq, jc)
+FAST(addmov, "addmov", add, fastmov)
+#undef FAST
+
 //
 //    Main interpreter loop 
 //
+#ifdef COUNT_DISPATCHES
+#define COUNT_DISPATCH(name) thread.dispatches[ByteCode::name]++
+#else
+#define COUNT_DISPATCH(name)
+#endif
+
 //__attribute__((__noinline__,__noclone__)) 
 void interpret(Thread& thread, Instruction const* pc) {
 
 #ifdef USE_THREADED_INTERPRETER
 	if(pc == 0) { 
     		#define LABELS_THREADED(name,type,...) (void*)&&name##_label,
-		static const void* labels[] = {BYTECODES(LABELS_THREADED)};
+#ifdef ENABLE_EPEE
+		// the handler hot loop heads are redirected to, after the bytecodes' own
+		#define LABEL_JITLOOP (void*)&&jitloop_label,
+#else
+		#define LABEL_JITLOOP
+#endif
+		static const void* labels[] = {BYTECODES(LABELS_THREADED) LABEL_JITLOOP};
 		glabels = labels;
+#ifdef ENABLE_EPEE
+		gjitloop = labels[sizeof(labels)/sizeof(labels[0])-1];
+#endif
 		return;
 	}
 
+	Value* base = thread.base;
+	Prototype const* prototype = thread.frame.prototype;
+
 	goto *(void*)(pc->ibc);
 	#define LABELED_OP(name,type,...) \
 		name##_label: \
-			{ pc = name##_op(thread, *pc); goto *(void*)(pc->ibc); } 
+			{ COUNT_DISPATCH(name); \
+			  if(Fast<ByteCode::name>::run(thread, base, prototype, pc)) goto *(void*)(pc->ibc); \
+			  pc = name##_op(thread, *pc); \
+			  base = thread.base; prototype = thread.frame.prototype; \
+			  goto *(void*)(pc->ibc); } 
 	STANDARD_BYTECODES(LABELED_OP)
+#ifdef ENABLE_EPEE
+	// loop heads found by FindLoops: run the compiled loop, then go on with
+	// the instruction it exited to (or the head itself) as usual
+	jitloop_label:
+		{ pc = RunLoop(thread, pc); goto *glabels[pc->bc]; }
+#endif
 	done_label: {}
 #else
 	while(pc->bc != ByteCode::done) {
 		switch(pc->bc) {
 			#define SWITCH_OP(name,type,...) \
-				case ByteCode::name: { pc = name##_op(thread, *pc); } break;
+				case ByteCode::name: { COUNT_DISPATCH(name); pc = name##_op(thread, *pc); } break;
 			BYTECODES(SWITCH_OP)
 		};
 	}
@@ -823,8 +1093,12 @@ Value Thread::eval(Prototype const* prototype, Environment* environment) {
 		base++;
 		assert(base == old_base);
 		assert(stackSize == stack.size());
+		// back at top level, between statements
+		if(stackSize == 0)
+			state.gcSafePoint();
 		return *(base-1);
 	} catch(...) {
+		disown(old_base);
 		base = old_base;
 		stack.resize(stackSize);
 		throw;
@@ -3,7 +3,6 @@
 
 #include <map>
 #include <set>
-#include <deque>
 
 #include "value.h"
 #include "thread.h"
@@ -11,6 +10,7 @@
 #ifdef ENABLE_EPEE
 #include "epee/ir.h"
 #include "epee/trace.h"
+#include "epee/method_jit.h"
 #endif
 
 class Thread;
@@ -31,31 +31,145 @@ BYTECODES(DECLARE_INTERPRETER_FNS)
 ///////////////////////////////////////////////////////////////////
 
 
-// TODO: Make this use a good concurrent map implementation 
+// Concurrent string interning table.
+// Strings are spread over shards by hash. Each shard is an open addressing
+// table of (hash, length, string) entries. Looking up a string that is
+// already interned takes no lock: an entry's string pointer is written last,
+// after its hash and length, and a shard's slot array is never modified in
+// place when it grows (a new one is published instead), so readers racing
+// with an insert see either a complete entry or an empty slot. Inserts take
+// the shard's lock. Outgrown slot arrays are not freed since readers may
+// still hold them; since tables only double this wastes less than their
+// final size.
+// String bodies are carved out of per-shard arena blocks.
+#define STRING_TABLE_SHARDS 64
+#define STRING_ARENA_BLOCK (64*1024)
+
 class StringTable {
-	std::map<std::string, String> stringTable;
-	Lock lock;
+	struct Entry {
+		uint64_t hash;
+		uint64_t length;
+		String volatile string;
+	};
+
+	struct Slots {
+		uint64_t mask;
+		Entry* entries;
+		explicit Slots(uint64_t size) : mask(size-1) {
+			entries = new Entry[size];
+			memset(entries, 0, sizeof(Entry)*size);
+		}
+	};
+
+	struct Shard {
+		Slots* volatile slots;
+		uint64_t load;
+		char* arena;
+		uint64_t arenaLeft;
+		Lock lock;
+		Shard() : slots(new Slots(64)), load(0), arena(0), arenaLeft(0) {}
+	} shards[STRING_TABLE_SHARDS];
+
+	static uint64_t hash(char const* s, uint64_t length) {
+		// FNV-1a
+		uint64_t h = 14695981039346656037ULL;
+		for(uint64_t i = 0; i < length; i++) {
+			h ^= (unsigned char)s[i];
+			h *= 1099511628211ULL;
+		}
+		return h;
+	}
+
+	static String find(Slots const* t, uint64_t h, char const* s, uint64_t length) {
+		for(uint64_t i = (h / STRING_TABLE_SHARDS) & t->mask; ; i = (i+1) & t->mask) {
+			Entry const& e = t->entries[i];
+			String str = e.string;
+			if(str == 0)
+				return 0;
+			asm volatile("" ::: "memory");
+			if(e.hash == h && e.length == length && memcmp(str, s, length) == 0)
+				return str;
+		}
+	}
+
+	// shard lock must be held
+	static void insert(Slots* t, uint64_t h, uint64_t length, String str) {
+		uint64_t i = (h / STRING_TABLE_SHARDS) & t->mask;
+		while(t->entries[i].string != 0)
+			i = (i+1) & t->mask;
+		t->entries[i].hash = h;
+		t->entries[i].length = length;
+		__sync_synchronize();
+		t->entries[i].string = str;
+	}
+
+	// shard lock must be held
+	static void add(Shard& shard, uint64_t h, uint64_t length, String str) {
+		Slots* t = shard.slots;
+		if((shard.load+1)*2 > t->mask+1) {
+			Slots* n = new Slots((t->mask+1)*2);
+			for(uint64_t i = 0; i <= t->mask; i++) {
+				Entry const& e = t->entries[i];
+				if(e.string != 0)
+					insert(n, e.hash, e.length, e.string);
+			}
+			__sync_synchronize();
+			shard.slots = t = n;
+		}
+		insert(t, h, length, str);
+		shard.load++;
+	}
+
+	// shard lock must be held
+	static char* allocate(Shard& shard, uint64_t size) {
+		if(size > STRING_ARENA_BLOCK/8)
+			return new char[size];
+		if(size > shard.arenaLeft) {
+			shard.arena = new char[STRING_ARENA_BLOCK];
+			shard.arenaLeft = STRING_ARENA_BLOCK;
+		}
+		char* r = shard.arena;
+		shard.arena += size;
+		shard.arenaLeft -= size;
+		return r;
+	}
+
 public:
 	StringTable() {
-	#define ENUM_STRING_TABLE(name, string) \
-		stringTable[string] = Strings::name; 
+	#define ENUM_STRING_TABLE(name, string) { \
+		uint64_t length = strlen(Strings::name); \
+		uint64_t h = hash(Strings::name, length); \
+		add(shards[h % STRING_TABLE_SHARDS], h, length, Strings::name); }
 		STRINGS(ENUM_STRING_TABLE);
+	#undef ENUM_STRING_TABLE
 	}
 
-	String in(std::string const& s) {
-		lock.acquire();
-		std::map<std::string, String>::const_iterator i = stringTable.find(s);
-		if(i == stringTable.end()) {
-			char* str = new char[s.size()+1];
-			memcpy(str, s.c_str(), s.size()+1);
-			String string = (String)str;
-			stringTable[s] = string;
-			lock.release();
-			return string;
-		} else {
-			lock.release();
-			return i->second;
+	String in(char const* s, uint64_t length) {
+		uint64_t h = hash(s, length);
+		Shard& shard = shards[h % STRING_TABLE_SHARDS];
+		String r = find(shard.slots, h, s, length);
+		if(r != 0)
+			return r;
+
+		shard.lock.acquire();
+		r = find(shard.slots, h, s, length);
+		if(r == 0) {
+			char* str = allocate(shard, length+1);
+			memcpy(str, s, length);
+			str[length] = 0;
+			add(shard, h, length, str);
+			r = str;
 		}
+		shard.lock.release();
+		return r;
+	}
+
+	String in(char const* s) {
+		return in(s, strlen(s));
+	}
+
+	String in(std::string const& s) {
+		return in(s.c_str(), s.size());
 	}
 
 	std::string out(String s) const {
@@ -75,6 +189,9 @@ struct CompiledCall : public gc {
 		: call(call), arguments(arguments), dotIndex(dotIndex), named(named) {}
 };
 
+struct LoopCode;
+struct Grain;
+
 struct Prototype : public gc {
 	Value expression;
 	String string;
@@ -83,11 +200,18 @@ struct Prototype : public gc {
 	int dotIndex;
 
 	int registers;
+	int slots;	// frame slots, encoded just after the constants
+	std::vector<int64_t, gc_allocator<int64_t> > parameterSlots;	// slot each parameter is bound to, -1 for the environment
+	bool frameless;	// nothing lives in the environment, so calls run in the closure's
+	std::vector<int64_t, gc_allocator<int64_t> > spills;	// parameters promises read, copied into a frameless frame's environment (see FrameEnvironment)
 	std::vector<Value, traceable_allocator<Value> > constants;
 	std::vector<CompiledCall, traceable_allocator<CompiledCall> > calls; 
 
-	std::vector<Instruction> bc;			// bytecode
-	mutable std::vector<Instruction> tbc;		// threaded bytecode
+	// scanned: instructions point at their SymbolCaches, see lookupEnclosing
+	std::vector<Instruction, traceable_allocator<Instruction> > bc;		// bytecode
+	mutable std::vector<Instruction, traceable_allocator<Instruction> > tbc;	// threaded bytecode
+	mutable std::vector<LoopCode*, traceable_allocator<LoopCode*> > loops;	// loops found for the method JIT
+	mutable Grain* grain;	// cost of one call of this function under mapply, created on first use
 };
 
 struct StackFrame {
@@ -99,6 +223,11 @@ struct StackFrame {
 	
 	int64_t dest;
 	Environment* env;
+
+	// A frameless function's caller and call, kept until its first call of
+	// its own gives it an environment. caller is 0 after that.
+	Environment* caller;
+	Value call;
 };
 
 // TODO: Careful, args and result might overlap!
@@ -111,6 +240,17 @@ struct InternalFunction {
 
 #define DEFAULT_NUM_REGISTERS 10000
 
+// vectors tracked as owned by frame slots, see Thread::owned
+#define OWNED_SLOTS 8
+
+// number of times an idle worker polls for work before parking
+#define IDLE_SPINS 256
+
+// adaptive doall grain: aim for chunks that take about this long...
+#define GRAIN_TARGET_TIME (20e-6)
+// ...but never cut a range into more than this many chunks per thread
+#define GRAIN_MAX_TASKS_PER_THREAD 64
+
 
 ////////////////////////////////////////////////////////////////////
 // Global shared state 
@@ -128,18 +268,30 @@ public:
 
 	std::vector<Thread*, traceable_allocator<Thread*> > threads;
 	int64_t nThreads;
+	bool pinned;		// workers are bound to cores (-j N --pin)
+
+	// how the collector runs, picked with --gc
+	enum Collector {
+		NO_GC,		// never collect
+		STOP_THE_WORLD,	// full collections, marked by all threads
+		INCREMENTAL	// collect in small steps, generationally
+	};
+	Collector collector;
 
 	bool verbose;
 	bool jitEnabled;
+	bool sseOnly;		// compile traces for SSE even on AVX machines (--sse)
     
 	int64_t done;
+	EventCount idle;	// workers park here when there is nothing to steal
 
 	Character arguments;
 
-	State(uint64_t threads, int64_t argc, char** argv);
+	State(uint64_t threads, int64_t argc, char** argv, bool pin = false);
 
 	~State() {
 		fetch_and_add(&done, 1);
+		idle.notifyAll();
 		while(fetch_and_add(&done, 0) != nThreads) { sleep(); }
 	}
 
@@ -148,6 +300,15 @@ public:
 		return *threads[0];
 	}
 
+	// A thread with nothing else to do lets an incremental collection
+	// make progress here instead of waiting for the next allocation.
+	// Only called where everything the thread holds is reachable from
+	// its stack or registers.
+	void gcSafePoint() {
+		if(collector == INCREMENTAL)
+			GC_collect_a_little();
+	}
+
 	void registerInternalFunction(String s, InternalFunctionPtr internalFunction, int64_t params) {
 		InternalFunction i = { internalFunction, params };
 		internalFunctions.push_back(i);
@@ -162,10 +323,18 @@ public:
 #endif
 	std::string deparse(Value const& v) const;
 
-	String internStr(std::string s) {
+	String internStr(std::string const& s) {
+		return strings.in(s);
+	}
+
+	String internStr(char const* s) {
 		return strings.in(s);
 	}
 
+	String internStr(char const* s, uint64_t length) {
+		return strings.in(s, length);
+	}
+
 	std::string externStr(String s) const {
 		return strings.out(s);
 	}
@@ -178,6 +347,39 @@ public:
 typedef void* (*TaskHeaderPtr)(void* args, uint64_t a, uint64_t b, Thread& thread);
 typedef void (*TaskFunctionPtr)(void* args, void* header, uint64_t a, uint64_t b, Thread& thread);
 
+// Estimate of what one element of a given doall body costs, used to pick
+// the grain (elements per chunk). Keep one per body whose cost it measures,
+// e.g. per compiled trace or per function mapply applies. Every task times
+// its first chunk and folds it into the estimate. Updates race between
+// threads, but it is only a heuristic.
+struct Grain {
+	uint64_t minimum;	// smallest grain the body allows
+	double cost;		// seconds per element, 0 until first sample
+	uint64_t samples;	// instrumentation: chunks timed so far
+	uint64_t chosen;	// instrumentation: last grain picked
+
+	explicit Grain(uint64_t minimum) : minimum(minimum), cost(0), samples(0), chosen(minimum) {}
+
+	void sample(uint64_t elements, double seconds) {
+		double c = seconds / std::max((uint64_t)1, elements);
+		cost = cost == 0 ? c : 0.75*cost + 0.25*c;
+		samples++;
+	}
+
+	uint64_t choose(uint64_t length, uint64_t threads, uint64_t alignment) {
+		uint64_t g = cost > 0 ? (uint64_t)(GRAIN_TARGET_TIME / cost) : minimum;
+		g = std::max(g, length / (threads * GRAIN_MAX_TASKS_PER_THREAD));
+		// leave at least one chunk for every thread
+		if(threads > 1)
+			g = std::min(g, length / threads);
+		g = std::max(g, minimum);
+		uint64_t tmp = g+alignment-1;
+		g = std::max((uint64_t)1, tmp - (tmp % alignment));
+		chosen = g;
+		return g;
+	}
+};
+
 class Thread : public gc {
 public:
 	struct Task : public gc {
@@ -189,9 +391,11 @@ public:
 		uint64_t alignment;
 		uint64_t ppt;
 		int64_t* done;
-		Task() : func(0), args(0), done(0) {}
-		Task(TaskHeaderPtr header, TaskFunctionPtr func, void* args, uint64_t a, uint64_t b, uint64_t alignment, uint64_t ppt) 
-			: header(header), func(func), args(args), a(a), b(b), alignment(alignment), ppt(ppt) {
+		EventCount* finished;	// notified when done reaches 0
+		Grain* grain;		// if set, ppt adapts to the measured chunk cost
+		Task() : func(0), args(0), done(0), finished(0), grain(0) {}
+		Task(TaskHeaderPtr header, TaskFunctionPtr func, void* args, uint64_t a, uint64_t b, uint64_t alignment, uint64_t ppt, EventCount* finished, Grain* grain) 
+			: header(header), func(func), args(args), a(a), b(b), alignment(alignment), ppt(ppt), finished(finished), grain(grain) {
 			done = new (GC) int64_t(1);
 		}
 	};
@@ -199,6 +403,8 @@ public:
 	State& state;
 	uint64_t index;
 	pthread_t thread;
+	int64_t cpu;		// core this thread is pinned to, or -1
+	int64_t socket;		// socket of that core
 	
 	Value* base;
 	Value* registers;
@@ -213,11 +419,54 @@ public:
 	Traces traces;
 #endif
 
-	std::deque<Task> tasks;
-	Lock tasksLock;
+	WorkDeque<Task> tasks;
 	int64_t steals;
+	EventCount finished;	// this thread parks here waiting on its own doall
+	uint64_t victimSeed;	// xorshift state for picking steal victims
 
 	int64_t assignment[64], set[64]; // temporary space for matching arguments
+
+	// Vectors that nothing but a private frame slot refers to (see
+	// Compiler::replaceInPlace), so [<- and [[<- can change them in place.
+	// Direct mapped on the slot's address.
+	struct Owned {
+		Value const* slot;
+		void* p;
+		int64_t capacity;	// elements the vector has room for
+	};
+	Owned owned[OWNED_SLOTS];
+	Value const* ownedLow;	// lowest slot in owned
+
+	Owned& owner(Value const* slot) {
+		return owned[((uint64_t)slot / sizeof(Value)) & (OWNED_SLOTS-1)];
+	}
+
+	void own(Value const* slot, int64_t capacity) {
+		Owned& o = owner(slot);
+		o.slot = slot;
+		o.p = slot->p;
+		o.capacity = capacity;
+		ownedLow = std::min(ownedLow, slot);
+	}
+
+	// frames with registers at or below top are gone
+	void disown(Value const* top) {
+		if(top < ownedLow) return;
+		ownedLow = registers + DEFAULT_NUM_REGISTERS;
+		for(int64_t i = 0; i < OWNED_SLOTS; i++) {
+			if(owned[i].slot <= top) {
+				owned[i].slot = 0;
+				owned[i].p = 0;
+			}
+			else {
+				ownedLow = std::min(ownedLow, owned[i].slot);
+			}
+		}
+	}
+
+#ifdef COUNT_DISPATCHES
+	uint64_t dispatches[ByteCode::done+1];
+#endif
 	
 	struct RandomSeed {
 		uint64_t v[2];
@@ -242,11 +491,21 @@ public:
 
 	std::string stringify(Value const& v) const { return state.stringify(v); }
 	std::string deparse(Value const& v) const { return state.deparse(v); }
-	String internStr(std::string s) { return state.internStr(s); }
+	String internStr(std::string const& s) { return state.internStr(s); }
+	String internStr(char const* s) { return state.internStr(s); }
+	String internStr(char const* s, uint64_t length) { return state.internStr(s, length); }
 	std::string externStr(String s) const { return state.externStr(s); }
 
+	void pin(int64_t c) {
+		cpu = c;
+		socket = cpuSocket(c);
+		pinToCpu(c);
+	}
+
 	static void* start(void* ptr) {
 		Thread* p = (Thread*)ptr;
+		if(p->cpu >= 0)
+			pinToCpu(p->cpu);
 		p->loop();
 		return 0;
 	}
@@ -254,18 +513,37 @@ public:
 	Value eval(Prototype const* prototype, Environment* environment); 
 	Value eval(Prototype const* prototype);
 	
-	void doall(TaskHeaderPtr header, TaskFunctionPtr func, void* args, uint64_t a, uint64_t b, uint64_t alignment=1, uint64_t ppt = 1) {
+	// If grain is given, ppt is ignored and picked from grain's cost estimate.
+	void doall(TaskHeaderPtr header, TaskFunctionPtr func, void* args, uint64_t a, uint64_t b, uint64_t alignment=1, uint64_t ppt = 1, Grain* grain = 0) {
 		if(a < b && func != 0) {
-			uint64_t tmp = ppt+alignment-1;
-			ppt = std::max((uint64_t)1, tmp - (tmp % alignment));
+			if(grain != 0) {
+				ppt = grain->choose(b-a, state.nThreads, alignment);
+			} else {
+				uint64_t tmp = ppt+alignment-1;
+				ppt = std::max((uint64_t)1, tmp - (tmp % alignment));
+			}
+
+			Task t(header, func, args, a, b, alignment, ppt, &finished, grain);
+
+			// wake one idle worker per chunk we could hand off
+			uint64_t chunks = (b-a+ppt-1)/ppt;
+			if(chunks > 1)
+				state.idle.notify((int32_t)std::min(chunks-1, (uint64_t)state.nThreads-1));
 
-			Task t(header, func, args, a, b, alignment, ppt);
 			run(t);
 	
 			while(fetch_and_add(t.done, 0) != 0) {
 				Task s;
-				if(dequeue(s) || steal(s)) run(s);
-				else sleep(); 
+				bool found = dequeue(s) || steal(s);
+				if(!found) {
+					int32_t key = finished.prepareWait();
+					found = dequeue(s) || steal(s);
+					if(found || fetch_and_add(t.done, 0) == 0)
+						finished.cancelWait();
+					else
+						finished.wait(key);
+				}
+				if(found) run(s);
 			}
 		}
 	}
@@ -276,7 +554,21 @@ private:
 			// pull stuff off my queue and run
 			// or steal and run
 			Task s;
-			if(dequeue(s) || steal(s)) {
+			bool found = false;
+			for(int64_t i = 0; i < IDLE_SPINS && !found; i++) {
+				found = dequeue(s) || steal(s);
+				if(!found) cpu_relax();
+			}
+			if(!found) {
+				state.gcSafePoint();
+				int32_t key = state.idle.prepareWait();
+				found = dequeue(s) || steal(s);
+				if(found || fetch_and_add(&(state.done), 0) != 0)
+					state.idle.cancelWait();
+				else
+					state.idle.wait(key);
+			}
+			if(found) {
 				try {
 					run(s);
 				} catch(RiposteError& error) {
@@ -286,13 +578,14 @@ private:
 				} catch(CompileError& error) {
 					printf("Error (compiler:%d): %s\n", (int)index, error.what().c_str());
 				}
-			} else sleep(); 
+			}
 		}
 		fetch_and_add(&(state.done), 1);
 	}
 
 	void run(Task& t) {
 		void* h = t.header != NULL ? t.header(t.args, t.a, t.b, *this) : 0;
+		bool sample = t.grain != 0;
 		while(t.a < t.b) {
 			// check if we need to relinquish some of our chunk...
 			int64_t s = atomic_xchg(&steals, 0);
@@ -308,17 +601,27 @@ private:
 				}
 				if(n.a < n.b) {
 					//printf("Thread %d relinquishing %d (%d %d)\n", index, n.b-n.a, t.a, t.b);
-					tasksLock.acquire();
 					fetch_and_add(t.done, 1); 
-					tasks.push_front(n);
-					tasksLock.release();
+					tasks.push(n);
+					state.idle.notify(1);
 				}
 			}
-			t.func(t.args, h, t.a, std::min(t.a+t.ppt,t.b), *this);
-			t.a += t.ppt;
+			uint64_t end = std::min(t.a+t.ppt,t.b);
+			if(sample) {
+				// time the first chunk and re-pick the grain for the rest
+				timespec begin = get_time();
+				t.func(t.args, h, t.a, end, *this);
+				t.grain->sample(end-t.a, time_elapsed(begin));
+				t.ppt = t.grain->choose(t.b-end, state.nThreads, t.alignment);
+				sample = false;
+			} else {
+				t.func(t.args, h, t.a, end, *this);
+			}
+			t.a = end;
 		}
 		//printf("Thread %d finished %d %d (%d)\n", index, t.a, t.b, t.done);
-		fetch_and_add(t.done, -1);
+		if(fetch_and_add(t.done, -1) == 1 && t.finished != 0)
+			t.finished->notify(1);
 	}
 
 	uint64_t split(Task const& t) {
@@ -331,41 +634,44 @@ private:
 	}
 
 	bool dequeue(Task& out) {
-		tasksLock.acquire();
-		if(tasks.size() >= 1) {
-			out = tasks.front();
-			tasks.pop_front();
-			tasksLock.release();
-			return true;
-		}
-		tasksLock.release();
-		return false;
+		return tasks.pop(out);
+	}
+
+	uint64_t nextVictim() {
+		victimSeed ^= victimSeed << 13;
+		victimSeed ^= victimSeed >> 7;
+		victimSeed ^= victimSeed << 17;
+		return victimSeed;
 	}
 
 	bool steal(Task& out) {
 		// check other threads for available tasks, don't check myself.
-		bool found = false;
-		for(uint64_t i = 0; i < state.threads.size() && !found; i++) {
-			if(i != index) {
+		// start at a random victim so idle threads don't all pile onto thread 0.
+		// when pinned, look on our own socket first so stolen ranges stay near their pages.
+		uint64_t n = state.threads.size();
+		if(n <= 1) return false;
+		uint64_t start = nextVictim() % n;
+		for(int pass = state.pinned ? 0 : 1; pass < 2; pass++) {
+			for(uint64_t k = 0; k < n; k++) {
+				uint64_t i = (start + k) % n;
+				if(i == index) continue;
 				Thread& t = *(state.threads[i]);
-				t.tasksLock.acquire();
-				if(t.tasks.size() > 0) {
-					out = t.tasks.back();
-					t.tasks.pop_back();
-					t.tasksLock.release();
-					found = true;
-				} else {
-					fetch_and_add(&t.steals,1);
-					t.tasksLock.release();
+				if(pass == 0 && t.socket != socket) continue;
+				if(pass == 1 && state.pinned && t.socket == socket) continue;
+				// retry while the victim has work, steal only fails spuriously on a lost race
+				while(!t.tasks.empty()) {
+					if(t.tasks.steal(out))
+						return true;
 				}
+				fetch_and_add(&t.steals,1);
 			}
 		}
-		return found;
+		return false;
 	}
 };
 
-inline State::State(uint64_t threads, int64_t argc, char** argv) 
-	: nThreads(threads), verbose(false), jitEnabled(true), done(0) {
+inline State::State(uint64_t threads, int64_t argc, char** argv, bool pin) 
+	: nThreads(threads), pinned(pin), collector(STOP_THE_WORLD), verbose(false), jitEnabled(true), sseOnly(false), done(0) {
 	Environment* base = new (GC) Environment(0);
 	this->global = new (GC) Environment(base);
 	path.push_back(base);
@@ -380,12 +686,22 @@ inline State::State(uint64_t threads, int64_t argc, char** argv)
 	pthread_attr_setscope (&attr, PTHREAD_SCOPE_SYSTEM);
 	pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
 
+	int64_t cpus = cpuCount();
+
 	Thread* t = new (GC) Thread(*this, 0);
+	if(pinned)
+		t->pin(0);
 	this->threads.push_back(t);
 
 	for(uint64_t i = 1; i < threads; i++) {
 		Thread* t = new Thread(*this, i);
-		pthread_create (&t->thread, &attr, Thread::start, t);
+		if(pinned) {
+			// start() does the pinning, but record the socket now so early thieves see it
+			t->cpu = i % cpus;
+			t->socket = cpuSocket(t->cpu);
+		}
+		// workers hold references on their stacks, so the collector has to know them
+		GC_pthread_create (&t->thread, &attr, Thread::start, t);
 		this->threads.push_back(t);
 	}
 
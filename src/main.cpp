@@ -172,6 +172,45 @@ static int run(State& state, std::istream& in, std::ostream& out, bool interacti
     return rc;
 }
 
+/* collector statistics for the whole session */
+static void dumpHeap(State& state)
+{
+    static char const* names[] = { "off", "on", "incremental" };
+    printf("gc: %s, %s marking, %d collections\n",
+        names[state.collector], GC_get_parallel() ? "parallel" : "serial",
+        (int)GC_get_gc_no());
+    printf("gc heap: %llu KB, %llu KB free, %llu KB allocated in total\n",
+        (unsigned long long)GC_get_heap_size()/1024,
+        (unsigned long long)GC_get_free_bytes()/1024,
+        (unsigned long long)GC_get_total_bytes()/1024);
+}
+
+#ifdef COUNT_DISPATCHES
+/* per opcode dispatch counts, summed over all threads */
+static void dumpDispatches(State& state)
+{
+    std::vector< std::pair<uint64_t, int> > counts;
+    uint64_t total = 0;
+    for(int i = 0; i <= ByteCode::done; i++) {
+        uint64_t c = 0;
+        for(size_t t = 0; t < state.threads.size(); t++)
+            c += state.threads[t]->dispatches[i];
+        if(c > 0)
+            counts.push_back(std::make_pair(c, i));
+        total += c;
+    }
+    std::sort(counts.rbegin(), counts.rend());
+    fprintf(stderr, "%-12s %14s %8s\n", "opcode", "dispatches", "share");
+    for(size_t i = 0; i < counts.size(); i++) {
+        fprintf(stderr, "%-12s %14llu %7.2f%%\n", 
+            ByteCode::toString((ByteCode::Enum)counts[i].second),
+            (unsigned long long)counts[i].first,
+            100.0 * counts[i].first / total);
+    }
+    fprintf(stderr, "%-12s %14llu\n", "total", (unsigned long long)total);
+}
+#endif
+
 static void usage()
 {
     l_message(0,"usage: riposte [options]... [script [args]...]");
@@ -179,6 +218,9 @@ static void usage()
     l_message(0,"    -f, --file         execute R script");
     l_message(0,"    -v, --verbose      enable verbose output");
     l_message(0,"    -j N               launch Riposte with N threads");
+    l_message(0,"    --pin              pin threads to cores");
+    l_message(0,"    --sse              compile traces for SSE only, not AVX");
+    l_message(0,"    --gc MODE          garbage collection: on (default), incremental or off");
 }
 
 extern int opterr;
@@ -195,6 +237,9 @@ int main(int argc, char** argv)
         { "quiet",     0,     NULL,           'q' },
         { "script",    0,     NULL,           's'  },
         { "args",      0,     NULL,           'a'  },
+        { "pin",       0,     NULL,           'p'  },
+        { "sse",       0,     NULL,           'S'  },
+        { "gc",        1,     NULL,           'g'  },
         { NULL,        0,     NULL,            0 }
     };
 
@@ -202,6 +247,9 @@ int main(int argc, char** argv)
     char * filename = NULL;
     bool echo = true;
     int threads = 1; 
+    bool pin = false;
+    bool sse = false;
+    State::Collector collector = State::STOP_THE_WORLD;
 
     int ch;
     opterr = 0;
@@ -229,6 +277,24 @@ int main(int argc, char** argv)
                     threads = atoi(optarg);
                 }
                 break;
+            case 'p':
+                pin = true;
+                break;
+            case 'S':
+                sse = true;
+                break;
+            case 'g':
+                if(0 == strcmp("on",optarg))
+                    collector = State::STOP_THE_WORLD;
+                else if(0 == strcmp("incremental",optarg))
+                    collector = State::INCREMENTAL;
+                else if(0 == strcmp("off",optarg))
+                    collector = State::NO_GC;
+                else {
+                    usage();
+                    exit(-1);
+                }
+                break;
             case 'h':
             default:
                 usage();
@@ -239,13 +305,23 @@ int main(int argc, char** argv)
 
     d_message(1,NULL,"Command option processing complete");
 
-    /* Start garbage collector */
+    /* Start garbage collector, marking with as many threads as we run on */
+    if(threads > 1) {
+        char markers[16];
+        snprintf(markers, sizeof(markers), "%d", threads);
+        setenv("GC_MARKERS", markers, 0);
+    }
     GC_INIT();
-    GC_disable();
+    if(collector == State::NO_GC)
+        GC_disable();
+    else if(collector == State::INCREMENTAL)
+        GC_enable_incremental();
 
     /* Initialize execution state */
-    State state(threads, argc, argv);
+    State state(threads, argc, argv, pin);
+    state.collector = collector;
     state.verbose = verbose;
+    state.sseOnly = sse;
     Thread& thread = state.getMainThread();
 
     /* Load built in & base functions */
@@ -274,6 +350,13 @@ int main(int argc, char** argv)
 
     /* Session over */
 
+#ifdef COUNT_DISPATCHES
+    dumpDispatches(state);
+#endif
+
+    if(verbose)
+        dumpHeap(state);
+
     fflush(stdout);
     fflush(stderr);
 
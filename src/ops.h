@@ -206,6 +206,8 @@ template<> struct pmaxBase<Character> { static Character::Element base() { retur
 #define FOLD_OP(Name, String, Group, Func) \
 template<typename T> \
 struct Name##VOp : public Func##VOp<typename Func##VOp<T, T>::R, T> {\
+	/* joins two partial results, see ScanLeft */ \
+	typedef Func##VOp<typename Name##VOp::R, typename Name##VOp::R> Combine; \
 	static typename Name##VOp::A::Element base() { return Func##Base<T>::base(); } \
 	static void Scalar(Thread& thread, typename Name##VOp::B::Element const b, Value& c) { \
 		Name##VOp::R::InitScalar(c, b); \
@@ -768,7 +768,7 @@ _eof_trans:
 	break;
 	case 55:
 #line 123 "lexer.rl"
-	{te = p+1;{token(TOKEN_SPECIALOP, CreateSymbol(state.internStr(std::string(ts, te-ts))) ); }}
+	{te = p+1;{token(TOKEN_SPECIALOP, CreateSymbol(state.internStr(ts, te-ts)) ); }}
 	break;
 	case 56:
 #line 126 "lexer.rl"
@@ -784,7 +784,7 @@ _eof_trans:
 	break;
 	case 59:
 #line 60 "lexer.rl"
-	{te = p;p--;{token( TOKEN_SYMBOL, CreateSymbol(state.internStr(std::string(ts, te-ts))) );}}
+	{te = p;p--;{token( TOKEN_SYMBOL, CreateSymbol(state.internStr(ts, te-ts)) );}}
 	break;
 	case 60:
 #line 65 "lexer.rl"
@@ -924,10 +924,10 @@ _eof_trans:
 	{{p = ((te))-1;}token( TOKEN_BREAK, CreateSymbol(Strings::breakSym) );}
 	break;
 	case 21:
-	{{p = ((te))-1;}token( TOKEN_SYMBOL, CreateSymbol(state.internStr(std::string(ts, te-ts))));}
+	{{p = ((te))-1;}token( TOKEN_SYMBOL, CreateSymbol(state.internStr(ts, te-ts)));}
 	break;
 	case 22:
-	{{p = ((te))-1;}token( TOKEN_SYMBOL, CreateSymbol(state.internStr(std::string(ts, te-ts))) );}
+	{{p = ((te))-1;}token( TOKEN_SYMBOL, CreateSymbol(state.internStr(ts, te-ts)) );}
 	break;
 	case 68:
 	{{p = ((te))-1;}token( TOKEN_NEWLINE );}
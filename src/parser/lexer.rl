@@ -54,10 +54,10 @@
 
 	# CreateSymbols.
 	( '..' digit+ )
-		{token( TOKEN_SYMBOL, CreateSymbol(state.internStr(std::string(ts, te-ts))));};
+		{token( TOKEN_SYMBOL, CreateSymbol(state.internStr(ts, te-ts)));};
 
 	( ('.' ([a-zA-Z_.] [a-zA-Z0-9_.]*)?) | [a-zA-Z] [a-zA-Z0-9_.]* ) 
-		{token( TOKEN_SYMBOL, CreateSymbol(state.internStr(std::string(ts, te-ts))) );};
+		{token( TOKEN_SYMBOL, CreateSymbol(state.internStr(ts, te-ts)) );};
 	( '`' ( [^`\\\n] | /\\./ )* '`' ) 
 		{std::string s(ts+1, te-ts-2); token( TOKEN_SYMBOL, CreateSymbol(state.internStr(unescape(s))) );};
 	# Numeric literals.
@@ -120,7 +120,7 @@
 	'?' {token( TOKEN_QUESTION, CreateSymbol(Strings::question) );};
 	
 	# Special Operators.
-	('%' [^\n%]* '%') {token(TOKEN_SPECIALOP, CreateSymbol(state.internStr(std::string(ts, te-ts))) ); };
+	('%' [^\n%]* '%') {token(TOKEN_SPECIALOP, CreateSymbol(state.internStr(ts, te-ts)) ); };
 
 	# Separators.
 	',' {token( TOKEN_COMMA );};
@@ -73,6 +73,29 @@ void Resize(Thread& thread, bool clone, Value& src, int64_t newLength) {
 	};
 }
 
+template<class D>
+void Grow(Thread& thread, D& v, int64_t& capacity, int64_t length) {
+	if(length > capacity) {
+		capacity = std::max(length, 2*capacity);
+		D r(capacity);
+		Insert(thread, v, 0, r, 0, v.length);
+		r.length = v.length;
+		v = r;
+	}
+	typename D::Element* e = v.v();
+	for(int64_t i = v.length; i < length; i++) e[i] = D::NAelement;
+	v.length = length;
+}
+
+void Grow(Thread& thread, Value& v, int64_t& capacity, int64_t length) {
+	switch(v.type) {
+		#define CASE(Name) case Type::Name: { Grow(thread, (Name&)v, capacity, length); } break;
+		VECTOR_TYPES_NOT_NULL(CASE)
+		#undef CASE
+		default: _error("NYI: Grow this type"); break;
+	};
+}
+
 template< class A >
 struct SubsetInclude {
 	static void eval(Thread& thread, A const& a, Integer const& d, int64_t nonzero, Value& out)
@@ -84,7 +107,7 @@ struct SubsetInclude {
 		typename A::Element* re = r.v();
 		int64_t length = d.length;
 		for(int64_t i = 0; i < length; i++) {
-			if(Integer::isNA(de[i])) re[j++] = A::NAelement;	
+			if(Integer::isNA(de[i]) || de[i] > a.length) re[j++] = A::NAelement;	
 			else if(de[i] != 0) re[j++] = ae[de[i]-1];
 		}
 		out = r;
@@ -49,10 +49,10 @@ inline void Element2(Value const& v, int64_t index, Value& out) {
 void SubsetSlow(Thread& thread, Value const& a, Value const& i, Value& out); 
 
 inline void Subset(Thread& thread, Value const& a, Value const& i, Value& out) {
-	if(i.isDouble1() && i.d >= 1) {
+	if(i.isDouble1() && i.d >= 1 && i.d < a.length+1) {
 		Element(a, (int64_t)i.d-1, out);
 	}
-	else if(i.isInteger1() && i.i >= 1) {
+	else if(i.isInteger1() && i.i >= 1 && i.i <= a.length) {
 		Element(a, i.i-1, out);
 	}
 	else {
@@ -95,8 +95,8 @@ inline void ElementAssign(Value const& v, int64_t index, Value& out) {
 
 void Element2Assign(Value const& v, int64_t index, Value& out) ALWAYS_INLINE;
 inline void Element2Assign(Value const& v, int64_t index, Value& out) {
-	if(index < 0 || index > v.length) _error("Out-of-range index");
-	switch(v.type) {
+	if(index < 0 || index >= out.length) _error("Out-of-range index");
+	switch(out.type) {
 		#define CASE(Name) case Type::Name: ((Name&)out)[index] = ((Name const&)v)[0]; break;
 		ATOMIC_VECTOR_TYPES(CASE)
 		#undef CASE
@@ -159,6 +159,11 @@ void Insert(Thread& thread, Value const& src, int64_t srcIndex, Value& dst, int6
 
 void Resize(Thread& thread, bool clone, Value& src, int64_t newLength);
 
+// Lengthens an unshared vector of length > 1 in place, padding with NAs,
+// while it fits in capacity elements; past that it's moved to one with
+// twice the room.
+void Grow(Thread& thread, Value& v, int64_t& capacity, int64_t length);
+
 template<class T>
 inline T Subset(T const& src, int64_t start, int64_t length) {
 	if(length > 0 && start+length > src.length)
@@ -242,3 +242,48 @@ struct Map2VS< DivOp<TDouble>, N, true > {
 };
 
 #endif
+
+// Transcendental kernels from vmath.h, within 2 ulp of libm (see vmath.h)
+#ifndef USE_AMD_LIBM
+#include "vmath.h"
+
+#define VMATH_MAP1(Name, Func) \
+template<int64_t N> \
+struct Map1< Name##VOp<Double>, N, true > { \
+	static void eval(Thread& thread, double const* a, double* r) { \
+		for(int64_t j = 0; j < N; j+=2) \
+			_mm_storeu_pd(r+j, Func(_mm_loadu_pd(a+j))); \
+	} \
+};
+VMATH_MAP1(exp, vexp)
+VMATH_MAP1(log, vlog)
+VMATH_MAP1(sin, vsin)
+VMATH_MAP1(cos, vcos)
+#undef VMATH_MAP1
+
+template<int64_t N>
+struct Map2VV< powVOp<Double,Double>, N, true > {
+	static void eval(Thread& thread, double const* a, double const* b, double* r) {
+		for(int64_t j = 0; j < N; j+=2)
+			_mm_storeu_pd(r+j, vpow(_mm_loadu_pd(a+j), _mm_loadu_pd(b+j)));
+	}
+};
+
+template<int64_t N>
+struct Map2SV< powVOp<Double,Double>, N, true > {
+	static void eval(Thread& thread, double const a, double const* b, double* r) {
+		const __m128d xa = _mm_set1_pd(a);
+		for(int64_t j = 0; j < N; j+=2)
+			_mm_storeu_pd(r+j, vpow(xa, _mm_loadu_pd(b+j)));
+	}
+};
+
+template<int64_t N>
+struct Map2VS< powVOp<Double,Double>, N, true > {
+	static void eval(Thread& thread, double const* a, double const b, double* r) {
+		const __m128d xb = _mm_set1_pd(b);
+		for(int64_t j = 0; j < N; j+=2)
+			_mm_storeu_pd(r+j, vpow(_mm_loadu_pd(a+j), xb));
+	}
+};
+#endif
@@ -4,6 +4,15 @@
 
 #include <pthread.h>
 #include <time.h>
+#include <limits.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
 
 static inline int fetch_and_add(int64_t * variable, int64_t value) {
 	asm volatile( 
@@ -21,6 +30,104 @@ static inline int atomic_xchg(int64_t* v, int64_t n) {
 	return n;
 }
 
+static inline void sleep() {
+	struct timespec sleepTime;
+	struct timespec returnTime;
+	sleepTime.tv_sec = 0;
+	sleepTime.tv_nsec = 500000;
+	nanosleep(&sleepTime, &returnTime);
+}
+
+static inline void cpu_relax() {
+	asm volatile("pause" ::: "memory");
+}
+
+// Eventcount for parking idle threads without losing wakeups.
+// A waiter calls prepareWait, re-checks its condition, then calls either
+// cancelWait (condition now true) or wait. A notifier makes the condition
+// true first and then calls notify.
+// On Linux this blocks in a futex; elsewhere it falls back to sleep().
+class EventCount {
+	volatile int32_t epoch;
+	volatile int32_t waiters;
+
+	static void block(volatile int32_t* addr, int32_t val) {
+#ifdef __linux__
+		syscall(SYS_futex, (int32_t*)addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+#else
+		sleep();
+#endif
+	}
+
+	static void wake(volatile int32_t* addr, int32_t n) {
+#ifdef __linux__
+		syscall(SYS_futex, (int32_t*)addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+#endif
+	}
+
+public:
+	EventCount() : epoch(0), waiters(0) {}
+
+	int32_t prepareWait() {
+		__sync_fetch_and_add(&waiters, 1);
+		return epoch;
+	}
+
+	void cancelWait() {
+		__sync_fetch_and_sub(&waiters, 1);
+	}
+
+	void wait(int32_t key) {
+		while(epoch == key)
+			block(&epoch, key);
+		__sync_fetch_and_sub(&waiters, 1);
+	}
+
+	// wake up to n waiters (more may see the new epoch and return early)
+	void notify(int32_t n) {
+		__sync_synchronize();
+		if(waiters > 0) {
+			__sync_fetch_and_add(&epoch, 1);
+			wake(&epoch, n);
+		}
+	}
+
+	void notifyAll() {
+		notify(INT_MAX);
+	}
+};
+
+// Processor topology for pinning workers. Only implemented on Linux,
+// elsewhere every cpu reports socket 0 and pinning is a no-op.
+static inline int64_t cpuCount() {
+	int64_t n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? n : 1;
+}
+
+static inline int64_t cpuSocket(int64_t cpu) {
+	int64_t socket = 0;
+#ifdef __linux__
+	char path[128];
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", (int)cpu);
+	FILE* f = fopen(path, "r");
+	if(f != NULL) {
+		int s;
+		if(fscanf(f, "%d", &s) == 1 && s >= 0) socket = s;
+		fclose(f);
+	}
+#endif
+	return socket;
+}
+
+static inline void pinToCpu(int64_t cpu) {
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
 class Lock
 {
     pthread_mutex_t m;
@@ -42,12 +149,89 @@ public:
     }
 };
 
-static inline void sleep() {
-	struct timespec sleepTime;
-	struct timespec returnTime;
-	sleepTime.tv_sec = 0;
-	sleepTime.tv_nsec = 500000;
-	nanosleep(&sleepTime, &returnTime);
-}
+// Chase-Lev work-stealing deque (Chase & Lev, SPAA 2005).
+// The owning thread pushes and pops at the bottom without locking,
+// other threads steal from the top with a single CAS.
+// Outgrown buffers are never freed explicitly since a thief may still
+// be reading from one; the GC reclaims them.
+template<class T>
+class WorkDeque {
+	struct Buffer : public gc {
+		int64_t mask;
+		T* data;
+		explicit Buffer(int64_t size) : mask(size-1) {
+			data = new (GC) T[size];
+		}
+		T const& get(int64_t i) const { return data[i & mask]; }
+		void put(int64_t i, T const& t) { data[i & mask] = t; }
+	};
+
+	volatile int64_t top;
+	volatile int64_t bottom;
+	Buffer* volatile buffer;
+
+	Buffer* grow(Buffer* a, int64_t b, int64_t t) {
+		Buffer* n = new (GC) Buffer(2*(a->mask+1));
+		for(int64_t i = t; i < b; i++)
+			n->put(i, a->get(i));
+		return n;
+	}
+
+public:
+	explicit WorkDeque(int64_t size = 64) : top(0), bottom(0) {
+		buffer = new (GC) Buffer(nextPow2(size));
+	}
+
+	// owner only
+	void push(T const& x) {
+		int64_t b = bottom;
+		int64_t t = top;
+		Buffer* a = buffer;
+		if(b - t >= a->mask) {
+			a = grow(a, b, t);
+			buffer = a;
+		}
+		a->put(b, x);
+		__sync_synchronize();
+		bottom = b+1;
+	}
+
+	// owner only
+	bool pop(T& out) {
+		int64_t b = bottom - 1;
+		Buffer* a = buffer;
+		bottom = b;
+		__sync_synchronize();
+		int64_t t = top;
+		if(b < t) {
+			bottom = t;
+			return false;
+		}
+		out = a->get(b);
+		if(b > t)
+			return true;
+		// last element, race any thieves for it
+		bool won = __sync_bool_compare_and_swap(&top, t, t+1);
+		bottom = t+1;
+		return won;
+	}
+
+	// any thread
+	bool steal(T& out) {
+		int64_t t = top;
+		__sync_synchronize();
+		int64_t b = bottom;
+		if(t >= b)
+			return false;
+		Buffer* a = buffer;
+		out = a->get(t);
+		return __sync_bool_compare_and_swap(&top, t, t+1);
+	}
+
+	bool empty() const {
+		return bottom <= top;
+	}
+};
+
 
 #endif
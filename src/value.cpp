@@ -19,3 +19,5 @@ const String Character::NAelement = Strings::NA;
 
 const Value List::NAelement = Value::Nil();
 
+
+volatile uint64_t Dictionary::version = 0;
@@ -5,6 +5,7 @@
 #include <vector>
 #include <assert.h>
 #include <limits>
+#include <sys/mman.h>
 
 #include "common.h"
 #include "type.h"
@@ -101,6 +102,55 @@ struct Pair : public gc { String n; Value v; };
 // Not the same as the publically visible PairList which is just an S3 class
 typedef std::vector<Pair, traceable_allocator<Pair> > PairList;
 
+// Arrays of Values and Pairs are given exact layouts so the collector
+// only looks at each Value's header and p. Names are interned outside the
+// collected heap. Function, Promise and Default headers carry their
+// Prototype, so headers are scanned too; those of other types (type and
+// length) and packed scalars in p are treated conservatively.
+inline GC_descr ExactDescriptor(size_t words, size_t header, size_t pointer) {
+	GC_word bitmap[GC_BITMAP_SIZE(Pair)] = {0};
+	GC_set_bit(bitmap, header);
+	GC_set_bit(bitmap, pointer);
+	return GC_make_descriptor(bitmap, words);
+}
+
+inline Value* AllocateValues(size_t n) {
+	static GC_descr const d = ExactDescriptor(GC_WORD_LEN(Value), 
+		GC_WORD_OFFSET(Value, header), GC_WORD_OFFSET(Value, p));
+	return (Value*)GC_calloc_explicitly_typed(n, sizeof(Value), d);
+}
+
+inline Pair* AllocatePairs(size_t n) {
+	static GC_descr const d = ExactDescriptor(GC_WORD_LEN(Pair), 
+		(offsetof(Pair, v) + offsetof(Value, header))/sizeof(GC_word),
+		(offsetof(Pair, v) + offsetof(Value, p))/sizeof(GC_word));
+	return (Pair*)GC_calloc_explicitly_typed(n, sizeof(Pair), d);
+}
+
+// Atomic vectors of at least ALIGNED_VECTOR_BYTES start on a
+// VECTOR_ALIGNMENT boundary and are padded to a multiple of it, so code
+// working on them in 64 byte (AVX-512 or non-temporal) chunks needs no
+// unaligned head or partial tail. Smaller ones of 128 or more elements
+// are only 16 byte aligned, which is all SSE needs.
+#define ALIGNED_VECTOR_BYTES (1 << 14)
+#define VECTOR_ALIGNMENT 64
+// vectors spanning whole huge pages ask for them, to save TLB misses
+#define HUGE_PAGE_BYTES (2 << 20)
+
+inline void* AllocateAligned(size_t bytes) {
+	bytes = (bytes + VECTOR_ALIGNMENT-1) & ~(size_t)(VECTOR_ALIGNMENT-1);
+	// the collector keeps the block alive through the interior pointer
+	uintptr_t p = (uintptr_t)GC_malloc_atomic(bytes + VECTOR_ALIGNMENT);
+	p = (p + VECTOR_ALIGNMENT-1) & ~(uintptr_t)(VECTOR_ALIGNMENT-1);
+#ifdef MADV_HUGEPAGE
+	uintptr_t start = (p + HUGE_PAGE_BYTES-1) & ~(uintptr_t)(HUGE_PAGE_BYTES-1);
+	uintptr_t end = (p + bytes) & ~(uintptr_t)(HUGE_PAGE_BYTES-1);
+	if(start < end)
+		madvise((void*)start, end-start, MADV_HUGEPAGE);
+#endif
+	return (void*)p;
+}
+
 //
 // Value type implementations
 //
@@ -142,9 +192,13 @@ struct Vector : public Value {
 			int64_t length_aligned = (l < 128) ? (l + 1) : l;
 			//v.p = Recursive ? new (GC, sizeof(Element)*length_aligned) Inner() :
 			//	new (PointerFreeGC, sizeof(Element)*length_aligned) Inner();
-			v. p = Recursive ?
-					GC_malloc(sizeof(Element)*length_aligned) :
-					GC_malloc_atomic(sizeof(Element)*length_aligned);
+			// recursive vectors hold Values
+			if(Recursive)
+				v.p = (void*)AllocateValues(length_aligned);
+			else if(sizeof(Element)*length_aligned >= ALIGNED_VECTOR_BYTES)
+				v.p = AllocateAligned(sizeof(Element)*length_aligned);
+			else
+				v.p = GC_malloc_atomic(sizeof(Element)*length_aligned);
 			assert(l < 128 || (0xF & (int64_t)v.p) == 0);
 			if( (0xF & (int64_t)v.p) != 0)
 				v.p =  (char*)v.p + 0x8;
@@ -158,7 +212,7 @@ struct Vector : public Value {
 			v.scalar<ElementType>() = d;
 		else {
 			v.p = Recursive ?
-					GC_malloc(sizeof(Element)*4) :
+					(void*)AllocateValues(4) :
 					GC_malloc_atomic(sizeof(Element)*4);
 			*(Element*)v.p = d;
 		}
@@ -300,6 +354,7 @@ protected:
 	uint64_t size, load;
 	Pair* d;
 	Pair inlineDict[inlineSize];
+	mutable bool cached;	// a SymbolCache depends on this dictionary's layout
 
 	uint64_t hash(String s) const ALWAYS_INLINE { return (uint64_t)s>>3; }
 
@@ -340,6 +395,15 @@ protected:
 		return &d[i];
 	}
 
+	// Adding or removing a name may change the result of a cached lookup
+	// walking through this dictionary, or move its slot.
+	void invalidate() {
+		if(__builtin_expect(cached, false)) {
+			cached = false;
+			__sync_fetch_and_add(&version, 1);
+		}
+	}
+
 	void rehash(uint64_t s) {
 		uint64_t old_size = size;
 		uint64_t old_load = load;
@@ -349,7 +413,7 @@ protected:
 		if(s <= size) return; // should rehash on shrinking sometimes, when?
 
 		size = s;
-		d = new (GC) Pair[s];
+		d = AllocatePairs(s);
 		clear();
 		
 		// copy over previous populated values...
@@ -364,7 +428,11 @@ protected:
 	}
 
 public:
-	Dictionary() : size(inlineSize), d(inlineDict) {
+	// Bumped whenever a dictionary that a SymbolCache depends on changes
+	// shape.
+	static volatile uint64_t version;
+
+	Dictionary() : size(inlineSize), d(inlineDict), cached(false) {
 		clear();
 	}
 
@@ -383,6 +451,7 @@ public:
 		bool success;
 		Pair* p = find(name, success);
 		if(!success) {
+			invalidate();
 			if(((load+1) * 2) > size)
 				rehash((size*2));
 			load++;
@@ -396,12 +465,14 @@ public:
 		bool success;
 		Pair* p = find(name, success);
 		if(success) {
+			invalidate();
 			load--;
 			memset(p, 0, sizeof(Pair));
 		}
 	}
 
 	void clear() {
+		invalidate();
 		load = 0;
 		memset(d, 0, sizeof(Pair)*size); 
 	}
@@ -507,6 +578,21 @@ public:
 	}
 };
 
+// Inline cache for a variable lookup that missed the local environment.
+// Remembers where the walk up the lexical chain started and the slot it
+// found. The entry is valid while its version equals Dictionary::version.
+// Instructions are shared between threads, so an entry is never changed
+// once published: a miss builds a new one and swaps the pointer, and a
+// reader sees either the old entry or the new one, never a mix.
+struct SymbolCache {
+	struct Entry : public gc {
+		Environment const* start;
+		Pair const* slot;
+		uint64_t version;
+	};
+	Entry const* volatile entry;
+};
+
 class Environment : public Dictionary {
 private:
 	Environment* lexical, *dynamic;
@@ -549,6 +635,40 @@ public:
 		return insertRecursive(name);
 	}
 
+	Value const& getLocal(String name, bool& success) const ALWAYS_INLINE {
+		return find(name, success)->v;
+	}
+
+	// getRecursive for a variable that isn't local, with the walk up the
+	// lexical chain going through cache. The local probe is never cached
+	// since locals change on every call.
+	Value const& getEnclosing(String name, SymbolCache& cache) const {
+		SymbolCache::Entry const* e = cache.entry;
+		if(e != 0 && e->version == version && e->start == lexical)
+			return e->slot->v;
+
+		uint64_t v = version;
+		bool success;
+		Environment const* env = lexical;
+		env->cached = true;
+		Pair* p = env->find(name, success);
+		while(!success && env->LexicalScope()) {
+			env = env->LexicalScope();
+			env->cached = true;
+			p = env->find(name, success);
+		}
+		if(success) {
+			SymbolCache::Entry* n = new (GC) SymbolCache::Entry();
+			n->start = lexical;
+			n->slot = p;
+			n->version = v;
+			// the entry's fields have to be visible before the pointer to it
+			__sync_synchronize();
+			cache.entry = n;
+		}
+		return p->v;
+	}
+
 	struct Pointer {
 		Environment* env;
 		String name;
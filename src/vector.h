@@ -3,6 +3,7 @@
 #define _RIPOSTE_VECTOR_H
 
 #include "value.h"
+#include "interpreter.h"
 
 template< class Op, int64_t N, bool Multiple = (((N)%(4)) == 0) >
 struct Map1 {
@@ -176,17 +177,72 @@ struct FoldLeft {
 	}
 };
 
+// Scans longer than a block run in parallel when there are threads to run
+// them: each block is scanned on its own, then the blocks' totals are
+// scanned and every block after the first combined with the total before it.
+#define SCAN_BLOCK 16384
+
 template< class Op >
 struct ScanLeft {
+	typedef typename Op::R::Element RE;
+	typedef typename Op::B::Element BE;
+
+	struct Blocks {
+		BE const* b;
+		RE* r;
+		int64_t length;
+		std::vector<RE> totals;	// inclusive, up to the end of each block
+	};
+
+	static void scan(Thread& thread, BE const* b, RE* r, int64_t length) {
+		RE a = Op::base();
+		for(int64_t i = 0; i < length; ++i) {
+			r[i] = a = Op::eval(thread, a, b[i]);
+		}
+	}
+
+	static void scanbody(void* args, void* h, uint64_t start, uint64_t end, Thread& thread) {
+		Blocks& s = *(Blocks*)args;
+		for(uint64_t k = start; k < end; k++) {
+			int64_t i = k*SCAN_BLOCK;
+			scan(thread, s.b+i, s.r+i, std::min((int64_t)SCAN_BLOCK, s.length-i));
+		}
+	}
+
+	static void offsetbody(void* args, void* h, uint64_t start, uint64_t end, Thread& thread) {
+		Blocks& s = *(Blocks*)args;
+		for(uint64_t k = start; k < end; k++) {
+			RE p = s.totals[k-1];
+			RE* r = s.r;
+			int64_t e = std::min((int64_t)(k+1)*SCAN_BLOCK, s.length);
+			for(int64_t i = k*SCAN_BLOCK; i < e; ++i)
+				r[i] = Op::Combine::eval(thread, p, r[i]);
+		}
+	}
+
 	static void eval(Thread& thread, typename Op::B const& b, Value& out)
 	{
-		typename Op::B::Element const* be = b.v();
-		typename Op::R::Element a = Op::base();
 		typename Op::R r(b.length);
-		typename Op::R::Element* re = r.v();
 		int64_t length = b.length;
-		for(int64_t i = 0; i < length; ++i) {
-			re[i] = a = Op::eval(thread, a, be[i]);
+		if(length <= SCAN_BLOCK || thread.state.nThreads == 1) {
+			scan(thread, b.v(), r.v(), length);
+		} else {
+			// one pair per instantiation, i.e. per scan op and element type
+			static Grain scanGrain(1), offsetGrain(1);
+			Blocks s;
+			s.b = b.v();
+			s.r = r.v();
+			s.length = length;
+			uint64_t blocks = (length+SCAN_BLOCK-1)/SCAN_BLOCK;
+			thread.doall(NULL, scanbody, &s, 0, blocks, 1, 1, &scanGrain);
+
+			s.totals.resize(blocks);
+			RE p = s.totals[0] = s.r[SCAN_BLOCK-1];
+			for(uint64_t k = 1; k < blocks; k++) {
+				int64_t e = std::min((int64_t)(k+1)*SCAN_BLOCK, length);
+				s.totals[k] = p = Op::Combine::eval(thread, p, s.r[e-1]);
+			}
+			thread.doall(NULL, offsetbody, &s, 1, blocks, 1, 1, &offsetGrain);
 		}
 		out = (Value&)r;
 	}
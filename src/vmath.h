@@ -0,0 +1,291 @@
+#ifndef _RIPOSTE_VMATH_H
+#define _RIPOSTE_VMATH_H
+
+// SIMD math kernels, two doubles at a time, for the trace JIT's helpers and
+// the interpreter's Map specializations (see sse.h).
+//
+// Error bounds, measured against glibc:
+//	vexp	<= 1 ulp
+//	vlog	<= 1 ulp
+//	vsin	<= 1 ulp for |x| <= VMATH_TRIG_MAX, libm beyond
+//	vcos	<= 1 ulp for |x| <= VMATH_TRIG_MAX, libm beyond
+//	vpow	<= 2 ulp for finite x > 0 and finite y, libm otherwise
+// The unary kernels return NaN inputs (and so NA) unchanged; overflow and
+// underflow give inf and 0 as libm does.
+
+#include <math.h>
+#include <stdint.h>
+#include <smmintrin.h>
+
+// largest argument the trig functions reduce themselves
+#define VMATH_TRIG_MAX 1e5
+
+static inline __m128d vmath_const(uint64_t bits) {
+	return _mm_castsi128_pd(_mm_set1_epi64x(bits));
+}
+
+// integral double (|n| < 2^51) to int64 lanes, by way of 2^52+2^51
+static inline __m128i vmath_toint(__m128d n) {
+	const __m128d magic = _mm_set1_pd(6755399441055744.0);
+	return _mm_sub_epi64(_mm_castpd_si128(_mm_add_pd(n, magic)), _mm_castpd_si128(magic));
+}
+
+// 2^n for integral n in [-1022, 1023]
+static inline __m128d vmath_pow2(__m128i n) {
+	return _mm_castsi128_pd(_mm_slli_epi64(_mm_add_epi64(n, _mm_set1_epi64x(1023)), 52));
+}
+
+static inline __m128d vmath_select(__m128d mask, __m128d a, __m128d b) {
+	return _mm_blendv_pd(b, a, mask);
+}
+
+// a*b = hi + lo exactly (Dekker's product)
+static inline void vmath_mul12(__m128d a, __m128d b, __m128d& hi, __m128d& lo) {
+	const __m128d split = _mm_set1_pd(134217729.0);
+	__m128d ca = _mm_mul_pd(split, a);
+	__m128d ah = _mm_sub_pd(ca, _mm_sub_pd(ca, a));
+	__m128d al = _mm_sub_pd(a, ah);
+	__m128d cb = _mm_mul_pd(split, b);
+	__m128d bh = _mm_sub_pd(cb, _mm_sub_pd(cb, b));
+	__m128d bl = _mm_sub_pd(b, bh);
+	hi = _mm_mul_pd(a, b);
+	lo = _mm_add_pd(_mm_add_pd(_mm_add_pd(_mm_sub_pd(_mm_mul_pd(ah, bh), hi),
+		_mm_mul_pd(ah, bl)), _mm_mul_pd(al, bh)), _mm_mul_pd(al, bl));
+}
+
+// e^(x+xlo), |xlo| small next to x
+static inline __m128d vmath_expk(__m128d x, __m128d xlo) {
+	const __m128d ln2hi = _mm_set1_pd(6.93147180369123816490e-01);
+	const __m128d ln2lo = _mm_set1_pd(1.90821492927058770002e-10);
+
+	// lanes past these over- or underflow anyway, zero them so the
+	// scaling below never produces subnormals (slow on most cores)
+	__m128d over = _mm_cmpgt_pd(x, _mm_set1_pd(710.0));
+	__m128d under = _mm_cmplt_pd(x, _mm_set1_pd(-746.0));
+	x = _mm_andnot_pd(_mm_or_pd(over, under), x);
+	xlo = _mm_andnot_pd(_mm_or_pd(over, under), xlo);
+
+	// x = n*ln2 + r, |r| <= ln2/2
+	const __m128d magic = _mm_set1_pd(6755399441055744.0);
+	__m128d t = _mm_add_pd(_mm_mul_pd(x, _mm_set1_pd(1.44269504088896338700)), magic);
+	__m128d n = _mm_sub_pd(t, magic);
+	__m128d r = _mm_sub_pd(x, _mm_mul_pd(n, ln2hi));
+	r = _mm_add_pd(_mm_sub_pd(r, _mm_mul_pd(n, ln2lo)), xlo);
+
+	// e^r - 1 - r by Taylor series, the terms past 1/13! are below 2^-60;
+	// Estrin's scheme keeps the dependency chain short
+	__m128d r2 = _mm_mul_pd(r, r);
+	__m128d r4 = _mm_mul_pd(r2, r2);
+	__m128d a0 = _mm_add_pd(_mm_mul_pd(_mm_set1_pd(1.0/6.0), r), _mm_set1_pd(0.5));
+	__m128d a1 = _mm_add_pd(_mm_mul_pd(_mm_set1_pd(1.0/120.0), r), _mm_set1_pd(1.0/24.0));
+	__m128d a2 = _mm_add_pd(_mm_mul_pd(_mm_set1_pd(1.0/5040.0), r), _mm_set1_pd(1.0/720.0));
+	__m128d a3 = _mm_add_pd(_mm_mul_pd(_mm_set1_pd(1.0/362880.0), r), _mm_set1_pd(1.0/40320.0));
+	__m128d a4 = _mm_add_pd(_mm_mul_pd(_mm_set1_pd(1.0/39916800.0), r), _mm_set1_pd(1.0/3628800.0));
+	__m128d a5 = _mm_add_pd(_mm_mul_pd(_mm_set1_pd(1.0/6227020800.0), r), _mm_set1_pd(1.0/479001600.0));
+	__m128d b0 = _mm_add_pd(_mm_mul_pd(a1, r2), a0);
+	__m128d b1 = _mm_add_pd(_mm_mul_pd(a3, r2), a2);
+	__m128d b2 = _mm_add_pd(_mm_mul_pd(a5, r2), a4);
+	__m128d p = _mm_add_pd(_mm_mul_pd(_mm_add_pd(_mm_mul_pd(b2, r4), b1), r4), b0);
+	p = _mm_add_pd(_mm_set1_pd(1.0), _mm_add_pd(r, _mm_mul_pd(r2, p)));
+
+	// scale by 2^n in two steps so subnormal results round once
+	// n sits in the low bits of t and vmath_pow2 only keeps the bits that
+	// land in the exponent, so 32 bit arithmetic is enough
+	__m128i n1 = _mm_srai_epi32(_mm_castpd_si128(t), 1);
+	__m128i n2 = _mm_sub_epi32(_mm_castpd_si128(t), n1);
+	p = _mm_mul_pd(_mm_mul_pd(p, vmath_pow2(n1)), vmath_pow2(n2));
+	p = vmath_select(over, _mm_set1_pd(INFINITY), p);
+	return _mm_andnot_pd(under, p);
+}
+
+static inline __m128d vexp(__m128d x) {
+	__m128d r = vmath_expk(x, _mm_setzero_pd());
+	return vmath_select(_mm_cmpunord_pd(x, x), x, r);
+}
+
+// s*R(s*s) with fdlibm's Lg1..Lg7, by Estrin's scheme
+static inline __m128d vmath_logpoly(__m128d s) {
+	__m128d z = _mm_mul_pd(s, s);
+	__m128d z2 = _mm_mul_pd(z, z);
+	__m128d z4 = _mm_mul_pd(z2, z2);
+	__m128d a0 = _mm_add_pd(_mm_mul_pd(_mm_set1_pd(3.999999999940941908e-01), z), _mm_set1_pd(6.666666666666735130e-01));
+	__m128d a1 = _mm_add_pd(_mm_mul_pd(_mm_set1_pd(2.222219843214978396e-01), z), _mm_set1_pd(2.857142874366239149e-01));
+	__m128d a2 = _mm_add_pd(_mm_mul_pd(_mm_set1_pd(1.531383769920937332e-01), z), _mm_set1_pd(1.818357216161805012e-01));
+	__m128d b0 = _mm_add_pd(_mm_mul_pd(a1, z2), a0);
+	__m128d b1 = _mm_add_pd(_mm_mul_pd(_mm_set1_pd(1.479819860511658591e-01), z2), a2);
+	__m128d R = _mm_add_pd(_mm_mul_pd(b1, z4), b0);
+	return _mm_mul_pd(_mm_mul_pd(R, z), s);
+}
+
+// x = 2^k * (1+f), sqrt(2)/2 <= 1+f < sqrt(2), for normal x > 0 (musl's
+// reduction: offsetting the bits lands both k and f without a compare)
+static inline void vmath_logreduce(__m128d x, __m128d& k, __m128d& f) {
+	__m128i bits = _mm_castpd_si128(x);
+	__m128i t = _mm_add_epi64(bits, _mm_set1_epi64x(0x00095F619980C433LL));
+	__m128i e = _mm_srli_epi64(t, 52);
+	k = _mm_sub_pd(_mm_castsi128_pd(_mm_or_si128(e, _mm_set1_epi64x(0x4330000000000000LL))),
+		_mm_set1_pd(4503599627370496.0 + 1023.0));
+	__m128i m = _mm_sub_epi64(bits, _mm_slli_epi64(_mm_sub_epi64(e, _mm_set1_epi64x(1023)), 52));
+	f = _mm_sub_pd(_mm_castsi128_pd(m), _mm_set1_pd(1.0));
+}
+
+// log(x) = hi + lo to about 2^-60 for normal x > 0 (fdlibm's kernel, with
+// the leading 2s term carried in double-double)
+static inline void vmath_logk(__m128d x, __m128d& hi, __m128d& lo) {
+	const __m128d ln2hi = _mm_set1_pd(6.93147180369123816490e-01);
+	const __m128d ln2lo = _mm_set1_pd(1.90821492927058770002e-10);
+	const __m128d two = _mm_set1_pd(2.0);
+	__m128d k, f;
+	vmath_logreduce(x, k, f);
+
+	// log(1+f) = 2s + s*R(s*s), s = f/(2+f)
+	__m128d dhi = _mm_add_pd(two, f);
+	__m128d dlo = _mm_sub_pd(f, _mm_sub_pd(dhi, two));
+	__m128d shi = _mm_div_pd(f, dhi);
+	__m128d phi, plo;
+	vmath_mul12(shi, dhi, phi, plo);
+	__m128d slo = _mm_div_pd(_mm_sub_pd(_mm_sub_pd(_mm_sub_pd(f, phi), plo), _mm_mul_pd(shi, dlo)), dhi);
+
+	__m128d R = vmath_logpoly(shi);
+	// k*ln2hi + 2*shi is the only sum that needs to be exact
+	__m128d a = _mm_mul_pd(k, ln2hi);
+	__m128d b = _mm_add_pd(shi, shi);
+	hi = _mm_add_pd(a, b);
+	__m128d bv = _mm_sub_pd(hi, a);
+	__m128d err = _mm_add_pd(_mm_sub_pd(a, _mm_sub_pd(hi, bv)), _mm_sub_pd(b, bv));
+	lo = _mm_add_pd(_mm_add_pd(err, _mm_mul_pd(k, ln2lo)), _mm_add_pd(_mm_add_pd(slo, slo), R));
+}
+
+// lanes of r where ok is clear get f of the lane instead, or the lane
+// itself when it is NaN (libm would quiet NA's payload)
+static inline double vmath_libm(double x, double (*f)(double)) {
+	return x != x ? x : f(x);
+}
+
+static inline __m128d vmath_fixup(__m128d ok, __m128d x, __m128d r, double (*f)(double)) {
+	int bits = _mm_movemask_pd(ok) ^ 3;
+	if(bits) {
+		double xs[2], rs[2];
+		_mm_storeu_pd(xs, x);
+		_mm_storeu_pd(rs, r);
+		if(bits & 1) rs[0] = vmath_libm(xs[0], f);
+		if(bits & 2) rs[1] = vmath_libm(xs[1], f);
+		r = _mm_loadu_pd(rs);
+	}
+	return r;
+}
+
+static inline __m128d vlog(__m128d x) {
+	const __m128d ln2hi = _mm_set1_pd(6.93147180369123816490e-01);
+	const __m128d ln2lo = _mm_set1_pd(1.90821492927058770002e-10);
+	__m128d k, f;
+	vmath_logreduce(x, k, f);
+
+	// fdlibm: log(1+f) = f - (hfsq - s*(hfsq+R)), hfsq = f*f/2
+	__m128d s = _mm_div_pd(f, _mm_add_pd(_mm_set1_pd(2.0), f));
+	__m128d hfsq = _mm_mul_pd(_mm_mul_pd(_mm_set1_pd(0.5), f), f);
+	__m128d t = _mm_add_pd(_mm_mul_pd(s, hfsq), vmath_logpoly(s));
+	t = _mm_sub_pd(hfsq, _mm_add_pd(t, _mm_mul_pd(k, ln2lo)));
+	__m128d r = _mm_add_pd(_mm_mul_pd(k, ln2hi), _mm_sub_pd(f, t));
+
+	// zero, negatives, subnormals, inf and NaN go to libm
+	__m128d ok = _mm_and_pd(_mm_cmpge_pd(x, _mm_set1_pd(2.2250738585072014e-308)),
+		_mm_cmplt_pd(x, _mm_set1_pd(INFINITY)));
+	return vmath_fixup(ok, x, r, log);
+}
+
+// sin(x) for q even, cos(x) for q odd, negated when q&2; x = q*pi/2 + r
+static inline __m128d vmath_sincosk(__m128d x, __m128d offset) {
+	// pi/2 in 33 bit pieces, q*pio2_1 and q*pio2_2 are exact for q < 2^20
+	const __m128d pio2_1 = _mm_set1_pd(1.57079632673412561417e+00);
+	const __m128d pio2_2 = _mm_set1_pd(6.07710050630396597660e-11);
+	const __m128d pio2_3 = _mm_set1_pd(2.02226624871116645580e-21);
+
+	// r = x - q*pi/2 as r + rlo
+	__m128d q = _mm_round_pd(_mm_mul_pd(x, _mm_set1_pd(6.36619772367581382433e-01)), _MM_FROUND_TO_NEAREST_INT);
+	__m128d t = _mm_sub_pd(x, _mm_mul_pd(q, pio2_1));
+	__m128d w = _mm_mul_pd(q, pio2_2);
+	// t - w exactly (two-sum), small r loses nothing to cancellation
+	__m128d u = _mm_sub_pd(t, w);
+	__m128d bv = _mm_sub_pd(u, t);
+	__m128d e = _mm_sub_pd(_mm_sub_pd(t, _mm_sub_pd(u, bv)), _mm_add_pd(w, bv));
+	e = _mm_sub_pd(e, _mm_mul_pd(q, pio2_3));
+	__m128d r = _mm_add_pd(u, e);
+	__m128d rlo = _mm_sub_pd(e, _mm_sub_pd(r, u));
+	__m128i qi = _mm_add_epi64(vmath_toint(q), _mm_castpd_si128(offset));
+	__m128d z = _mm_mul_pd(r, r);
+	const __m128d half = _mm_set1_pd(0.5);
+
+	// fdlibm's __kernel_sin(r, rlo) and __kernel_cos(r, rlo) on |r| <= pi/4
+	__m128d s = _mm_set1_pd(1.58969099521155010221e-10);
+	s = _mm_add_pd(_mm_mul_pd(s, z), _mm_set1_pd(-2.50507602534068634195e-08));
+	s = _mm_add_pd(_mm_mul_pd(s, z), _mm_set1_pd(2.75573137070700676789e-06));
+	s = _mm_add_pd(_mm_mul_pd(s, z), _mm_set1_pd(-1.98412698298579493134e-04));
+	s = _mm_add_pd(_mm_mul_pd(s, z), _mm_set1_pd(8.33333333332248946124e-03));
+	__m128d v = _mm_mul_pd(z, r);
+	s = _mm_sub_pd(_mm_mul_pd(z, _mm_sub_pd(_mm_mul_pd(half, rlo), _mm_mul_pd(v, s))), rlo);
+	s = _mm_sub_pd(r, _mm_sub_pd(s, _mm_mul_pd(v, _mm_set1_pd(-1.66666666666666324348e-01))));
+
+	__m128d c = _mm_set1_pd(-1.13596475577881948265e-11);
+	c = _mm_add_pd(_mm_mul_pd(c, z), _mm_set1_pd(2.08757232129817482790e-09));
+	c = _mm_add_pd(_mm_mul_pd(c, z), _mm_set1_pd(-2.75573143513906633035e-07));
+	c = _mm_add_pd(_mm_mul_pd(c, z), _mm_set1_pd(2.48015872894767294178e-05));
+	c = _mm_add_pd(_mm_mul_pd(c, z), _mm_set1_pd(-1.38888888888741095749e-03));
+	c = _mm_add_pd(_mm_mul_pd(c, z), _mm_set1_pd(4.16666666666666019037e-02));
+	__m128d hz = _mm_mul_pd(half, z);
+	w = _mm_sub_pd(_mm_set1_pd(1.0), hz);
+	c = _mm_mul_pd(_mm_mul_pd(z, z), c);
+	c = _mm_add_pd(w, _mm_add_pd(_mm_sub_pd(_mm_sub_pd(_mm_set1_pd(1.0), w), hz), _mm_sub_pd(c, _mm_mul_pd(r, rlo))));
+
+	__m128d odd = _mm_castsi128_pd(_mm_cmpeq_epi64(_mm_and_si128(qi, _mm_set1_epi64x(1)), _mm_set1_epi64x(1)));
+	__m128d result = vmath_select(odd, c, s);
+	__m128i sign = _mm_slli_epi64(_mm_and_si128(qi, _mm_set1_epi64x(2)), 62);
+	return _mm_xor_pd(result, _mm_castsi128_pd(sign));
+}
+
+// lanes too big for the kernels, infinities and NaN take the slow path
+static inline __m128d vmath_trig(__m128d x, __m128d r, double (*f)(double)) {
+	__m128d ax = _mm_and_pd(x, vmath_const(0x7FFFFFFFFFFFFFFFULL));
+	return vmath_fixup(_mm_cmple_pd(ax, _mm_set1_pd(VMATH_TRIG_MAX)), x, r, f);
+}
+
+static inline __m128d vsin(__m128d x) {
+	__m128d r = vmath_sincosk(x, _mm_setzero_pd());
+	// keep the sign of zero
+	r = vmath_select(_mm_cmpeq_pd(x, _mm_setzero_pd()), x, r);
+	return vmath_trig(x, r, sin);
+}
+
+static inline __m128d vcos(__m128d x) {
+	return vmath_trig(x, vmath_sincosk(x, _mm_castsi128_pd(_mm_set1_epi64x(1))), cos);
+}
+
+static inline __m128d vpow(__m128d x, __m128d y) {
+	// e^(y*log(x)), with y*log(x) in double-double so large results keep
+	// their low bits
+	__m128d lhi, llo, phi, plo;
+	vmath_logk(x, lhi, llo);
+	vmath_mul12(y, lhi, phi, plo);
+	plo = _mm_add_pd(plo, _mm_mul_pd(y, llo));
+	__m128d zhi = _mm_add_pd(phi, plo);
+	__m128d zlo = _mm_sub_pd(plo, _mm_sub_pd(zhi, phi));
+	__m128d r = vmath_expk(zhi, zlo);
+
+	// x <= 0, subnormal x, infinities and NaN need pow's special cases
+	const __m128d inf = _mm_set1_pd(INFINITY);
+	__m128d ok = _mm_and_pd(_mm_cmpge_pd(x, _mm_set1_pd(2.2250738585072014e-308)), _mm_cmplt_pd(x, inf));
+	ok = _mm_and_pd(ok, _mm_cmplt_pd(_mm_and_pd(y, vmath_const(0x7FFFFFFFFFFFFFFFULL)), inf));
+	int bits = _mm_movemask_pd(ok) ^ 3;
+	if(bits) {
+		double xs[2], ys[2], rs[2];
+		_mm_storeu_pd(xs, x);
+		_mm_storeu_pd(ys, y);
+		_mm_storeu_pd(rs, r);
+		if(bits & 1) rs[0] = pow(xs[0], ys[0]);
+		if(bits & 2) rs[1] = pow(xs[1], ys[1]);
+		r = _mm_loadu_pd(rs);
+	}
+	return r;
+}
+
+#endif